@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Attach uwu_bpf.o to a device: "tc" at clsact egress, "xdp" on ingress.
+#
+#   uwu-bpf attach tc|xdp DEV
+#   uwu-bpf detach tc|xdp DEV
+#
+# UWU_BPF_OBJ overrides where the object is looked for.
+
+usage() {
+	echo "Usage: $0 attach|detach tc|xdp DEV" >&2
+	exit 1
+}
+
+OBJ=${UWU_BPF_OBJ:-}
+if [ -z "$OBJ" ]; then
+	for OBJ in "$(dirname "$0")/uwu_bpf.o" /usr/local/lib/bpf/uwu_bpf.o; do
+		[ -f "$OBJ" ] && break
+	done
+fi
+
+[ $# -eq 3 ] || usage
+DEV=$3
+
+case $1/$2 in
+attach/tc)
+	[ -f "$OBJ" ] || { echo "No uwu_bpf.o, run make first" >&2; exit 1; }
+	tc qdisc replace dev $DEV clsact &&
+	tc filter replace dev $DEV egress prio 1 handle 1 bpf da \
+		obj "$OBJ" sec tc
+	;;
+attach/xdp)
+	[ -f "$OBJ" ] || { echo "No uwu_bpf.o, run make first" >&2; exit 1; }
+	ip link set dev $DEV xdp obj "$OBJ" sec xdp.frags
+	;;
+detach/tc)
+	tc filter del dev $DEV egress prio 1 handle 1 bpf
+	;;
+detach/xdp)
+	ip link set dev $DEV xdp off
+	;;
+*)
+	usage
+	;;
+esac
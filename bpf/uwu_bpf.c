@@ -0,0 +1,379 @@
+/**
+ * uwu_bpf - uwu the application data at TC or XDP.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * The same transform as skb_uwu() in xt_UWU.c, for attaching to a clsact
+ * qdisc (egress, section "tc") or to XDP (ingress, section "xdp.frags",
+ * so multi-buffer frames are let in too). Every IPv4 TCP and UDP packet
+ * through the hook gets uwu'd.
+ *
+ * The payload is copied out in UWU_CHUNK byte pieces into a per-CPU
+ * buffer, transformed there and copied back only if something changed.
+ * That works the same for a linear XDP frame and for a 64k GSO skb with
+ * its payload in page frags, and the chunks are walked with bpf_loop() so
+ * the verifier only has to look at one of them. Chunks start at an even
+ * offset from the L4 header, which makes bpf_csum_diff() of the old and
+ * new bytes the checksum delta the kernel side keeps in xt_payload_csum.
+ *
+ * Needs bpf_loop() and bpf_xdp_load_bytes(), so Linux 5.18 or later.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/pkt_cls.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#define UWU_CHUNK	256
+
+/* from net/ip.h, which isn't uapi */
+#define IP_MF		0x2000
+#define IP_OFFSET	0x1fff
+
+/**
+ * The byte loop keeps its state here rather than in locals: what it reads
+ * back from a map value is an unknown scalar to the verifier, so the paths
+ * through each byte merge again instead of every count of bytes rewritten
+ * so far and every mode making a state of its own.
+ */
+struct uwu_buf {
+	__u8	from[UWU_CHUNK];
+	__u8	to[UWU_CHUNK];
+	__u32	mode;
+	__u32	rewritten;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct uwu_buf);
+} uwu_bufs SEC(".maps");
+
+/**
+ * The command word state carried across TCP segments, like xt_uwu_flow.h
+ * but keyed by the 4-tuple since there is no conntrack entry here. Only
+ * in-order segments pick it up, anything else starts afresh.
+ */
+struct uwu_flow_key {
+	__be32	saddr;
+	__be32	daddr;
+	__be16	sport;
+	__be16	dport;
+};
+
+struct uwu_flow {
+	__u32	next_seq;
+	__u32	mode;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+	__type(key, struct uwu_flow_key);
+	__type(value, struct uwu_flow);
+} uwu_flows SEC(".maps");
+
+enum {
+	UWU_STAT_PACKETS,
+	UWU_STAT_REWRITTEN,
+	UWU_STAT_BYTES,
+	UWU_STAT_ERRORS,
+	__UWU_STAT_MAX
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, __UWU_STAT_MAX);
+	__type(key, __u32);
+	__type(value, __u64);
+} uwu_stats SEC(".maps");
+
+struct uwu_walk {
+	void		*ctx;
+	/* first payload byte, chunks start at base <= start */
+	__u32		start;
+	__u32		base;
+	__u32		end;
+	__u32		mode;
+	__u32		csum;
+	__u32		rewritten;
+	int		err;
+};
+
+static __always_inline void uwu_stat_add(__u32 item, __u64 n)
+{
+	__u64 *v = bpf_map_lookup_elem(&uwu_stats, &item);
+
+	if (v)
+		*v += n;
+}
+
+static __always_inline long uwu_load(void *ctx, const bool xdp, __u32 off,
+		void *to, __u32 len)
+{
+	if (xdp)
+		return bpf_xdp_load_bytes(ctx, off, to, len);
+	return bpf_skb_load_bytes(ctx, off, to, len);
+}
+
+static __always_inline long uwu_store(void *ctx, const bool xdp, __u32 off,
+		void *from, __u32 len)
+{
+	if (xdp)
+		return bpf_xdp_store_bytes(ctx, off, from, len);
+	/* keeps skb->csum right on a CHECKSUM_COMPLETE skb */
+	return bpf_skb_store_bytes(ctx, off, from, len, BPF_F_RECOMPUTE_CSUM);
+}
+
+/* uwu_map[] and uwu_class[] of xt_UWU.c, spelt out */
+static __always_inline __u8 uwu_map(__u8 c)
+{
+	switch (c) {
+	case 'l':
+	case 'r':
+		return 'w';
+	case 'L':
+	case 'R':
+		return 'W';
+	}
+	return c;
+}
+
+static __always_inline long uwu_chunk(__u32 i, struct uwu_walk *w,
+		const bool xdp)
+{
+	__u32 key = 0, off = w->base + i * UWU_CHUNK, len, sz, j;
+	struct uwu_buf *buf = bpf_map_lookup_elem(&uwu_bufs, &key);
+	__s64 csum;
+
+	if (!buf || off >= w->end)
+		return 1;
+	len = w->end - off;
+	if (len > UWU_CHUNK)
+		len = UWU_CHUNK;
+	/* no-op for 1..UWU_CHUNK, but lets the verifier see len >= 1 */
+	len = ((len - 1) & (UWU_CHUNK - 1)) + 1;
+	if (uwu_load(w->ctx, xdp, off, buf->from, len))
+		goto err;
+
+	buf->mode = w->mode;
+	buf->rewritten = 0;
+	for (j = 0; j < UWU_CHUNK; j++) {
+		__u8 c = buf->from[j];
+
+		if (j >= len)
+			break;
+		buf->to[j] = c;
+		if (off + j < w->start)
+			continue;
+		if (buf->mode) {
+			if (c == '\n') {
+				buf->mode = 0;
+			} else if (uwu_map(c) != c) {
+				buf->to[j] = uwu_map(c);
+				buf->rewritten++;
+			}
+		} else if (c < 'A' || c > 'Z') {
+			buf->mode = 1;
+		}
+	}
+	w->mode = buf->mode;
+	if (!buf->rewritten)
+		return 0;
+
+	if (uwu_store(w->ctx, xdp, off, buf->to, len))
+		goto err;
+
+	/* bpf_csum_diff() wants whole words, pad both sides with zeroes */
+	sz = (len + 3) & ~3;
+	for (j = len; j < sz && j < UWU_CHUNK; j++)
+		buf->from[j] = buf->to[j] = 0;
+	sz &= UWU_CHUNK * 2 - 1;
+	if (sz > UWU_CHUNK)
+		goto err;
+	csum = bpf_csum_diff((__be32 *)buf->from, sz, (__be32 *)buf->to, sz,
+			     w->csum);
+	if (csum < 0)
+		goto err;
+	w->csum = csum;
+	w->rewritten += buf->rewritten;
+
+	return 0;
+err:
+	w->err = 1;
+	return 1;
+}
+
+static long uwu_chunk_skb(__u32 i, void *data)
+{
+	return uwu_chunk(i, data, false);
+}
+
+static long uwu_chunk_xdp(__u32 i, void *data)
+{
+	return uwu_chunk(i, data, true);
+}
+
+static __always_inline __u16 uwu_csum_fold(__u32 csum)
+{
+	csum = (csum & 0xffff) + (csum >> 16);
+	csum = (csum & 0xffff) + (csum >> 16);
+
+	return ~csum;
+}
+
+/**
+ * Returns 0 to let the packet through, -1 to drop it: the payload may be
+ * half rewritten by then and the checksum would be wrong.
+ */
+static __always_inline int uwu_packet(void *ctx, __u32 len, const bool xdp)
+{
+	struct uwu_walk w = { .ctx = ctx };
+	struct uwu_flow_key fkey = {};
+	struct uwu_flow *flow = NULL;
+	__u32 thoff, check, seq = 0;
+	struct ethhdr eth;
+	struct iphdr iph;
+	bool udp;
+
+	if (uwu_load(ctx, xdp, 0, &eth, sizeof(eth)) ||
+	    eth.h_proto != bpf_htons(ETH_P_IP))
+		return 0;
+	if (uwu_load(ctx, xdp, sizeof(eth), &iph, sizeof(iph)) ||
+	    iph.ihl < 5)
+		return 0;
+	if (iph.frag_off & bpf_htons(IP_MF | IP_OFFSET))
+		return 0;
+	thoff = sizeof(eth) + iph.ihl * 4;
+
+	if (iph.protocol == IPPROTO_TCP) {
+		struct tcphdr tcph;
+
+		if (uwu_load(ctx, xdp, thoff, &tcph, sizeof(tcph)))
+			return 0;
+		w.start = thoff + tcph.doff * 4;
+		check = thoff + offsetof(struct tcphdr, check);
+		seq = bpf_ntohl(tcph.seq);
+		fkey.sport = tcph.source;
+		fkey.dport = tcph.dest;
+	} else if (iph.protocol == IPPROTO_UDP) {
+		w.start = thoff + sizeof(struct udphdr);
+		check = thoff + offsetof(struct udphdr, check);
+	} else {
+		return 0;
+	}
+	udp = iph.protocol == IPPROTO_UDP;
+	/* tot_len is 0 on a BIG TCP GSO packet */
+	w.end = sizeof(eth) + bpf_ntohs(iph.tot_len);
+	if (!iph.tot_len || w.end > len)
+		w.end = len;
+	if (w.start >= w.end)
+		return 0;
+	w.base = w.start - ((w.start - thoff) & 1);
+
+	uwu_stat_add(UWU_STAT_PACKETS, 1);
+	if (!udp) {
+		fkey.saddr = iph.saddr;
+		fkey.daddr = iph.daddr;
+		flow = bpf_map_lookup_elem(&uwu_flows, &fkey);
+		if (flow && flow->next_seq == seq)
+			w.mode = flow->mode;
+	}
+
+	bpf_loop((w.end - w.base + UWU_CHUNK - 1) / UWU_CHUNK,
+		 xdp ? uwu_chunk_xdp : uwu_chunk_skb, &w, 0);
+	if (w.err) {
+		uwu_stat_add(UWU_STAT_ERRORS, 1);
+		return -1;
+	}
+
+	if (!udp) {
+		struct uwu_flow next = {
+			.next_seq	= seq + w.end - w.start,
+			.mode		= w.mode,
+		};
+
+		if (flow)
+			*flow = next;
+		else
+			bpf_map_update_elem(&uwu_flows, &fkey, &next, BPF_ANY);
+	}
+	if (!w.rewritten)
+		return 0;
+	uwu_stat_add(UWU_STAT_REWRITTEN, 1);
+	uwu_stat_add(UWU_STAT_BYTES, w.rewritten);
+
+	if (!xdp) {
+		__u16 sum;
+
+		/* a zero UDP checksum stays zero, a zero result becomes -0 */
+		if (uwu_load(ctx, xdp, check, &sum, sizeof(sum)))
+			return -1;
+		if (udp && !sum)
+			return 0;
+		if (bpf_l4_csum_replace(ctx, check, 0, w.csum,
+					udp ? BPF_F_MARK_MANGLED_0 : 0))
+			return -1;
+		/**
+		 * The stores added the payload change to a CHECKSUM_COMPLETE
+		 * skb->csum, and the L4 checksum just moved by as much the
+		 * other way, which that doesn't account for.
+		 */
+		bpf_csum_update(ctx, ~w.csum);
+	} else {
+		__u16 sum;
+		__u32 csum;
+
+		if (uwu_load(ctx, xdp, check, &sum, sizeof(sum)))
+			return -1;
+		if (udp && !sum)
+			return 0;
+		csum = ~(__u32)sum;
+		csum += w.csum;
+		csum += csum < w.csum;
+		sum = uwu_csum_fold(csum);
+		if (udp && !sum)
+			sum = 0xffff;
+		if (uwu_store(ctx, xdp, check, &sum, sizeof(sum)))
+			return -1;
+	}
+
+	return 0;
+}
+
+SEC("tc")
+int uwu_tc(struct __sk_buff *skb)
+{
+	return uwu_packet(skb, skb->len, false) ? TC_ACT_SHOT : TC_ACT_OK;
+}
+
+SEC("xdp.frags")
+int uwu_xdp(struct xdp_md *xdp)
+{
+	return uwu_packet(xdp, bpf_xdp_get_buff_len(xdp), true) ? XDP_DROP : XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
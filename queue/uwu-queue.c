@@ -0,0 +1,816 @@
+/**
+ * uwu-queue - uwu or XOR packets handed to userspace with NFQUEUE.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * The same transforms as the targets, with the byte kernels of
+ * uwu_core.h and xor_core.h, for packets a -j NFQUEUE rule sends here
+ * rather than to xt_UWU.ko. One thread per queue, pinned to a CPU of its
+ * own, so --queue-balance with --queue-cpu-fanout keeps every packet on
+ * the CPU it was queued on. Each thread reads up to -b packets per
+ * recvmmsg() and answers all of them with one sendmsg(): the packets it
+ * changed each get a verdict carrying the new data, pointed at where it
+ * was received, and a single batch verdict accepts everything else.
+ *
+ * The queues are set up with NFQA_CFG_F_GSO, so GSO packets come up whole
+ * and get transformed once, like the targets do. Every packet starts the
+ * IRC command word rule afresh and is checked for binary data on its own,
+ * as xt_UWU does with flow_slots=0.
+ *
+ * Talks nfnetlink directly, like nft-payload. Has to be built with
+ * -mgeneral-regs-only for the vector kernels, see xt_payload_core.h.
+ */
+
+#define _GNU_SOURCE
+
+#include "uwu_core.h"
+#include "xor_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+
+#define die(fmt, args...) \
+do { \
+	fprintf(stderr, fmt "\n", ##args); \
+	exit(EXIT_FAILURE); \
+} while (0)
+
+#define fail(fmt, args...) die("Failed to " fmt, ##args)
+
+#define MAX_QUEUES	256
+#define MAX_BATCH	256
+/* a GSO packet of up to 64k and the netlink headers around it */
+#define BUF_SIZE	(65536 + 4096)
+#define SOCK_BUF	(64 << 20)
+
+/* what goes in front of the packet data of a verdict that changes it */
+struct verdict_hdr {
+	struct nlmsghdr			nlh;
+	struct nfgenmsg			nfg;
+	struct nlattr			vattr;
+	struct nfqnl_msg_verdict_hdr	vhdr;
+	struct nlattr			pattr;
+};
+
+struct worker {
+	pthread_t			thread;
+	unsigned int			queue;
+	int				cpu;
+	int				sock;
+	unsigned int			send_max;
+
+	u8				*bufs;
+	struct mmsghdr			msgs[MAX_BATCH];
+	struct iovec			iovs[MAX_BATCH];
+	struct verdict_hdr		hdrs[MAX_BATCH + 1];
+	struct iovec			out[MAX_BATCH * 3 + 1];
+	unsigned int			nr_out;
+	unsigned int			out_len;
+
+	unsigned long long		packets;
+	unsigned long long		mangled;
+	unsigned long long		binary;
+	unsigned long long		bytes;
+	unsigned long long		recvs;
+	unsigned long long		sends;
+	unsigned long long		errors;
+};
+
+enum {
+	MODE_UWU,
+	MODE_XOR,
+};
+
+static int mode = MODE_UWU;
+static const struct uwu_impl *impl;
+static struct xor_keystream ks;
+static bool skip_binary = true;
+static unsigned int batch = 64;
+static volatile sig_atomic_t stop;
+
+static void usage(const char *argv0, int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+"Usage: %s [OPTIONS]\n"
+"\n"
+"uwus or XORs what NFQUEUE rules queue, with one thread per queue, until\n"
+"-d or ^C, then prints what each thread did. For instance:\n"
+"\n"
+"  iptables -t mangle -A OUTPUT -p tcp --dport 6667 -j NFQUEUE \\\n"
+"          --queue-balance 0:3 --queue-cpu-fanout --queue-bypass\n"
+"  %s -q 0:3\n"
+"\n"
+"Options:\n"
+"  -a  uwu binary payloads too\n"
+"  -b  packets per recvmmsg() and verdicts per sendmsg(), 64 by default\n"
+"  -d  stop after this many seconds\n"
+"  -h  show this message\n"
+"  -i  uwu transform variant, the fastest one by default\n"
+"  -k  XOR with key instead of uwu'ing (implies -m xor)\n"
+"  -m  uwu (default) or xor\n"
+"  -q  first:last queue, the same as --queue-balance, by default 0 up to\n"
+"      one per CPU. Queue first + i is read by a thread on CPU i\n"
+"  -x  the XOR key is in hex\n",
+		argv0, argv0);
+	exit(error_code);
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define BENCH_SIZE	4096
+#define BENCH_LOOPS	64
+
+/* See uwu_select_impl() in xt_UWU.c */
+static const struct uwu_impl *select_impl(const char *name)
+{
+	static const char text[] = "PRIVMSG #lobby :hello world, are rollers rare?\n";
+	static u8 src[BENCH_SIZE], buf[BENCH_SIZE];
+	const struct uwu_impl *best = NULL;
+	u64 best_ns = UINT64_MAX, t;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(uwu_impls); i++) {
+		if (uwu_impls[i].valid && !uwu_impls[i].valid())
+			continue;
+		if (name && !strcmp(name, uwu_impls[i].name))
+			return &uwu_impls[i];
+	}
+	if (name)
+		die("Transform variant %s is not available", name);
+
+	for (i = 0; i < BENCH_SIZE; i++)
+		src[i] = text[i % (sizeof(text) - 1)];
+	for (i = 0; i < ARRAY_SIZE(uwu_impls); i++) {
+		if (uwu_impls[i].valid && !uwu_impls[i].valid())
+			continue;
+		t = now_ns();
+		for (j = 0; j < BENCH_LOOPS; j++) {
+			struct uwu_state st = { .uwu_mode = 1 };
+
+			memcpy(buf, src, BENCH_SIZE);
+			uwu_impls[i].transform(&st, buf, BENCH_SIZE);
+		}
+		t = now_ns() - t;
+		if (t < best_ns) {
+			best_ns = t;
+			best = &uwu_impls[i];
+		}
+	}
+
+	return best;
+}
+
+static int hex2bin(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else
+		return c - 'A' + 10;
+}
+
+static unsigned int parse_key(const char *arg, int hex, u8 *key)
+{
+	unsigned int len = strlen(arg), i;
+
+	if (len == 0)
+		die("KEY must not be empty");
+	if (!hex) {
+		if (len > XOR_MAX_KEY_LEN)
+			die("KEY is too long");
+		memcpy(key, arg, len);
+		return len;
+	}
+
+	if (len > XOR_MAX_KEY_LEN * 2)
+		die("KEY is too long");
+	if (len % 2 != 0)
+		die("Odd number of hex digits");
+	len /= 2;
+	for (i = 0; i < len; i++) {
+		if (!isxdigit(arg[i * 2]) || !isxdigit(arg[i * 2 + 1]))
+			die("Invalid hex char");
+		key[i] = (hex2bin(arg[i * 2]) << 4) | hex2bin(arg[i * 2 + 1]);
+	}
+
+	return len;
+}
+
+/* The ones' complement sum of len bytes as big endian 16 bit words */
+static u64 csum_bytes(const u8 *p, unsigned int len)
+{
+	u64 sum = 0;
+
+	for (; len >= 2; p += 2, len -= 2)
+		sum += (u32)p[0] << 8 | p[1];
+	if (len)
+		sum += (u32)p[0] << 8;
+
+	return sum;
+}
+
+/**
+ * Fix the L4 checksum at check up for the payload changes in csum. A
+ * complete one gets patched in O(1), as xt_payload_csum_update() does.
+ * One left to the device (NFQA_SKB_CSUMNOTREADY) only holds the pseudo
+ * header sum, but nfnetlink_queue marks a packet it copies new data into
+ * CHECKSUM_NONE, so it has to be summed in full here. That goes for GSO
+ * packets too: veth and lo hand them on whole to a receiver that then
+ * checks the sum, and TCP segmentation sets the field up anew.
+ */
+static void queue_csum(const u8 *l4, unsigned int len, u16 *check,
+		const struct xt_payload_csum *csum, bool udp, u32 info)
+{
+	u16 sum;
+
+	/* a zero UDP checksum means the sender didn't compute one */
+	if (udp && !*check)
+		return;
+	if (info & NFQA_SKB_CSUMNOTREADY) {
+		sum = ~xt_payload_csum_fold16(csum_bytes(l4, len));
+	} else {
+		sum = ~xt_payload_csum_fold16((u16)~ntohs(*check) +
+				xt_payload_csum_fold16(csum->to) +
+				(u16)~xt_payload_csum_fold16(csum->from));
+	}
+	if (udp && !sum)
+		sum = 0xffff;
+	*check = htons(sum);
+}
+
+/**
+ * Transform the payload of the IPv4 packet at pkt in place. Returns true
+ * if it changed.
+ */
+static bool queue_mangle(struct worker *w, u8 *pkt, unsigned int len,
+		u32 info)
+{
+	struct iphdr *iph = (struct iphdr *)pkt;
+	unsigned int ihl, thlen, plen;
+	struct xt_payload_csum csum;
+	struct tcphdr *th;
+	struct udphdr *uh;
+	u16 *check;
+	u8 *p;
+
+	if (len < sizeof(*iph) || iph->version != 4)
+		return false;
+	ihl = iph->ihl * 4;
+	/**
+	 * Only the first 64k of a bigger GSO packet (tot_len 0) come up, and
+	 * a verdict with less data than the packet had would cut it short.
+	 */
+	if (ihl < sizeof(*iph) || ntohs(iph->tot_len) < ihl ||
+	    ntohs(iph->tot_len) > len)
+		return false;
+	if (ntohs(iph->frag_off) & (IP_MF | IP_OFFMASK))
+		return false;
+	len = ntohs(iph->tot_len) - ihl;
+
+	switch (iph->protocol) {
+	case IPPROTO_TCP:
+		th = (struct tcphdr *)(pkt + ihl);
+		if (len < sizeof(*th) || th->doff * 4 < sizeof(*th) ||
+		    th->doff * 4 > len)
+			return false;
+		thlen = th->doff * 4;
+		check = &th->check;
+		break;
+	case IPPROTO_UDP:
+		uh = (struct udphdr *)(pkt + ihl);
+		if (len < sizeof(*uh))
+			return false;
+		thlen = sizeof(*uh);
+		check = &uh->check;
+		break;
+	default:
+		return false;
+	}
+	p = pkt + ihl + thlen;
+	plen = len - thlen;
+	if (!plen)
+		return false;
+
+	if (mode == MODE_UWU) {
+		struct uwu_state st = { .uwu_mode = 0 };
+
+		if (skip_binary && uwu_classify(p, plen) == UWU_CLASS_BINARY) {
+			w->binary++;
+			return false;
+		}
+		impl->transform(&st, p, plen);
+		if (!st.rewritten)
+			return false;
+		csum = st.csum;
+		w->bytes += st.rewritten;
+	} else {
+		struct xor_walk xw = { .ks = &ks };
+
+		xor_transform(&xw, p, plen, 0);
+		csum = xw.csum;
+		w->bytes += plen;
+	}
+	queue_csum(pkt + ihl, len, check, &csum, iph->protocol == IPPROTO_UDP,
+		   info);
+
+	return true;
+}
+
+static void verdict_hdr_init(struct verdict_hdr *h, unsigned int type,
+		unsigned int queue, u32 id, unsigned int len)
+{
+	memset(h, 0, sizeof(*h));
+	h->nlh.nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+	h->nlh.nlmsg_flags = NLM_F_REQUEST;
+	h->nfg.nfgen_family = AF_UNSPEC;
+	h->nfg.version = NFNETLINK_V0;
+	h->nfg.res_id = htons(queue);
+	h->vattr.nla_type = NFQA_VERDICT_HDR;
+	h->vattr.nla_len = NLA_HDRLEN + sizeof(h->vhdr);
+	h->vhdr.verdict = htonl(NF_ACCEPT);
+	h->vhdr.id = htonl(id);
+	h->pattr.nla_type = NFQA_PAYLOAD;
+	h->pattr.nla_len = NLA_HDRLEN + len;
+	h->nlh.nlmsg_len = sizeof(*h) + len;
+}
+
+static void queue_flush(struct worker *w)
+{
+	struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+	struct msghdr msg = {
+		.msg_name	= &snl,
+		.msg_namelen	= sizeof(snl),
+		.msg_iov	= w->out,
+		.msg_iovlen	= w->nr_out,
+	};
+
+	if (!w->nr_out)
+		return;
+	if (sendmsg(w->sock, &msg, 0) < 0)
+		w->errors++;
+	w->sends++;
+	w->nr_out = 0;
+	w->out_len = 0;
+}
+
+/* A verdict carrying the new data of packet id, which stays where it is */
+static void queue_put_verdict(struct worker *w, struct verdict_hdr *h,
+		u32 id, u8 *data, unsigned int len)
+{
+	static u8 pad[NLA_ALIGNTO];
+	unsigned int size = sizeof(*h) + NLA_ALIGN(len);
+
+	if (w->out_len + size > w->send_max)
+		queue_flush(w);
+	verdict_hdr_init(h, NFQNL_MSG_VERDICT, w->queue, id, len);
+	w->out[w->nr_out++] = (struct iovec){ h, sizeof(*h) };
+	w->out[w->nr_out++] = (struct iovec){ data, len };
+	if (NLA_ALIGN(len) != len)
+		w->out[w->nr_out++] = (struct iovec){ pad,
+						       NLA_ALIGN(len) - len };
+	w->out_len += size;
+}
+
+/* Accepts every packet up to id that didn't get a verdict of its own yet */
+static void queue_put_batch(struct worker *w, struct verdict_hdr *h, u32 id)
+{
+	unsigned int size = offsetof(struct verdict_hdr, pattr);
+
+	verdict_hdr_init(h, NFQNL_MSG_VERDICT_BATCH, w->queue, id, 0);
+	h->nlh.nlmsg_len = size;
+	w->out[w->nr_out++] = (struct iovec){ h, size };
+	w->out_len += size;
+}
+
+/**
+ * The packets in what one recvmmsg() slot got, which nfnetlink_queue sends
+ * one at a time. The changed ones get their verdict right away, the rest
+ * are left for the batch verdict: returns how many, the highest id of them
+ * in *last. A batch verdict that finds nothing to accept fails, so it is
+ * only sent for those.
+ */
+static unsigned int queue_handle(struct worker *w, u8 *buf, int len,
+		unsigned int *nr_hdrs, u32 *last)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	unsigned int n = 0;
+
+	for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		struct nfqnl_msg_packet_hdr *ph = NULL;
+		u8 *data = NULL;
+		unsigned int data_len = 0, attrlen;
+		struct nlattr *nla;
+		u32 info = 0, id;
+
+		if (nlh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+			if (err->error)
+				w->errors++;
+			continue;
+		}
+		if (nlh->nlmsg_type !=
+		    ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET))
+			continue;
+
+		nla = (struct nlattr *)((u8 *)NLMSG_DATA(nlh) +
+					NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+		attrlen = nlh->nlmsg_len - ((u8 *)nla - (u8 *)nlh);
+		while (attrlen >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+		       nla->nla_len <= attrlen) {
+			void *val = (u8 *)nla + NLA_HDRLEN;
+
+			switch (nla->nla_type & NLA_TYPE_MASK) {
+			case NFQA_PACKET_HDR:
+				ph = val;
+				break;
+			case NFQA_PAYLOAD:
+				data = val;
+				data_len = nla->nla_len - NLA_HDRLEN;
+				break;
+			case NFQA_SKB_INFO:
+				info = ntohl(*(u32 *)val);
+				break;
+			}
+			if (NLA_ALIGN(nla->nla_len) >= attrlen)
+				break;
+			attrlen -= NLA_ALIGN(nla->nla_len);
+			nla = (struct nlattr *)((u8 *)nla +
+						NLA_ALIGN(nla->nla_len));
+		}
+		if (!ph)
+			continue;
+
+		id = ntohl(ph->packet_id);
+		w->packets++;
+		if (data && queue_mangle(w, data, data_len, info)) {
+			w->mangled++;
+			if (*nr_hdrs == MAX_BATCH) {
+				queue_flush(w);
+				*nr_hdrs = 0;
+			}
+			queue_put_verdict(w, &w->hdrs[(*nr_hdrs)++], id, data,
+					  data_len);
+			continue;
+		}
+		if (!n || id > *last)
+			*last = id;
+		n++;
+	}
+
+	return n;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int i, n, nr_hdrs, pending;
+	cpu_set_t cpus;
+	u32 last, id = 0;
+	int ret;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	for (i = 0; i < batch; i++) {
+		w->iovs[i].iov_base = w->bufs + (size_t)i * BUF_SIZE;
+		w->iovs[i].iov_len = BUF_SIZE;
+		w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+		w->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!stop) {
+		ret = recvmmsg(w->sock, w->msgs, batch, MSG_WAITFORONE, NULL);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/* the socket overflowed, fail-open let them through */
+			if (errno == ENOBUFS) {
+				w->errors++;
+				continue;
+			}
+			fail("receive from queue %u: %s", w->queue,
+			     strerror(errno));
+		}
+		w->recvs++;
+
+		nr_hdrs = 0;
+		pending = 0;
+		last = 0;
+		for (i = 0; i < (unsigned int)ret; i++) {
+			n = queue_handle(w, w->bufs + (size_t)i * BUF_SIZE,
+					 w->msgs[i].msg_len, &nr_hdrs, &id);
+			if (n && (!pending || id > last))
+				last = id;
+			pending += n;
+		}
+		if (pending)
+			queue_put_batch(w, &w->hdrs[nr_hdrs], last);
+		queue_flush(w);
+	}
+
+	return NULL;
+}
+
+/**
+ * Send the config messages in m and wait for their acks. A packet that
+ * gets queued in the meantime is let through.
+ */
+static void queue_config_send(int sock, unsigned int queue, const u8 *m,
+		unsigned int len, unsigned int nr_msgs)
+{
+	struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+	static u8 buf[BUF_SIZE];
+	struct nlmsghdr *nlh;
+	struct verdict_hdr h;
+	ssize_t n;
+
+	if (sendto(sock, m, len, 0, (struct sockaddr *)&snl, sizeof(snl)) < 0)
+		fail("configure queue %u: %s", queue, strerror(errno));
+	while (nr_msgs) {
+		n = recv(sock, buf, sizeof(buf), 0);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n < 0)
+			fail("configure queue %u: %s", queue, strerror(errno));
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n);
+		     nlh = NLMSG_NEXT(nlh, n)) {
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+				if (err->error)
+					fail("configure queue %u: %s", queue,
+					     strerror(-err->error));
+				nr_msgs--;
+				continue;
+			}
+			if (nlh->nlmsg_type !=
+			    ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET))
+				continue;
+			/* accepts every packet queued so far */
+			verdict_hdr_init(&h, NFQNL_MSG_VERDICT_BATCH, queue,
+					 ~0U, 0);
+			h.nlh.nlmsg_len = offsetof(struct verdict_hdr, pattr);
+			sendto(sock, &h, h.nlh.nlmsg_len, 0,
+			       (struct sockaddr *)&snl, sizeof(snl));
+		}
+	}
+}
+
+static unsigned int msg_put(u8 *m, unsigned int off, unsigned int type,
+		unsigned int queue, const struct nlattr *attrs, unsigned int len)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(m + off);
+	struct nfgenmsg *nfg = NLMSG_DATA(nlh);
+
+	memset(nlh, 0, NLMSG_SPACE(sizeof(*nfg)));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*nfg)) + len;
+	nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nfg->nfgen_family = AF_UNSPEC;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(queue);
+	memcpy((u8 *)nfg + NLMSG_ALIGN(sizeof(*nfg)), attrs, len);
+
+	return off + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/* Bind the socket of w to its queue, copying whole packets, GSO and all */
+static void queue_open(struct worker *w)
+{
+	struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+	struct timeval tv = { .tv_usec = 100000 };
+	struct {
+		struct nlattr			nla;
+		struct nfqnl_msg_config_cmd	cmd;
+	} bind_cmd = {
+		{ NLA_HDRLEN + sizeof(bind_cmd.cmd), NFQA_CFG_CMD },
+		{ .command = NFQNL_CFG_CMD_BIND, .pf = htons(AF_INET) },
+	};
+	/* laid out the way the attributes are, params is packed */
+	struct {
+		struct nlattr			nla;
+		struct nfqnl_msg_config_params	params;
+		u8				pad[3];
+		struct nlattr			mask_nla;
+		u32				mask;
+		struct nlattr			flags_nla;
+		u32				flags;
+	} params = {
+		{ NLA_HDRLEN + sizeof(params.params), NFQA_CFG_PARAMS },
+		{ .copy_range = htonl(0xffff), .copy_mode = NFQNL_COPY_PACKET },
+		{ 0 },
+		{ NLA_HDRLEN + sizeof(u32), NFQA_CFG_MASK },
+		htonl(NFQA_CFG_F_GSO | NFQA_CFG_F_FAIL_OPEN),
+		{ NLA_HDRLEN + sizeof(u32), NFQA_CFG_FLAGS },
+		htonl(NFQA_CFG_F_GSO | NFQA_CFG_F_FAIL_OPEN),
+	};
+	socklen_t optlen = sizeof(int);
+	int one = 1, size = SOCK_BUF;
+	u8 m[256];
+	unsigned int len;
+
+	w->sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			 NETLINK_NETFILTER);
+	if (w->sock < 0)
+		fail("open netlink socket: %s", strerror(errno));
+	if (bind(w->sock, (struct sockaddr *)&snl, sizeof(snl)) < 0)
+		fail("bind netlink socket: %s", strerror(errno));
+	if (setsockopt(w->sock, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+		       sizeof(size)) < 0)
+		setsockopt(w->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (setsockopt(w->sock, SOL_SOCKET, SO_SNDBUFFORCE, &size,
+		       sizeof(size)) < 0)
+		setsockopt(w->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	/* the kernel doubles it, and keeps a bit for itself */
+	if (getsockopt(w->sock, SOL_SOCKET, SO_SNDBUF, &size, &optlen) < 0)
+		fail("get the send buffer size: %s", strerror(errno));
+	w->send_max = size / 2 - 1024;
+	if (w->send_max < BUF_SIZE)
+		die("Send buffer of %d bytes is too small", size);
+	setsockopt(w->sock, SOL_NETLINK, NETLINK_NO_ENOBUFS, &one,
+		   sizeof(one));
+	setsockopt(w->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	len = msg_put(m, 0, NFQNL_MSG_CONFIG, w->queue,
+		      (struct nlattr *)&bind_cmd, sizeof(bind_cmd));
+	len = msg_put(m, len, NFQNL_MSG_CONFIG, w->queue,
+		      (struct nlattr *)&params, sizeof(params));
+	queue_config_send(w->sock, w->queue, m, len, 2);
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int first = 0, nr = 0, last, i, key_len = 0, seconds = 0;
+	unsigned long long packets = 0, syscalls = 0;
+	const char *impl_name = NULL, *key = NULL;
+	struct sigaction sa = { .sa_handler = on_signal };
+	static struct worker workers[MAX_QUEUES];
+	int opt, hex = 0, ncpu;
+	u8 key_bytes[XOR_MAX_KEY_LEN];
+	char *end;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "ab:d:hi:k:m:q:x")) != -1) {
+		switch (opt) {
+		case 'a':
+			skip_binary = false;
+			break;
+		case 'b':
+			batch = strtoul(optarg, &end, 0);
+			if (*end || !batch || batch > MAX_BATCH)
+				die("Batch is 1 to %d packets", MAX_BATCH);
+			break;
+		case 'd':
+			seconds = strtoul(optarg, &end, 0);
+			if (*end)
+				die("Bad duration %s", optarg);
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		case 'i':
+			impl_name = optarg;
+			break;
+		case 'k':
+			key = optarg;
+			mode = MODE_XOR;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "uwu"))
+				mode = MODE_UWU;
+			else if (!strcmp(optarg, "xor"))
+				mode = MODE_XOR;
+			else
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'q':
+			if (sscanf(optarg, "%u:%u", &first, &last) != 2 ||
+			    last < first || last - first >= MAX_QUEUES ||
+			    last > 65535)
+				die("Bad queue range %s", optarg);
+			nr = last - first + 1;
+			break;
+		case 'x':
+			hex = 1;
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0], EXIT_FAILURE);
+	if (mode == MODE_XOR) {
+		if (!key)
+			die("-m xor needs a key, see -k");
+		key_len = parse_key(key, hex, key_bytes);
+		xor_keystream_init(&ks, key_bytes, key_len);
+	}
+	if (!nr)
+		nr = ncpu < MAX_QUEUES ? ncpu : MAX_QUEUES;
+
+	uwu_tables_init();
+	impl = select_impl(impl_name);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct worker *w = &workers[i];
+
+		w->queue = first + i;
+		w->cpu = i % ncpu;
+		w->bufs = malloc((size_t)batch * BUF_SIZE);
+		if (!w->bufs)
+			fail("allocate buffers: %s", strerror(errno));
+		queue_open(w);
+	}
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run,
+				   &workers[i]))
+			fail("start thread %u", i);
+	}
+	fprintf(stderr, "%s on queues %u:%u with the %s transform\n",
+		mode == MODE_UWU ? "uwu" : "xor", first, first + nr - 1,
+		impl->name);
+
+	if (seconds) {
+		/* a signal cuts it short */
+		sleep(seconds);
+		stop = 1;
+	} else {
+		while (!stop)
+			pause();
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		close(w->sock);
+		printf("queue %u cpu %d: %llu packets %llu mangled "
+		       "%llu binary %llu bytes %llu recvmmsg %llu sendmsg "
+		       "%llu errors\n", w->queue, w->cpu, w->packets,
+		       w->mangled, w->binary, w->bytes, w->recvs, w->sends,
+		       w->errors);
+		packets += w->packets;
+		syscalls += w->recvs + w->sends;
+		free(w->bufs);
+	}
+	/* hundredths, without the floating point the build doesn't allow */
+	if (syscalls)
+		printf("total: %llu packets, %llu.%02llu per syscall\n",
+		       packets, packets / syscalls,
+		       packets * 100 / syscalls % 100);
+
+	return EXIT_SUCCESS;
+}
@@ -24,46 +24,513 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* after xtables.h, so that its ARRAY_SIZE is the one in use */
+#include "uwu_phrase.h"
+
+enum {
+	O_UWU_OFFSET = 0,
+	O_UWU_MAX_BYTES,
+	O_UWU_MIN_LEN,
+	O_UWU_MAX_LEN,
+	O_UWU_MAP,
+	O_UWU_PHRASE,
+	O_UWU_XOR_KEY,
+	O_UWU_XOR_HEX_KEY,
+	O_UWU_CONF,
+	O_UWU_BUDGET,
+	O_UWU_BUDGET_BURST,
+	O_UWU_BUDGET_CUT,
+	F_UWU_XOR_KEY     = 1 << O_UWU_XOR_KEY,
+	F_UWU_XOR_HEX_KEY = 1 << O_UWU_XOR_HEX_KEY,
+	F_UWU_CONF        = 1 << O_UWU_CONF,
+	F_UWU_BUDGET      = 1 << O_UWU_BUDGET,
+};
 
 #define s struct xt_uwu_info
 static const struct xt_option_entry uwu_opts[] = {
+	{.name = "uwu-offset", .id = O_UWU_OFFSET, .type = XTTYPE_UINT32,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, offset)},
+	{.name = "uwu-max-bytes", .id = O_UWU_MAX_BYTES, .type = XTTYPE_UINT32,
+	 .min = 1, .flags = XTOPT_PUT, XTOPT_POINTER(s, max_bytes)},
+	{.name = "uwu-min-len", .id = O_UWU_MIN_LEN, .type = XTTYPE_UINT32,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, min_len)},
+	{.name = "uwu-max-len", .id = O_UWU_MAX_LEN, .type = XTTYPE_UINT32,
+	 .min = 1, .flags = XTOPT_PUT, XTOPT_POINTER(s, max_len)},
+	{.name = "uwu-map", .id = O_UWU_MAP, .type = XTTYPE_STRING},
+	{.name = "uwu-phrase", .id = O_UWU_PHRASE, .type = XTTYPE_STRING},
+	{.name = "then-xor-key", .id = O_UWU_XOR_KEY, .type = XTTYPE_STRING,
+	 .min = 1, .max = sizeof(((s *)NULL)->xor_key),
+	 .excl = F_UWU_XOR_HEX_KEY},
+	{.name = "then-xor-hex-key", .id = O_UWU_XOR_HEX_KEY,
+	 .type = XTTYPE_STRING, .excl = F_UWU_XOR_KEY},
+	{.name = "uwu-conf", .id = O_UWU_CONF, .type = XTTYPE_STRING,
+	 .min = 1, .max = XT_PAYLOAD_CONF_NAME - 1,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, conf)},
+	{.name = "uwu-budget", .id = O_UWU_BUDGET, .type = XTTYPE_UINT32,
+	 .min = 1, .flags = XTOPT_PUT, XTOPT_POINTER(s, budget_rate)},
+	{.name = "uwu-budget-burst", .id = O_UWU_BUDGET_BURST,
+	 .type = XTTYPE_UINT32, .min = 1, .also = F_UWU_BUDGET,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, budget_burst)},
+	{.name = "uwu-budget-cut", .id = O_UWU_BUDGET_CUT, .type = XTTYPE_NONE,
+	 .also = F_UWU_BUDGET},
 	XTOPT_TABLEEND,
 };
 #undef s
 
+/* --uwu-map names, each short for a FROM:TO */
+static const struct {
+	const char	*name;
+	const char	*spec;
+} uwu_presets[] = {
+	{ "uwu", "lrLR:wwWW" },
+	{ "leet", "aeiostAEIOST:431057431057" },
+	{ "rot13", "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ:"
+		   "nopqrstuvwxyzabcdefghijklmNOPQRSTUVWXYZABCDEFGHIJKLM" },
+	{ "shout", "abcdefghijklmnopqrstuvwxyz:ABCDEFGHIJKLMNOPQRSTUVWXYZ" },
+	{ "none", "" },
+};
 
 static void uwu_help(void)
 {
 	printf(
 "uwu target options:\n"
-"none\n"
+"--uwu-offset n       leave the first n bytes of the payload alone\n"
+"--uwu-max-bytes n    uwu at most n bytes of the payload\n"
+"--uwu-min-len n      leave payloads shorter than n bytes alone\n"
+"--uwu-max-len n      leave payloads longer than n bytes alone\n"
+"--uwu-map map[,map]  rewrite through the maps, applied in order, instead\n"
+"                     of l/r to w. A map is FROM:TO, rewriting each byte of\n"
+"                     FROM to the one at the same place in TO, either of\n"
+"                     which can be 0x followed by hex, or one of uwu, leet,\n"
+"                     rot13, shout or none\n"
+"--uwu-phrase FROM:TO[,FROM:TO]  rewrite the phrases first, TO can be of\n"
+"                     another length. Up to 16 of 16 bytes each, 0x and hex\n"
+"                     as for --uwu-map\n"
+"--then-xor-key key   XOR the uwu'd bytes with key in the same pass\n"
+"--then-xor-hex-key key  the same with the key in hex\n"
+"--uwu-conf name      do what the named config says at the time, which\n"
+"                     payload-conf sets, instead of any of the above\n"
+"--uwu-budget n       on each CPU, walk at most n bytes of payload a second\n"
+"                     and let packets past that through untouched\n"
+"--uwu-budget-burst n  of which up to n bytes at once, n of --uwu-budget\n"
+"                     by default\n"
+"--uwu-budget-cut     uwu packets past the budget up to what is left of it\n"
+"                     rather than not at all\n"
 	);
 }
 
+static int hex2bin(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	else
+		abort();
+}
+
+/* one side of a FROM:TO, returns its length in bytes */
+static unsigned int uwu_parse_side(const char *arg, size_t len, __u8 *out)
+{
+	unsigned int i;
+
+	if (len < 2 || arg[0] != '0' || arg[1] != 'x') {
+		if (len > 256)
+			xtables_error(PARAMETER_PROBLEM, "UWU: map too long");
+		memcpy(out, arg, len);
+		return len;
+	}
+	arg += 2;
+	len -= 2;
+	if (len % 2 != 0)
+		xtables_error(PARAMETER_PROBLEM, "Odd number of hex digits");
+	if (len / 2 > 256)
+		xtables_error(PARAMETER_PROBLEM, "UWU: map too long");
+	for (i = 0; i < len / 2; i++) {
+		if (!isxdigit(arg[i * 2]) || !isxdigit(arg[i * 2 + 1]))
+			xtables_error(PARAMETER_PROBLEM, "Invalid hex char");
+		out[i] = (hex2bin(arg[i * 2]) << 4) | hex2bin(arg[i * 2 + 1]);
+	}
+
+	return len / 2;
+}
+
+static void uwu_map_pair(__u8 *map, const char *arg, size_t len)
+{
+	const char *sep = memchr(arg, ':', len);
+	unsigned int from_len, to_len, i;
+	__u8 from[256], to[256];
+
+	if (!sep)
+		xtables_error(PARAMETER_PROBLEM,
+			      "UWU: map \"%.*s\" is not FROM:TO or a preset",
+			      (int)len, arg);
+	from_len = uwu_parse_side(arg, sep - arg, from);
+	to_len = uwu_parse_side(sep + 1, arg + len - sep - 1, to);
+	if (from_len != to_len)
+		xtables_error(PARAMETER_PROBLEM,
+			      "UWU: FROM and TO of \"%.*s\" differ in length",
+			      (int)len, arg);
+	for (i = 0; i < from_len; i++)
+		map[from[i]] = to[i];
+}
+
+static void uwu_map_preset(__u8 *map, unsigned int preset)
+{
+	const char *spec = uwu_presets[preset].spec;
+	unsigned int i;
+
+	for (i = 0; i < 256; i++)
+		map[i] = i;
+	if (*spec)
+		uwu_map_pair(map, spec, strlen(spec));
+}
+
+/* --uwu-map, on top of the identity map */
+static void uwu_map_parse(__u8 *map, const char *arg)
+{
+	__u8 preset[256];
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < 256; i++)
+		map[i] = i;
+	for (; *arg; arg += len + !!arg[len]) {
+		len = strcspn(arg, ",");
+		for (i = 0; i < ARRAY_SIZE(uwu_presets); i++) {
+			if (strlen(uwu_presets[i].name) == len &&
+			    !strncmp(arg, uwu_presets[i].name, len))
+				break;
+		}
+		if (i == ARRAY_SIZE(uwu_presets)) {
+			uwu_map_pair(map, arg, len);
+			continue;
+		}
+		/* only what the preset changes, so presets combine */
+		uwu_map_preset(preset, i);
+		for (i = 0; i < 256; i++) {
+			if (preset[i] != i)
+				map[i] = preset[i];
+		}
+	}
+}
+
+static void uwu_print_side(const __u8 *side, unsigned int len)
+{
+	bool literal = !(len >= 2 && side[0] == '0' && side[1] == 'x');
+	unsigned int i;
+
+	for (i = 0; i < len && literal; i++)
+		literal = isalnum(side[i]);
+	if (literal) {
+		printf("%.*s", len, (const char *)side);
+		return;
+	}
+	printf("0x");
+	for (i = 0; i < len; i++)
+		printf("%02x", side[i]);
+}
+
+/**
+ * A map the way uwu_map_parse() reads it back to the same bytes: a preset
+ * if it is one, otherwise every byte that changes as one FROM:TO, in hex
+ * where the bytes aren't all letters and digits.
+ */
+static void uwu_map_print(const __u8 *map)
+{
+	__u8 preset[256], from[256], to[256];
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(uwu_presets); i++) {
+		uwu_map_preset(preset, i);
+		if (!memcmp(preset, map, sizeof(preset))) {
+			printf("%s", uwu_presets[i].name);
+			return;
+		}
+	}
+	for (i = 0; i < 256; i++) {
+		if (map[i] != i) {
+			from[n] = i;
+			to[n++] = map[i];
+		}
+	}
+	uwu_print_side(from, n);
+	putchar(':');
+	uwu_print_side(to, n);
+}
+
+/* --uwu-phrase, compiled for the kernel to match in one pass */
+static void uwu_phrase_parse(struct xt_uwu_ac *ac, const char *arg)
+{
+	__u8 from[256], to[256];
+	const char *sep, *err;
+	size_t len;
+
+	for (; *arg; arg += len + !!arg[len]) {
+		struct xt_uwu_phrase *ph = &ac->phrases[ac->nr_phrases];
+
+		len = strcspn(arg, ",");
+		sep = memchr(arg, ':', len);
+		if (!sep)
+			xtables_error(PARAMETER_PROBLEM,
+				      "UWU: phrase \"%.*s\" is not FROM:TO",
+				      (int)len, arg);
+		if (ac->nr_phrases == XT_UWU_PHRASES)
+			xtables_error(PARAMETER_PROBLEM,
+				      "UWU: more than %u phrases",
+				      XT_UWU_PHRASES);
+		ph->from_len = uwu_parse_side(arg, sep - arg, from);
+		ph->to_len = uwu_parse_side(sep + 1, arg + len - sep - 1, to);
+		if (!ph->from_len || ph->from_len > XT_UWU_PHRASE_LEN ||
+		    ph->to_len > XT_UWU_PHRASE_LEN)
+			xtables_error(PARAMETER_PROBLEM,
+				      "UWU: phrase \"%.*s\" is empty or longer "
+				      "than %u bytes", (int)len, arg,
+				      XT_UWU_PHRASE_LEN);
+		memcpy(ph->from, from, ph->from_len);
+		memcpy(ph->to, to, ph->to_len);
+		ac->nr_phrases++;
+	}
+
+	err = uwu_phrase_compile(ac);
+	if (err)
+		xtables_error(PARAMETER_PROBLEM, "UWU: %s", err);
+}
+
+static void uwu_phrase_print(const struct xt_uwu_ac *ac)
+{
+	unsigned int i;
+
+	for (i = 0; i < ac->nr_phrases; i++) {
+		if (i)
+			putchar(',');
+		uwu_print_side(ac->phrases[i].from, ac->phrases[i].from_len);
+		putchar(':');
+		uwu_print_side(ac->phrases[i].to, ac->phrases[i].to_len);
+	}
+}
 
 static void uwu_parse(struct xt_option_call *cb)
 {
-	struct xt_uwu_info *xor = cb->data;
+	struct xt_uwu_info *uwu = cb->data;
 	int len, i;
 
 	xtables_option_parse(cb);
+	switch (cb->entry->id) {
+	case O_UWU_MAP:
+		uwu_map_parse(uwu->map, cb->arg);
+		uwu->map_set = 1;
+		break;
+	case O_UWU_PHRASE:
+		uwu_phrase_parse(&uwu->phrases, cb->arg);
+		break;
+	case O_UWU_XOR_KEY:
+		strncpy((char *)uwu->xor_key, cb->arg, sizeof(uwu->xor_key));
+		uwu->xor_key_len = strlen(cb->arg);
+		break;
+	case O_UWU_XOR_HEX_KEY:
+		len = strlen(cb->arg);
+		if (len == 0) {
+			xtables_error(PARAMETER_PROBLEM,
+					"KEY must not be empty");
+		}
+		if (len > sizeof(uwu->xor_key) * 2)
+			xtables_error(PARAMETER_PROBLEM, "KEY is too long");
+		if (len % 2 != 0) {
+			xtables_error(PARAMETER_PROBLEM,
+					"Odd number of hex digits");
+		}
+		len /= 2;
+		for (i = 0; i < len; i++) {
+			if (!isxdigit(cb->arg[i * 2]) ||
+			    !isxdigit(cb->arg[i * 2 + 1])) {
+				xtables_error(PARAMETER_PROBLEM,
+						"Invalid hex char");
+			}
+			uwu->xor_key[i] = (hex2bin(cb->arg[i * 2]) << 4) |
+				hex2bin(cb->arg[i * 2 + 1]);
+		}
+		uwu->xor_key_len = len;
+		break;
+	case O_UWU_BUDGET_CUT:
+		uwu->budget_cut = 1;
+		break;
+	}
 }
 
 static void uwu_check(struct xt_fcheck_call *cb)
 {
+	const struct xt_uwu_info *uwu = cb->data;
+
+	if ((cb->xflags & F_UWU_CONF) && (cb->xflags & ~F_UWU_CONF))
+		xtables_error(PARAMETER_PROBLEM,
+			      "UWU: --uwu-conf can't go with other options");
+	if (uwu->max_len && uwu->min_len > uwu->max_len)
+		xtables_error(PARAMETER_PROBLEM,
+			      "UWU: --uwu-min-len is above --uwu-max-len");
+	if (uwu->budget_rate && !uwu->budget_cut &&
+	    (uwu->budget_burst ?: uwu->budget_rate) < xt_uwu_budget_need(uwu))
+		xtables_error(PARAMETER_PROBLEM,
+			      "UWU: the budget burst is below the %u bytes one "
+			      "packet can need, which it would never let "
+			      "through without --uwu-budget-cut",
+			      xt_uwu_budget_need(uwu));
+}
+
+static bool is_hex_key(const __u8 *key, __u8 key_len)
+{
+	int i;
+
+	for (i = 0; i < key_len; i++) {
+		if (!isprint(key[i]))
+			return true;
+	}
+
+	return false;
+}
+
+static void print_key(const __u8 *key, __u8 key_len)
+{
+	int i;
+
+	putchar('\"');
+	for (i = 0; i < key_len; i++) {
+		if (key[i] == '\\' || key[i] == '\"')
+			printf("\\%c", key[i]);
+		else
+			putchar(key[i]);
+	}
+	putchar('\"');
+}
+
+static void print_hex_key(const __u8 *key, __u8 key_len)
+{
+	int i;
+
+	putchar('\"');
+	for (i = 0; i < key_len; i++)
+		printf("%02x", key[i]);
+	putchar('\"');
+}
+
+/**
+ * The kernel numbers every UWU rule and keeps its counters in
+ * /proc/net/xt_uwu_rules, one "id packets bytes budget_hits" line per
+ * rule. Older modules leave out budget_hits, which then reads as 0.
+ */
+static bool uwu_rule_stats(__u32 id, unsigned long long *packets,
+		unsigned long long *bytes, unsigned long long *hits)
+{
+	char line[128];
+	unsigned int rule_id;
+	bool found = false;
+	FILE *fp;
+
+	fp = fopen("/proc/net/xt_uwu_rules", "r");
+	if (!fp)
+		return false;
+	while (fgets(line, sizeof(line), fp)) {
+		*hits = 0;
+		if (sscanf(line, "%u %llu %llu %llu", &rule_id, packets, bytes,
+			   hits) >= 3 && rule_id == id) {
+			found = true;
+			break;
+		}
+	}
+	fclose(fp);
 
+	return found;
 }
 
 static void uwu_print(const void *ip, const struct xt_entry_target *target,
 		int numeric)
 {
-	const struct xt_uwu_info *xor = (void *)target->data;
-		printf(" nya~ ");
+	const struct xt_uwu_info *uwu = (void *)target->data;
+	unsigned long long packets, bytes, hits;
+
+	printf(" nya~ ");
+	if (uwu->conf[0])
+		printf("conf %s ", uwu->conf);
+	if (uwu->offset)
+		printf("offset %u ", uwu->offset);
+	if (uwu->max_bytes)
+		printf("max-bytes %u ", uwu->max_bytes);
+	if (uwu->min_len)
+		printf("min-len %u ", uwu->min_len);
+	if (uwu->max_len)
+		printf("max-len %u ", uwu->max_len);
+	if (uwu->map_set) {
+		printf("map ");
+		uwu_map_print(uwu->map);
+		putchar(' ');
+	}
+	if (uwu->phrases.nr_phrases) {
+		printf("phrases ");
+		uwu_phrase_print(&uwu->phrases);
+		putchar(' ');
+	}
+	if (uwu->xor_key_len && is_hex_key(uwu->xor_key, uwu->xor_key_len)) {
+		printf("then-xor-hex-key: ");
+		print_hex_key(uwu->xor_key, uwu->xor_key_len);
+		putchar(' ');
+	} else if (uwu->xor_key_len) {
+		printf("then-xor-key: ");
+		print_key(uwu->xor_key, uwu->xor_key_len);
+		putchar(' ');
+	}
+	if (uwu->budget_rate)
+		printf("budget %u ", uwu->budget_rate);
+	if (uwu->budget_burst)
+		printf("budget-burst %u ", uwu->budget_burst);
+	if (uwu->budget_cut)
+		printf("budget-cut ");
+	if (uwu_rule_stats(uwu->id, &packets, &bytes, &hits)) {
+		printf("uwu'd %llu packets %llu bytes ", packets, bytes);
+		if (uwu->budget_rate)
+			printf("budget hit %llu times ", hits);
+	}
 }
 
 static void uwu_save(const void *ip, const struct xt_entry_target *target)
 {
-	const struct xt_uwu_info *xor = (void *)target->data;
+	const struct xt_uwu_info *uwu = (void *)target->data;
+
+	if (uwu->conf[0])
+		printf(" --uwu-conf %s", uwu->conf);
+	if (uwu->offset)
+		printf(" --uwu-offset %u", uwu->offset);
+	if (uwu->max_bytes)
+		printf(" --uwu-max-bytes %u", uwu->max_bytes);
+	if (uwu->min_len)
+		printf(" --uwu-min-len %u", uwu->min_len);
+	if (uwu->max_len)
+		printf(" --uwu-max-len %u", uwu->max_len);
+	if (uwu->map_set) {
+		printf(" --uwu-map ");
+		uwu_map_print(uwu->map);
+	}
+	if (uwu->phrases.nr_phrases) {
+		printf(" --uwu-phrase ");
+		uwu_phrase_print(&uwu->phrases);
+	}
+	if (uwu->xor_key_len && is_hex_key(uwu->xor_key, uwu->xor_key_len)) {
+		printf(" --then-xor-hex-key ");
+		print_hex_key(uwu->xor_key, uwu->xor_key_len);
+	} else if (uwu->xor_key_len) {
+		printf(" --then-xor-key ");
+		print_key(uwu->xor_key, uwu->xor_key_len);
+	}
+	if (uwu->budget_rate)
+		printf(" --uwu-budget %u", uwu->budget_rate);
+	if (uwu->budget_burst)
+		printf(" --uwu-budget-burst %u", uwu->budget_burst);
+	if (uwu->budget_cut)
+		printf(" --uwu-budget-cut");
 }
 
 static struct xtables_target uwu_tg_reg = {
@@ -72,7 +539,7 @@ static struct xtables_target uwu_tg_reg = {
 	.family		= PF_INET,
 	.revision	= 0,
 	.size		= XT_ALIGN(sizeof(struct xt_uwu_info)),
-	.userspacesize	= sizeof(struct xt_uwu_info),
+	.userspacesize	= offsetof(struct xt_uwu_info, id),
 	.help		= uwu_help,
 	.print		= uwu_print,
 	.save		= uwu_save,
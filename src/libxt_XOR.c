@@ -28,17 +28,24 @@
 enum {
 	O_XOR_KEY = 0,
 	O_XOR_HEX_KEY,
+	O_XOR_CONF,
 	F_XOR_KEY     = 1 << O_XOR_KEY,
 	F_XOR_HEX_KEY = 1 << O_XOR_HEX_KEY,
-	F_XOR_OP_ANY  = F_XOR_KEY | F_XOR_HEX_KEY,
+	F_XOR_CONF    = 1 << O_XOR_CONF,
+	F_XOR_OP_ANY  = F_XOR_KEY | F_XOR_HEX_KEY | F_XOR_CONF,
 };
 
 #define s struct xt_xor_info
 static const struct xt_option_entry XOR_opts[] = {
 	{.name = "xor-key", .id = O_XOR_KEY, .type = XTTYPE_STRING,
-	 .min = 1, .max = sizeof(((s *)NULL)->key), .excl = F_XOR_HEX_KEY},
+	 .min = 1, .max = sizeof(((s *)NULL)->key),
+	 .excl = F_XOR_HEX_KEY | F_XOR_CONF},
 	{.name = "xor-hex-key", .id = O_XOR_HEX_KEY, .type = XTTYPE_STRING,
-	 .excl = F_XOR_KEY},
+	 .excl = F_XOR_KEY | F_XOR_CONF},
+	{.name = "xor-conf", .id = O_XOR_CONF, .type = XTTYPE_STRING,
+	 .min = 1, .max = XT_PAYLOAD_CONF_NAME - 1,
+	 .excl = F_XOR_KEY | F_XOR_HEX_KEY,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, conf)},
 	XTOPT_TABLEEND,
 };
 #undef s
@@ -49,6 +56,8 @@ static void XOR_help(void)
 "XOR target options:\n"
 "--xor-key key        specify the xor key\n"
 "--xor-hex-key key    specify the xor key in hex\n"
+"--xor-conf name      use the key of the named config at the time, which\n"
+"                     payload-conf sets\n"
 	);
 }
 
@@ -106,8 +115,8 @@ static void XOR_check(struct xt_fcheck_call *cb)
 {
 	if (!(cb->xflags & F_XOR_OP_ANY))
 		xtables_error(PARAMETER_PROBLEM,
-				"XOR target: You must specify `--xor-key' or "
-				"`--xor-hex-key'");
+				"XOR target: You must specify `--xor-key', "
+				"`--xor-hex-key' or `--xor-conf'");
 }
 
 static bool is_hex_key(const __u8 *key, __u8 key_len)
@@ -151,7 +160,9 @@ static void XOR_print(const void *ip, const struct xt_entry_target *target,
 {
 	const struct xt_xor_info *xor = (void *)target->data;
 
-	if (is_hex_key(xor->key, xor->key_len)) {
+	if (xor->conf[0]) {
+		printf(" xor-conf: %s", xor->conf);
+	} else if (is_hex_key(xor->key, xor->key_len)) {
 		printf(" xor-hex-key: ");
 		print_hex_key(xor->key, xor->key_len);
 	} else {
@@ -164,7 +175,9 @@ static void XOR_save(const void *ip, const struct xt_entry_target *target)
 {
 	const struct xt_xor_info *xor = (void *)target->data;
 
-	if (is_hex_key(xor->key, xor->key_len)) {
+	if (xor->conf[0]) {
+		printf(" --xor-conf %s", xor->conf);
+	} else if (is_hex_key(xor->key, xor->key_len)) {
 		printf(" --xor-hex-key ");
 		print_hex_key(xor->key, xor->key_len);
 	} else {
@@ -179,7 +192,7 @@ static struct xtables_target xor_tg_reg = {
 	.family		= PF_INET,
 	.revision	= 0,
 	.size		= XT_ALIGN(sizeof(struct xt_xor_info)),
-	.userspacesize	= sizeof(struct xt_xor_info),
+	.userspacesize	= offsetof(struct xt_xor_info, ks),
 	.help		= XOR_help,
 	.print		= XOR_print,
 	.save		= XOR_save,
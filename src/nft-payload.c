@@ -0,0 +1,272 @@
+/**
+ * nft-payload - add an nft uwu or xor rule.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * nft(8) only knows the expressions built into libnftables, so it can't
+ * add a rule using the uwu or xor ones. This appends a rule consisting of
+ * just that expression to an existing chain, talking nfnetlink directly.
+ * The matching is left to nft: put the rule in a chain of its own and jump
+ * there from a set lookup or a verdict map.
+ */
+
+#include "xt_UWU.h"
+#include "xt_XOR.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#define die(fmt, args...) \
+do { \
+	fprintf(stderr, fmt "\n", ##args); \
+	exit(EXIT_FAILURE); \
+} while (0)
+
+#define fail(fmt, args...) die("Failed to " fmt, ##args)
+
+#define XOR_KEY_MAX	sizeof(((struct xt_xor_info *)NULL)->key)
+
+struct msg {
+	char		buf[8192];
+	unsigned int	len;
+};
+
+static void usage(const char *argv0, int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+"Usage: %s [OPTIONS] table chain uwu\n"
+"       %s [OPTIONS] table chain xor key\n"
+"\n"
+"Appends a rule made of just the uwu or xor expression to chain.\n"
+"\n"
+"Options:\n"
+"  -h  show this message\n"
+"  -f  family of the table, ip (default) or inet\n"
+"  -x  the xor key is in hex\n",
+		argv0, argv0);
+	exit(error_code);
+}
+
+static struct nlmsghdr *msg_put_hdr(struct msg *m, unsigned int type,
+		unsigned int flags, unsigned int family, unsigned int res_id,
+		unsigned int seq)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(m->buf + m->len);
+	struct nfgenmsg *nfg;
+
+	if (m->len + NLMSG_SPACE(sizeof(*nfg)) > sizeof(m->buf))
+		die("Message too long");
+	memset(nlh, 0, NLMSG_SPACE(sizeof(*nfg)));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*nfg));
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = seq;
+	nfg = NLMSG_DATA(nlh);
+	nfg->nfgen_family = family;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(res_id);
+	m->len += NLMSG_ALIGN(nlh->nlmsg_len);
+
+	return nlh;
+}
+
+static struct nlattr *msg_put_attr(struct msg *m, struct nlmsghdr *nlh,
+		unsigned int type, const void *data, unsigned int len)
+{
+	struct nlattr *nla = (struct nlattr *)(m->buf + m->len);
+
+	if (m->len + NLA_ALIGN(NLA_HDRLEN + len) > sizeof(m->buf))
+		die("Message too long");
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+	memset((char *)nla + nla->nla_len, 0,
+	       NLA_ALIGN(nla->nla_len) - nla->nla_len);
+	m->len += NLA_ALIGN(nla->nla_len);
+	nlh->nlmsg_len = m->buf + m->len - (char *)nlh;
+
+	return nla;
+}
+
+static void msg_put_str(struct msg *m, struct nlmsghdr *nlh,
+		unsigned int type, const char *s)
+{
+	msg_put_attr(m, nlh, type, s, strlen(s) + 1);
+}
+
+static struct nlattr *msg_nest_start(struct msg *m, struct nlmsghdr *nlh,
+		unsigned int type)
+{
+	return msg_put_attr(m, nlh, NLA_F_NESTED | type, NULL, 0);
+}
+
+static void msg_nest_end(struct msg *m, struct nlattr *nest)
+{
+	nest->nla_len = m->buf + m->len - (char *)nest;
+}
+
+static int hex2bin(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else
+		return c - 'A' + 10;
+}
+
+static unsigned int parse_key(const char *arg, int hex, unsigned char *key)
+{
+	unsigned int len = strlen(arg), i;
+
+	if (len == 0)
+		die("KEY must not be empty");
+	if (!hex) {
+		if (len > XOR_KEY_MAX)
+			die("KEY is too long");
+		memcpy(key, arg, len);
+		return len;
+	}
+
+	if (len > XOR_KEY_MAX * 2)
+		die("KEY is too long");
+	if (len % 2 != 0)
+		die("Odd number of hex digits");
+	len /= 2;
+	for (i = 0; i < len; i++) {
+		if (!isxdigit(arg[i * 2]) || !isxdigit(arg[i * 2 + 1]))
+			die("Invalid hex char");
+		key[i] = (hex2bin(arg[i * 2]) << 4) | hex2bin(arg[i * 2 + 1]);
+	}
+
+	return len;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char key[XOR_KEY_MAX];
+	struct nlattr *exprs, *elem, *data;
+	unsigned int key_len = 0, seq;
+	int family = NFPROTO_IPV4;
+	struct sockaddr_nl snl;
+	struct nlmsghdr *nlh;
+	const char *expr;
+	int sock, opt, hex = 0;
+	static struct msg m;
+	char buf[8192];
+	ssize_t len;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "hf:x")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "ip"))
+				family = NFPROTO_IPV4;
+			else if (!strcmp(optarg, "inet"))
+				family = NFPROTO_INET;
+			else
+				die("Unsupported family: %s", optarg);
+			break;
+		case 'x':
+			hex = 1;
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+	if (optind + 3 > argc)
+		usage(argv[0], EXIT_FAILURE);
+	expr = argv[optind + 2];
+	if (!strcmp(expr, "uwu")) {
+		if (optind + 3 != argc)
+			usage(argv[0], EXIT_FAILURE);
+	} else if (!strcmp(expr, "xor")) {
+		if (optind + 4 != argc)
+			usage(argv[0], EXIT_FAILURE);
+		key_len = parse_key(argv[optind + 3], hex, key);
+	} else {
+		usage(argv[0], EXIT_FAILURE);
+	}
+
+	seq = time(NULL);
+	msg_put_hdr(&m, NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC,
+		    NFNL_SUBSYS_NFTABLES, seq++);
+	nlh = msg_put_hdr(&m, (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWRULE,
+			  NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK, family, 0,
+			  seq);
+	msg_put_str(&m, nlh, NFTA_RULE_TABLE, argv[optind]);
+	msg_put_str(&m, nlh, NFTA_RULE_CHAIN, argv[optind + 1]);
+	exprs = msg_nest_start(&m, nlh, NFTA_RULE_EXPRESSIONS);
+	elem = msg_nest_start(&m, nlh, NFTA_LIST_ELEM);
+	msg_put_str(&m, nlh, NFTA_EXPR_NAME, expr);
+	data = msg_nest_start(&m, nlh, NFTA_EXPR_DATA);
+	if (key_len)
+		msg_put_attr(&m, nlh, NFTA_XOR_KEY, key, key_len);
+	msg_nest_end(&m, data);
+	msg_nest_end(&m, elem);
+	msg_nest_end(&m, exprs);
+	msg_put_hdr(&m, NFNL_MSG_BATCH_END, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES,
+		    seq + 1);
+
+	sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+	if (sock < 0)
+		fail("open the netlink socket: %s", strerror(errno));
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	if (sendto(sock, m.buf, m.len, 0, (struct sockaddr *)&snl,
+		   sizeof(snl)) < 0)
+		fail("send the rule: %s", strerror(errno));
+
+	/* only NEWRULE asked for an ack, errors come back for it too */
+	for (;;) {
+		len = recv(sock, buf, sizeof(buf), 0);
+		if (len < 0)
+			fail("read the reply: %s", strerror(errno));
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+			if (nlh->nlmsg_type != NLMSG_ERROR ||
+			    nlh->nlmsg_seq != seq)
+				continue;
+			if (err->error)
+				fail("add the %s rule: %s", expr,
+				     strerror(-err->error));
+			close(sock);
+			return EXIT_SUCCESS;
+		}
+	}
+}
@@ -0,0 +1,105 @@
+/**
+ * nft_uwu - uwu the application data from an nftables rule.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "xt_UWU.h"
+
+#include <linux/module.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <net/netfilter/nf_tables.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Ben Cartwright-Cox <ben@benjojo.co.uk>");
+MODULE_DESCRIPTION("nftables: uwu application data");
+MODULE_ALIAS_NFT_EXPR("uwu");
+
+/**
+ * A native expression instead of going through nft_compat and the UWU
+ * target, so the rule can sit behind a set lookup or a verdict map. The
+ * packet work is xt_uwu_payload() in xt_UWU.ko, so both paths share the
+ * transform, the stream state and /proc/net/xt_uwu_stat.
+ */
+static void nft_uwu_eval(const struct nft_expr *expr,
+		struct nft_regs *regs, const struct nft_pktinfo *pkt)
+{
+	/* the transform only knows IPv4, as the target does */
+	if (nft_pf(pkt) != NFPROTO_IPV4 ||
+	    !(pkt->flags & NFT_PKTINFO_L4PROTO))
+		return;
+
+	if (xt_uwu_payload(pkt->skb, nft_net(pkt), nft_thoff(pkt),
+			   NULL, NULL, NULL) == NF_DROP)
+		regs->verdict.code = NF_DROP;
+}
+
+static const struct nla_policy nft_uwu_policy[NFTA_UWU_MAX + 1] = {
+};
+
+static int nft_uwu_init(const struct nft_ctx *ctx,
+		const struct nft_expr *expr, const struct nlattr * const tb[])
+{
+	if (ctx->family != NFPROTO_IPV4 && ctx->family != NFPROTO_INET)
+		return -EOPNOTSUPP;
+
+	return xt_uwu_net_get(ctx->net, ctx->family);
+}
+
+static void nft_uwu_destroy(const struct nft_ctx *ctx,
+		const struct nft_expr *expr)
+{
+	xt_uwu_net_put(ctx->net, ctx->family);
+}
+
+static int nft_uwu_dump(struct sk_buff *skb, const struct nft_expr *expr,
+		bool reset)
+{
+	return 0;
+}
+
+static struct nft_expr_type nft_uwu_type;
+static const struct nft_expr_ops nft_uwu_ops = {
+	.type		= &nft_uwu_type,
+	.size		= NFT_EXPR_SIZE(0),
+	.eval		= nft_uwu_eval,
+	.init		= nft_uwu_init,
+	.destroy	= nft_uwu_destroy,
+	.dump		= nft_uwu_dump,
+};
+
+static struct nft_expr_type nft_uwu_type __read_mostly = {
+	.name		= "uwu",
+	.ops		= &nft_uwu_ops,
+	.policy		= nft_uwu_policy,
+	.maxattr	= NFTA_UWU_MAX,
+	.owner		= THIS_MODULE,
+};
+
+static int __init nft_uwu_module_init(void)
+{
+	return nft_register_expr(&nft_uwu_type);
+}
+
+static void __exit nft_uwu_module_exit(void)
+{
+	nft_unregister_expr(&nft_uwu_type);
+}
+
+module_init(nft_uwu_module_init);
+module_exit(nft_uwu_module_exit);
@@ -0,0 +1,133 @@
+/**
+ * nft_xor - XOR the application data from an nftables rule.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "xt_XOR.h"
+#include "xt_payload.h"
+#include "xor_core.h"
+
+#include <linux/module.h>
+#include <linux/netlink.h>
+#include <linux/slab.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <net/netfilter/nf_tables.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Ben Cartwright-Cox <ben@benjojo.co.uk>");
+MODULE_DESCRIPTION("nftables: XOR the application data");
+MODULE_ALIAS_NFT_EXPR("xor");
+
+/* the keystream is too big to keep in the rule itself */
+struct nft_xor {
+	struct xor_keystream	*ks;
+};
+
+/* the packet work is xt_xor_payload() in xt_XOR.ko, as for nft_uwu */
+static void nft_xor_eval(const struct nft_expr *expr,
+		struct nft_regs *regs, const struct nft_pktinfo *pkt)
+{
+	const struct nft_xor *priv = nft_expr_priv(expr);
+
+	if (nft_pf(pkt) != NFPROTO_IPV4 ||
+	    !(pkt->flags & NFT_PKTINFO_L4PROTO))
+		return;
+
+	if (xt_xor_payload(pkt->skb, nft_net(pkt), nft_thoff(pkt), priv->ks) ==
+	    NF_DROP)
+		regs->verdict.code = NF_DROP;
+}
+
+static const struct nla_policy nft_xor_policy[NFTA_XOR_MAX + 1] = {
+	[NFTA_XOR_KEY]	= NLA_POLICY_MAX_LEN(NLA_BINARY, XOR_MAX_KEY_LEN),
+};
+
+static int nft_xor_init(const struct nft_ctx *ctx,
+		const struct nft_expr *expr, const struct nlattr * const tb[])
+{
+	struct nft_xor *priv = nft_expr_priv(expr);
+	int ret;
+
+	if (ctx->family != NFPROTO_IPV4 && ctx->family != NFPROTO_INET)
+		return -EOPNOTSUPP;
+	if (!tb[NFTA_XOR_KEY] || !nla_len(tb[NFTA_XOR_KEY]))
+		return -EINVAL;
+
+	priv->ks = kmalloc(sizeof(*priv->ks), GFP_KERNEL_ACCOUNT);
+	if (!priv->ks)
+		return -ENOMEM;
+	xor_keystream_init(priv->ks, nla_data(tb[NFTA_XOR_KEY]),
+			   nla_len(tb[NFTA_XOR_KEY]));
+	ret = xt_payload_defrag_get(ctx->net);
+	if (ret)
+		kfree(priv->ks);
+
+	return ret;
+}
+
+static void nft_xor_destroy(const struct nft_ctx *ctx,
+		const struct nft_expr *expr)
+{
+	struct nft_xor *priv = nft_expr_priv(expr);
+
+	xt_payload_defrag_put(ctx->net);
+	kfree(priv->ks);
+}
+
+static int nft_xor_dump(struct sk_buff *skb, const struct nft_expr *expr,
+		bool reset)
+{
+	const struct nft_xor *priv = nft_expr_priv(expr);
+
+	/* the first key_len bytes of the keystream are the key */
+	if (nla_put(skb, NFTA_XOR_KEY, priv->ks->key_len, priv->ks->bytes))
+		return -1;
+
+	return 0;
+}
+
+static struct nft_expr_type nft_xor_type;
+static const struct nft_expr_ops nft_xor_ops = {
+	.type		= &nft_xor_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_xor)),
+	.eval		= nft_xor_eval,
+	.init		= nft_xor_init,
+	.destroy	= nft_xor_destroy,
+	.dump		= nft_xor_dump,
+};
+
+static struct nft_expr_type nft_xor_type __read_mostly = {
+	.name		= "xor",
+	.ops		= &nft_xor_ops,
+	.policy		= nft_xor_policy,
+	.maxattr	= NFTA_XOR_MAX,
+	.owner		= THIS_MODULE,
+};
+
+static int __init nft_xor_module_init(void)
+{
+	return nft_register_expr(&nft_xor_type);
+}
+
+static void __exit nft_xor_module_exit(void)
+{
+	nft_unregister_expr(&nft_xor_type);
+}
+
+module_init(nft_xor_module_init);
+module_exit(nft_xor_module_exit);
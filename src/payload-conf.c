@@ -0,0 +1,275 @@
+/**
+ * payload-conf - set, delete and list named UWU and XOR configs.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * A named config is what the target's info struct would hold for a rule
+ * with the same options, see xt_payload_conf.h. Rather than know every
+ * option, this loads the iptables extension of the target through
+ * libxtables and lets it parse them into the struct, then hands its
+ * userspace part to the kernel, and prints configs back with the
+ * extension's save().
+ */
+
+#include "xt_payload_conf.h"
+
+#include <xtables.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include <linux/netfilter.h>
+
+#define die(fmt, args...) \
+do { \
+	fprintf(stderr, fmt "\n", ##args); \
+	exit(EXIT_FAILURE); \
+} while (0)
+
+#define fail(fmt, args...) die("Failed to " fmt, ##args)
+
+static void usage(const char *argv0, int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+"Usage: %s TARGET set name [target options]\n"
+"       %s TARGET del name\n"
+"       %s TARGET show\n"
+"\n"
+"Sets, deletes or lists the named configs of TARGET (UWU or XOR), which\n"
+"rules use with --uwu-conf or --xor-conf. Setting a config takes the\n"
+"options of -j TARGET and changes what every rule using it does at once.\n",
+		argv0, argv0, argv0);
+	exit(error_code);
+}
+
+static void payload_conf_exit_err(enum xtables_exittype status,
+		const char *msg, ...)
+{
+	va_list args;
+
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	fputc('\n', stderr);
+	exit(status);
+}
+
+static struct option payload_conf_opts[] = {
+	{NULL},
+};
+
+static struct xtables_globals payload_conf_globals = {
+	.option_offset	= 0,
+	.program_name	= "payload-conf",
+	.program_version = XTABLES_VERSION,
+	.orig_opts	= payload_conf_opts,
+	.exit_err	= payload_conf_exit_err,
+};
+
+/* Loads the extension of target with an empty info struct for it to fill */
+static struct xtables_target *payload_conf_target(const char *name)
+{
+	struct xtables_target *t;
+	size_t size;
+
+	t = xtables_find_target(name, XTF_LOAD_MUST_SUCCEED);
+	if (!t->x6_parse || !t->save)
+		die("%s has no options to set", name);
+	size = XT_ALIGN(sizeof(struct xt_entry_target)) + t->size;
+	t->t = xtables_calloc(1, size);
+	t->t->u.target_size = size;
+	strcpy(t->t->u.user.name, t->name);
+	t->t->u.user.revision = t->revision;
+	if (t->init)
+		t->init(t->t);
+
+	return t;
+}
+
+/* /proc/net/xt_uwu_conf for UWU and so on, see xt_payload_register() */
+static void payload_conf_path(char *path, size_t size,
+		const struct xtables_target *t)
+{
+	size_t i, len;
+
+	len = snprintf(path, size, "/proc/net/xt_%s_conf", t->name);
+	for (i = strlen("/proc/net/xt_"); i < len && i < size; i++)
+		path[i] = tolower((unsigned char)path[i]);
+}
+
+static void payload_conf_write(const struct xtables_target *t,
+		const char *name, const void *data, size_t len)
+{
+	struct xt_payload_conf_msg *msg;
+	char path[PATH_MAX];
+	ssize_t ret;
+	int fd;
+
+	if (strlen(name) >= sizeof(msg->name))
+		die("Name %s is longer than %zu bytes", name,
+		    sizeof(msg->name) - 1);
+	msg = xtables_calloc(1, sizeof(*msg) + len);
+	strcpy(msg->name, name);
+	if (len)
+		memcpy(msg->data, data, len);
+
+	payload_conf_path(path, sizeof(path), t);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		fail("open %s: %s (is the module loaded?)", path,
+		     strerror(errno));
+	/* the kernel takes a message in a single write */
+	ret = write(fd, msg, sizeof(*msg) + len);
+	if (ret < 0 && errno == EBUSY)
+		die("%s is still used by rules", name);
+	if (ret < 0 && errno == ENOENT)
+		die("No config called %s", name);
+	if (ret < 0)
+		fail("write %s: %s", name, strerror(errno));
+	close(fd);
+	free(msg);
+}
+
+static void payload_conf_set(struct xtables_target *t, const char *name,
+		int argc, char **argv)
+{
+	struct option *opts;
+	int c;
+
+	opts = xtables_options_xfrm(payload_conf_globals.orig_opts, NULL,
+				    t->x6_options, &t->option_offset);
+	if (!opts)
+		fail("set up the options of %s", t->name);
+
+	optind = 0;
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		if (c == '?' || c == ':')
+			die("Bad option %s, see iptables -j %s --help",
+			    argv[optind - 1], t->name);
+		xtables_option_tpcall(c, argv, false, t, NULL);
+	}
+	if (optind != argc)
+		die("Unexpected argument %s", argv[optind]);
+	xtables_option_tfcall(t);
+
+	payload_conf_write(t, name, t->t->data, t->userspacesize);
+	xtables_free_opts(1);
+}
+
+static int hex2bin(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	else
+		return -1;
+}
+
+/* One "name rules config" line per config, the config in hex */
+static void payload_conf_show(struct xtables_target *t)
+{
+	char path[PATH_MAX], name[XT_PAYLOAD_CONF_NAME];
+	unsigned int rules;
+	size_t len, i;
+	char *line = NULL, *hex;
+	size_t line_size = 0;
+	FILE *fp;
+	int hi, lo;
+
+	payload_conf_path(path, sizeof(path), t);
+	fp = fopen(path, "r");
+	if (!fp)
+		fail("open %s: %s (is the module loaded?)", path,
+		     strerror(errno));
+	/* skip the header */
+	if (getline(&line, &line_size, fp) < 0) {
+		fclose(fp);
+		return;
+	}
+	while (getline(&line, &line_size, fp) > 0) {
+		if (sscanf(line, "%31s %u", name, &rules) != 2)
+			continue;
+		hex = strrchr(line, ' ');
+		if (!hex)
+			continue;
+		hex++;
+		len = strcspn(hex, "\n") / 2;
+		if (len != t->userspacesize)
+			die("%s has %zu bytes, %s wants %zu: the module and "
+			    "the extension don't match", name, len, t->name,
+			    t->userspacesize);
+
+		memset(t->t->data, 0, t->size);
+		for (i = 0; i < len; i++) {
+			hi = hex2bin(hex[i * 2]);
+			lo = hex2bin(hex[i * 2 + 1]);
+			if (hi < 0 || lo < 0)
+				die("Bad config line for %s", name);
+			t->t->data[i] = hi << 4 | lo;
+		}
+		printf("%s %u", name, rules);
+		t->save(NULL, t->t);
+		putchar('\n');
+	}
+	free(line);
+	fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+	struct xtables_target *t;
+	const char *cmd;
+
+	if (argc >= 2 && (!strcmp(argv[1], "-h") ||
+			  !strcmp(argv[1], "--help")))
+		usage(argv[0], EXIT_SUCCESS);
+	if (argc < 3)
+		usage(argv[0], EXIT_FAILURE);
+
+	if (xtables_init_all(&payload_conf_globals, NFPROTO_IPV4) < 0)
+		fail("initialize libxtables");
+	t = payload_conf_target(argv[1]);
+	cmd = argv[2];
+
+	if (!strcmp(cmd, "set") && argc >= 4) {
+		/* getopt_long() wants argv[0], so name stands in for it */
+		payload_conf_set(t, argv[3], argc - 3, argv + 3);
+	} else if (!strcmp(cmd, "del") && argc == 4) {
+		payload_conf_write(t, argv[3], NULL, 0);
+	} else if (!strcmp(cmd, "show") && argc == 3) {
+		printf("name rules config\n");
+		payload_conf_show(t);
+	} else {
+		usage(argv[0], EXIT_FAILURE);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/**
+ * trace_payload - tracepoints for the payload targets.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xt_payload
+
+#if !defined(_TRACE_PAYLOAD_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_PAYLOAD_H
+
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+
+/* target is xt_payload_target.name, as in xt_uwu or xt_xor */
+DECLARE_EVENT_CLASS(payload_enter,
+
+	TP_PROTO(const char *target, const struct sk_buff *skb,
+		 unsigned int len),
+
+	TP_ARGS(target, skb, len),
+
+	TP_STRUCT__entry(
+		__string(target,		target)
+		__field(const void *,	skbaddr)
+		__field(unsigned int,	len)
+	),
+
+	TP_fast_assign(
+		__assign_str(target);
+		__entry->skbaddr = skb;
+		__entry->len = len;
+	),
+
+	TP_printk("target=%s skbaddr=%p len=%u", __get_str(target),
+		  __entry->skbaddr, __entry->len)
+);
+
+DECLARE_EVENT_CLASS(payload_exit,
+
+	TP_PROTO(const char *target, const struct sk_buff *skb, int ret),
+
+	TP_ARGS(target, skb, ret),
+
+	TP_STRUCT__entry(
+		__string(target,		target)
+		__field(const void *,	skbaddr)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__assign_str(target);
+		__entry->skbaddr = skb;
+		__entry->ret = ret;
+	),
+
+	TP_printk("target=%s skbaddr=%p ret=%d", __get_str(target),
+		  __entry->skbaddr, __entry->ret)
+);
+
+#define DEFINE_PAYLOAD_EVENTS(name)					\
+DEFINE_EVENT(payload_enter, name##_entry,				\
+	TP_PROTO(const char *target, const struct sk_buff *skb,		\
+		 unsigned int len),					\
+	TP_ARGS(target, skb, len));					\
+DEFINE_EVENT(payload_exit, name##_exit,					\
+	TP_PROTO(const char *target, const struct sk_buff *skb, int ret), \
+	TP_ARGS(target, skb, ret))
+
+/* len is skb->len, ret the verdict */
+DEFINE_PAYLOAD_EVENTS(payload_tg);
+/* len is the payload length, ret what xt_payload_mangle() returns */
+DEFINE_PAYLOAD_EVENTS(payload_mangle);
+/* len is the payload length */
+DEFINE_PAYLOAD_EVENTS(payload_cow);
+/* len is skb->ip_summed */
+DEFINE_PAYLOAD_EVENTS(payload_csum);
+
+#endif /* _TRACE_PAYLOAD_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace_payload
+#include <trace/define_trace.h>
@@ -0,0 +1,724 @@
+/**
+ * uwu_core - the uwu transform kernels.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UWU_CORE_H
+#define _UWU_CORE_H
+
+#include "xt_payload_core.h"
+
+/**
+ * Byte classes used by the transform kernels. Every byte maps to itself in
+ * uwu_map[] unless it is one of the letters we rewrite. A rule can bring
+ * its own map, which only uwu_table() below follows.
+ */
+#define UWU_C_UPPER	0x01	/* 'A'-'Z', part of an IRC command word */
+#define UWU_C_EOL	0x02	/* '\n', ends a line */
+
+static u8 uwu_map[256] __read_mostly __maybe_unused;
+static u8 uwu_class[256] __read_mostly __maybe_unused;
+
+static inline void uwu_tables_init(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		uwu_map[i] = i;
+		uwu_class[i] = (i >= 'A' && i <= 'Z') ? UWU_C_UPPER : 0;
+	}
+	uwu_map['l'] = 'w';
+	uwu_map['r'] = 'w';
+	uwu_map['L'] = 'W';
+	uwu_map['R'] = 'W';
+	uwu_class['\n'] = UWU_C_EOL;
+}
+
+/**
+ * A map for uwu_table() from a rule's: a '\n' ends the line before it
+ * could be rewritten, so it must map to itself.
+ */
+static inline void uwu_map_init(u8 *map, const u8 *rule_map)
+{
+	memcpy(map, rule_map, 256);
+	map['\n'] = '\n';
+}
+
+/**
+ * In order to preserve protocols like IRC, we must prevent the command word
+ * (like PRIVMSG) from being uwu'd (pwivmsg). uwu_mode is 0 while we are in
+ * the leading run of upper case letters of a line, and 1 once the first
+ * other byte has been seen. That byte itself is left alone, a '\n' drops
+ * back to 0.
+ *
+ * Every variant below comes in two flavours built from the same code: the
+ * transform rewrites the buffer and records the checksum delta, the scan
+ * only runs the state machine and sets hit if any byte would have been
+ * rewritten.
+ */
+struct uwu_state {
+	int			uwu_mode;
+	/* uwu_mode at the start of the payload */
+	int			start_mode;
+	bool			hit;
+	/* offset of the next byte from the start of the payload */
+	unsigned int		off;
+	unsigned int		rewritten;
+	struct xt_payload_csum	csum;
+	/* for uwu_table(), NULL for uwu_map */
+	const u8		*map;
+};
+
+/* byte by byte through map, uwu_map for everything but uwu_table() */
+static __always_inline void __uwu_bytes(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan, const u8 *map)
+{
+	unsigned int off = st->off;
+	int uwu_mode = st->uwu_mode;
+
+	while (len-- > 0) {
+		u8 c = *p;
+
+		if (uwu_mode) {
+			if (uwu_class[c] & UWU_C_EOL) {
+				uwu_mode = 0;
+			} else if (map[c] != c) {
+				if (scan) {
+					st->hit = true;
+				} else {
+					xt_payload_csum_add(&st->csum, off, c,
+							map[c]);
+					*p = map[c];
+					st->rewritten++;
+				}
+			}
+		} else if (!(uwu_class[c] & UWU_C_UPPER)) {
+			uwu_mode = 1;
+		}
+		p++;
+		off++;
+	}
+	st->uwu_mode = uwu_mode;
+	st->off = off;
+}
+
+static __always_inline void __uwu_generic(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan)
+{
+	__uwu_bytes(st, p, len, scan, uwu_map);
+}
+
+#define UWU_VARIANT(name)						\
+static void uwu_##name(struct uwu_state *st, u8 *p, unsigned int len)	\
+{									\
+	__uwu_##name(st, p, len, false);				\
+}									\
+									\
+static void uwu_##name##_scan(struct uwu_state *st, const u8 *p,	\
+		unsigned int len)					\
+{									\
+	__uwu_##name(st, (u8 *)p, len, true);				\
+}
+
+UWU_VARIANT(generic)
+
+#define UWU_ONES	0x0101010101010101ULL
+#define UWU_HIGHS	0x8080808080808080ULL
+
+/* non-zero if any byte of v is 0 */
+static inline u64 uwu_haszero(u64 v)
+{
+	return (v - UWU_ONES) & ~v & UWU_HIGHS;
+}
+
+/* 0x80 in every byte of v that is 0, and in no other */
+static inline u64 uwu_zero_bytes(u64 v)
+{
+	u64 lows = ~UWU_HIGHS;
+
+	return ~(((v & lows) + lows) | v | lows);
+}
+
+/**
+ * 0x80 in every byte of the word that is 'l', 'r', 'L' or 'R'. Or-ing in
+ * 0x20 folds the upper case letters onto the lower case ones without
+ * creating any other match.
+ */
+static inline u64 uwu_word_hits(u64 w)
+{
+	u64 f = w | (0x20 * UWU_ONES);
+
+	return uwu_zero_bytes(f ^ ('l' * UWU_ONES)) |
+	       uwu_zero_bytes(f ^ ('r' * UWU_ONES));
+}
+
+/**
+ * The command word at the start of a line, see struct uwu_state: nothing
+ * in it is rewritten, so it is only skipped over. Returns where it ends,
+ * past the byte that ends it.
+ */
+static inline u8 *uwu_skip_command(struct uwu_state *st, u8 *p, u8 *end)
+{
+	while (p < end && (uwu_class[*p] & UWU_C_UPPER))
+		p++;
+	if (p < end) {
+		st->uwu_mode = 1;
+		p++;
+	}
+
+	return p;
+}
+
+/* the word w with each of its bytes looked up in map */
+static inline u64 uwu_word_map(u64 w, const u8 *map)
+{
+	return (u64)map[w & 0xff] |
+	       (u64)map[(w >> 8) & 0xff] << 8 |
+	       (u64)map[(w >> 16) & 0xff] << 16 |
+	       (u64)map[(w >> 24) & 0xff] << 24 |
+	       (u64)map[(w >> 32) & 0xff] << 32 |
+	       (u64)map[(w >> 40) & 0xff] << 40 |
+	       (u64)map[(w >> 48) & 0xff] << 48 |
+	       (u64)map[w >> 56] << 56;
+}
+
+/**
+ * 32 - n bytes in, the mask that keeps the first n bytes of a word or a
+ * vector block, whatever the byte order.
+ */
+static const u8 uwu_keep[64] __aligned(32) __maybe_unused = {
+	[0 ... 31] = 0xff
+};
+
+/**
+ * A word at a time through the body of a line. Without a map, the letters
+ * uwu_map[] rewrites become 'w' or 'W' in place, keeping their case bit.
+ * With one, every byte of the word is looked up. A word with a '\n' in
+ * it is done up to the '\n', which ends the body of the line. The
+ * checksum sums are taken over the whole words that changed, as
+ * xor_transform() does, and words that didn't aren't stored.
+ */
+static __always_inline void __uwu_words(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan, const u8 *map)
+{
+	u8 *start = p, *end = p + len;
+	unsigned int base = st->off, rewritten = 0, n, odd;
+	/* by the parity of the offset the words were loaded from */
+	u64 from[2] = { 0, 0 }, to[2] = { 0, 0 };
+	u64 w, x, m;
+
+	while (end - p >= sizeof(u64)) {
+		if (!st->uwu_mode) {
+			p = uwu_skip_command(st, p, end);
+			continue;
+		}
+		w = get_unaligned((u64 *)p);
+		odd = (base + (p - start)) & 1;
+		n = sizeof(u64);
+		if (uwu_haszero(w ^ ('\n' * UWU_ONES))) {
+			for (n = 0; p[n] != '\n'; n++)
+				;
+			st->uwu_mode = 0;
+		}
+		if (map) {
+			x = uwu_word_map(w, map);
+		} else {
+			m = uwu_word_hits(w);
+			m = (m >> 7) * 0xff;
+			x = w ^ ((w ^ (w & (0x20 * UWU_ONES)) ^
+				  ('W' * UWU_ONES)) & m);
+		}
+		if (n < sizeof(u64))
+			x = w ^ ((w ^ x) &
+				 get_unaligned((const u64 *)(uwu_keep + 32 - n)));
+		if (x != w) {
+			if (scan) {
+				st->hit = true;
+			} else {
+				m = ~uwu_zero_bytes(w ^ x) & UWU_HIGHS;
+				rewritten += ((m >> 7) * UWU_ONES) >> 56;
+				put_unaligned(x, (u64 *)p);
+				from[odd] += (u32)w + (w >> 32);
+				to[odd] += (u32)x + (x >> 32);
+			}
+		}
+		p += n < sizeof(u64) ? n + 1 : n;
+	}
+	if (!scan) {
+		xt_payload_csum_add_words(&st->csum, 0, from[0], to[0]);
+		xt_payload_csum_add_words(&st->csum, 1, from[1], to[1]);
+		st->rewritten += rewritten;
+	}
+	st->off = base + (p - start);
+	__uwu_bytes(st, p, end - p, scan, map ? map : uwu_map);
+}
+
+static __always_inline void __uwu_swar(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan)
+{
+	__uwu_words(st, p, len, scan, NULL);
+}
+
+UWU_VARIANT(swar)
+
+#ifdef XT_PAYLOAD_X86
+/**
+ * Vector variants, the same as the SWAR one a block at a time: a block
+ * without a '\n' has its letters blended to 'w' or 'W' in one go, one
+ * with a '\n' up to it, and the command word after it is skipped in C.
+ * Blocks start at even payload offsets, so the bytes they replace and the
+ * ones they write can be kept as two running sums of native 16 bit words,
+ * low and high bytes summed apart with psadbw.
+ *
+ * Like lib/raid6, the constants are loaded into the upper registers once
+ * per kernel_fpu_begin() section and the asm statements rely on them
+ * staying put, which is safe as the kernel itself never touches the vector
+ * registers. The same goes for the two sums, and for the block the load
+ * leaves in register 0 and its hits in register 1 for the rewrite. 4-8 hold
+ * '\n', 0x20, 'l', 'r' and 'W', 9 is zero, 10 and 11 are the sums. Short
+ * runs aren't worth the FPU state save, so they go through the SWAR code
+ * instead.
+ */
+#define UWU_SIMD_MIN	256
+
+static const u8 uwu_vec_const[5][32] __aligned(32) = {
+	{ [0 ... 31] = '\n' },
+	{ [0 ... 31] = 0x20 },
+	{ [0 ... 31] = 'l' },
+	{ [0 ... 31] = 'r' },
+	{ [0 ... 31] = 'W' },
+};
+
+/**
+ * Load the block at p, returning a bit for each 'l' or 'r' and setting
+ * *nl to one for each '\n'.
+ */
+static inline unsigned int uwu_sse2_load(const u8 *p, unsigned int *nl)
+{
+	unsigned int hits;
+
+	asm volatile("movdqu %2, %%xmm0\n\t"
+		     "movdqa %%xmm0, %%xmm1\n\t"
+		     "por %%xmm5, %%xmm1\n\t"
+		     "movdqa %%xmm1, %%xmm2\n\t"
+		     "pcmpeqb %%xmm6, %%xmm1\n\t"
+		     "pcmpeqb %%xmm7, %%xmm2\n\t"
+		     "por %%xmm2, %%xmm1\n\t"
+		     "movdqa %%xmm0, %%xmm2\n\t"
+		     "pcmpeqb %%xmm4, %%xmm2\n\t"
+		     "pmovmskb %%xmm1, %0\n\t"
+		     "pmovmskb %%xmm2, %1"
+		     : "=r" (hits), "=r" (*nl)
+		     : "m" (*(const u8 (*)[16])p));
+
+	return hits;
+}
+
+/* rewrite the hits among the bytes keep leaves of the block loaded from p */
+static inline void uwu_sse2_rewrite(u8 *p, const u8 *keep)
+{
+	asm volatile("movdqu %1, %%xmm2\n\t"
+		     "pand %%xmm2, %%xmm1\n\t"
+		     "movdqa %%xmm0, %%xmm2\n\t"
+		     "pand %%xmm5, %%xmm2\n\t"
+		     "por %%xmm8, %%xmm2\n\t"
+		     "pxor %%xmm0, %%xmm2\n\t"
+		     "pand %%xmm1, %%xmm2\n\t"
+		     "pxor %%xmm0, %%xmm2\n\t"
+		     "movdqu %%xmm2, %0\n\t"
+		     "pand %%xmm1, %%xmm0\n\t"
+		     "pand %%xmm1, %%xmm2\n\t"
+		     "movdqa %%xmm0, %%xmm1\n\t"
+		     "psllw $8, %%xmm0\n\t"
+		     "psrlw $8, %%xmm0\n\t"
+		     "psrlw $8, %%xmm1\n\t"
+		     "psadbw %%xmm9, %%xmm0\n\t"
+		     "psadbw %%xmm9, %%xmm1\n\t"
+		     "psllq $8, %%xmm1\n\t"
+		     "paddq %%xmm0, %%xmm10\n\t"
+		     "paddq %%xmm1, %%xmm10\n\t"
+		     "movdqa %%xmm2, %%xmm1\n\t"
+		     "psllw $8, %%xmm2\n\t"
+		     "psrlw $8, %%xmm2\n\t"
+		     "psrlw $8, %%xmm1\n\t"
+		     "psadbw %%xmm9, %%xmm2\n\t"
+		     "psadbw %%xmm9, %%xmm1\n\t"
+		     "psllq $8, %%xmm1\n\t"
+		     "paddq %%xmm2, %%xmm11\n\t"
+		     "paddq %%xmm1, %%xmm11"
+		     : "=m" (*(u8 (*)[16])p)
+		     : "m" (*(const u8 (*)[16])keep));
+}
+
+static inline void uwu_sse2_sums(u64 *from, u64 *to)
+{
+	asm volatile("pshufd $0x4e, %%xmm10, %%xmm0\n\t"
+		     "paddq %%xmm0, %%xmm10\n\t"
+		     "movq %%xmm10, %0\n\t"
+		     "pshufd $0x4e, %%xmm11, %%xmm0\n\t"
+		     "paddq %%xmm0, %%xmm11\n\t"
+		     "movq %%xmm11, %1"
+		     : "=r" (*from), "=r" (*to));
+}
+
+static inline void uwu_sse2_begin(void)
+{
+	asm volatile("movdqa %0, %%xmm4\n\t"
+		     "movdqa %1, %%xmm5\n\t"
+		     "movdqa %2, %%xmm6\n\t"
+		     "movdqa %3, %%xmm7\n\t"
+		     "movdqa %4, %%xmm8\n\t"
+		     "pxor %%xmm9, %%xmm9\n\t"
+		     "pxor %%xmm10, %%xmm10\n\t"
+		     "pxor %%xmm11, %%xmm11"
+		     : : "m" (uwu_vec_const[0]), "m" (uwu_vec_const[1]),
+		         "m" (uwu_vec_const[2]), "m" (uwu_vec_const[3]),
+		         "m" (uwu_vec_const[4]));
+}
+
+/**
+ * The loop shared by the vector variants, block bytes at a time, built
+ * around the load, rewrite and sums of one of them. A block with a '\n'
+ * in it is done up to the '\n', which ends the body of the line.
+ */
+static __always_inline void __uwu_vec(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan, unsigned int block,
+		void (*begin)(void),
+		unsigned int (*load)(const u8 *p, unsigned int *nl),
+		void (*rewrite)(u8 *p, const u8 *keep),
+		void (*sums)(u64 *from, u64 *to))
+{
+	u8 *start = p, *end = p + len;
+	unsigned int base = st->off, rewritten = 0, hits, nl, n;
+	const u8 *keep;
+	u64 from, to;
+
+	if (len < UWU_SIMD_MIN || !irq_fpu_usable()) {
+		__uwu_swar(st, p, len, scan);
+		return;
+	}
+
+	kernel_fpu_begin();
+	begin();
+	while (end - p >= block) {
+		if (!st->uwu_mode) {
+			p = uwu_skip_command(st, p, end);
+			continue;
+		}
+		if ((base + (p - start)) & 1) {
+			st->off = base + (p - start);
+			__uwu_generic(st, p, 1, scan);
+			p++;
+			continue;
+		}
+		hits = load(p, &nl);
+		n = block;
+		keep = uwu_keep;
+		if (nl) {
+			n = __ffs(nl);
+			hits &= (1U << n) - 1;
+			keep = uwu_keep + 32 - n;
+			st->uwu_mode = 0;
+		}
+		if (hits) {
+			if (scan) {
+				st->hit = true;
+			} else {
+				rewrite(p, keep);
+				rewritten += hweight32(hits);
+			}
+		}
+		p += nl ? n + 1 : n;
+	}
+	if (!scan) {
+		sums(&from, &to);
+		xt_payload_csum_add_words(&st->csum, 0, from, to);
+		st->rewritten += rewritten;
+	}
+	kernel_fpu_end();
+
+	st->off = base + (p - start);
+	__uwu_generic(st, p, end - p, scan);
+}
+
+static __always_inline void __uwu_sse2(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan)
+{
+	__uwu_vec(st, p, len, scan, 16, uwu_sse2_begin, uwu_sse2_load,
+		  uwu_sse2_rewrite, uwu_sse2_sums);
+}
+
+UWU_VARIANT(sse2)
+
+static inline unsigned int uwu_avx2_load(const u8 *p, unsigned int *nl)
+{
+	unsigned int hits;
+
+	asm volatile("vmovdqu %2, %%ymm0\n\t"
+		     "vpor %%ymm5, %%ymm0, %%ymm2\n\t"
+		     "vpcmpeqb %%ymm6, %%ymm2, %%ymm1\n\t"
+		     "vpcmpeqb %%ymm7, %%ymm2, %%ymm2\n\t"
+		     "vpor %%ymm2, %%ymm1, %%ymm1\n\t"
+		     "vpcmpeqb %%ymm4, %%ymm0, %%ymm2\n\t"
+		     "vpmovmskb %%ymm1, %0\n\t"
+		     "vpmovmskb %%ymm2, %1"
+		     : "=r" (hits), "=r" (*nl)
+		     : "m" (*(const u8 (*)[32])p));
+
+	return hits;
+}
+
+static inline void uwu_avx2_rewrite(u8 *p, const u8 *keep)
+{
+	asm volatile("vpand %1, %%ymm1, %%ymm1\n\t"
+		     "vpand %%ymm5, %%ymm0, %%ymm2\n\t"
+		     "vpor %%ymm8, %%ymm2, %%ymm2\n\t"
+		     "vpblendvb %%ymm1, %%ymm2, %%ymm0, %%ymm2\n\t"
+		     "vmovdqu %%ymm2, %0\n\t"
+		     "vpand %%ymm1, %%ymm0, %%ymm0\n\t"
+		     "vpand %%ymm1, %%ymm2, %%ymm2\n\t"
+		     "vpsllw $8, %%ymm0, %%ymm1\n\t"
+		     "vpsrlw $8, %%ymm1, %%ymm1\n\t"
+		     "vpsrlw $8, %%ymm0, %%ymm0\n\t"
+		     "vpsadbw %%ymm9, %%ymm1, %%ymm1\n\t"
+		     "vpsadbw %%ymm9, %%ymm0, %%ymm0\n\t"
+		     "vpsllq $8, %%ymm0, %%ymm0\n\t"
+		     "vpaddq %%ymm1, %%ymm10, %%ymm10\n\t"
+		     "vpaddq %%ymm0, %%ymm10, %%ymm10\n\t"
+		     "vpsllw $8, %%ymm2, %%ymm1\n\t"
+		     "vpsrlw $8, %%ymm1, %%ymm1\n\t"
+		     "vpsrlw $8, %%ymm2, %%ymm2\n\t"
+		     "vpsadbw %%ymm9, %%ymm1, %%ymm1\n\t"
+		     "vpsadbw %%ymm9, %%ymm2, %%ymm2\n\t"
+		     "vpsllq $8, %%ymm2, %%ymm2\n\t"
+		     "vpaddq %%ymm1, %%ymm11, %%ymm11\n\t"
+		     "vpaddq %%ymm2, %%ymm11, %%ymm11"
+		     : "=m" (*(u8 (*)[32])p)
+		     : "m" (*(const u8 (*)[32])keep));
+}
+
+static inline void uwu_avx2_sums(u64 *from, u64 *to)
+{
+	asm volatile("vextracti128 $1, %%ymm10, %%xmm0\n\t"
+		     "vpaddq %%xmm0, %%xmm10, %%xmm0\n\t"
+		     "vpshufd $0x4e, %%xmm0, %%xmm1\n\t"
+		     "vpaddq %%xmm1, %%xmm0, %%xmm0\n\t"
+		     "vmovq %%xmm0, %0\n\t"
+		     "vextracti128 $1, %%ymm11, %%xmm0\n\t"
+		     "vpaddq %%xmm0, %%xmm11, %%xmm0\n\t"
+		     "vpshufd $0x4e, %%xmm0, %%xmm1\n\t"
+		     "vpaddq %%xmm1, %%xmm0, %%xmm0\n\t"
+		     "vmovq %%xmm0, %1"
+		     : "=r" (*from), "=r" (*to));
+}
+
+static inline void uwu_avx2_begin(void)
+{
+	asm volatile("vmovdqa %0, %%ymm4\n\t"
+		     "vmovdqa %1, %%ymm5\n\t"
+		     "vmovdqa %2, %%ymm6\n\t"
+		     "vmovdqa %3, %%ymm7\n\t"
+		     "vmovdqa %4, %%ymm8\n\t"
+		     "vpxor %%ymm9, %%ymm9, %%ymm9\n\t"
+		     "vpxor %%ymm10, %%ymm10, %%ymm10\n\t"
+		     "vpxor %%ymm11, %%ymm11, %%ymm11"
+		     : : "m" (uwu_vec_const[0]), "m" (uwu_vec_const[1]),
+		         "m" (uwu_vec_const[2]), "m" (uwu_vec_const[3]),
+		         "m" (uwu_vec_const[4]));
+}
+
+static __always_inline void __uwu_avx2(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan)
+{
+	__uwu_vec(st, p, len, scan, 32, uwu_avx2_begin, uwu_avx2_load,
+		  uwu_avx2_rewrite, uwu_avx2_sums);
+}
+
+UWU_VARIANT(avx2)
+
+static bool uwu_sse2_valid(void)
+{
+	return xt_payload_has_sse2();
+}
+
+static bool uwu_avx2_valid(void)
+{
+	return xt_payload_has_avx2();
+}
+#endif /* XT_PAYLOAD_X86 */
+
+/**
+ * Any map at all, so none of the shortcuts above that look for the bytes
+ * uwu_map[] rewrites: the SWAR loop with every byte of a word looked up,
+ * so that a dialect costs the same per byte as any other. Only the words
+ * that change are stored, the chunks scan() passed over may still be
+ * shared.
+ */
+static __always_inline void __uwu_table(struct uwu_state *st, u8 *p,
+		unsigned int len, bool scan)
+{
+	__uwu_words(st, p, len, scan, st->map ? st->map : uwu_map);
+}
+
+UWU_VARIANT(table)
+
+struct uwu_impl {
+	const char	*name;
+	void		(*transform)(struct uwu_state *st, u8 *p,
+				     unsigned int len);
+	void		(*scan)(struct uwu_state *st, const u8 *p,
+				unsigned int len);
+	bool		(*valid)(void);
+};
+
+static const struct uwu_impl uwu_impls[] __maybe_unused = {
+	{ .name = "generic", .transform = uwu_generic,
+	  .scan = uwu_generic_scan },
+	{ .name = "swar", .transform = uwu_swar,
+	  .scan = uwu_swar_scan },
+#ifdef XT_PAYLOAD_X86
+	{ .name = "sse2", .transform = uwu_sse2,
+	  .scan = uwu_sse2_scan, .valid = uwu_sse2_valid },
+	{ .name = "avx2", .transform = uwu_avx2,
+	  .scan = uwu_avx2_scan, .valid = uwu_avx2_valid },
+#endif
+};
+
+/* for rules with a map of their own, never picked for uwu_map */
+static const struct uwu_impl uwu_table_impl __maybe_unused = {
+	.name = "table", .transform = uwu_table, .scan = uwu_table_scan,
+};
+
+/**
+ * Whether a flow carries text at all, judged from up to UWU_CLASSIFY_LEN
+ * bytes at the start of its payload. TLS and DTLS records and a few common
+ * compressed, image and executable formats are recognised by their first
+ * bytes. Anything else counts as binary when more than an eighth of the
+ * sample is control characters (IRC formatting codes stay below that) or
+ * more than a third is bytes with the top bit set that aren't part of
+ * well-formed UTF-8, which random and compressed data always have and
+ * text in any script doesn't. Samples shorter than UWU_CLASSIFY_MIN are
+ * too small to say.
+ */
+#define UWU_CLASSIFY_LEN	64
+#define UWU_CLASSIFY_MIN	16
+
+enum {
+	UWU_CLASS_UNKNOWN,
+	UWU_CLASS_TEXT,
+	UWU_CLASS_BINARY,
+};
+
+static const struct {
+	u8	len;
+	u8	magic[5];
+} uwu_magics[] __maybe_unused = {
+	{ 2, { 0x1f, 0x8b } },				/* gzip */
+	{ 4, { 0x28, 0xb5, 0x2f, 0xfd } },		/* zstd */
+	{ 5, { 0xfd, '7', 'z', 'X', 'Z' } },		/* xz */
+	{ 4, { 'P', 'K', 0x03, 0x04 } },		/* zip */
+	{ 4, { 0x89, 'P', 'N', 'G' } },
+	{ 3, { 0xff, 0xd8, 0xff } },			/* JPEG */
+	{ 4, { 0x7f, 'E', 'L', 'F' } },
+};
+
+/* content type 20-23, then a version of 3.x or DTLS 254.x */
+static inline bool uwu_classify_tls(const u8 *p, unsigned int len)
+{
+	return len >= 3 && p[0] >= 0x14 && p[0] <= 0x17 &&
+	       ((p[1] == 0x03 && p[2] <= 0x04) ||
+		(p[1] == 0xfe && p[2] >= 0xfd));
+}
+
+/**
+ * The length of the UTF-8 sequence at the start of p, or 0 if there isn't
+ * a well-formed one: no overlong forms, surrogates or code points past
+ * U+10FFFF. A sequence the end of p cuts short counts as far as it goes.
+ */
+static inline unsigned int uwu_utf8_len(const u8 *p, unsigned int len)
+{
+	u8 c = p[0], lo = 0x80, hi = 0xbf;
+	unsigned int n, i;
+
+	if (c >= 0xc2 && c <= 0xdf)
+		n = 2;
+	else if (c >= 0xe0 && c <= 0xef)
+		n = 3;
+	else if (c >= 0xf0 && c <= 0xf4)
+		n = 4;
+	else
+		return 0;
+	if (c == 0xe0)
+		lo = 0xa0;
+	else if (c == 0xed)
+		hi = 0x9f;
+	else if (c == 0xf0)
+		lo = 0x90;
+	else if (c == 0xf4)
+		hi = 0x8f;
+
+	for (i = 1; i < n && i < len; i++) {
+		if (p[i] < lo || p[i] > hi)
+			return 0;
+		lo = 0x80;
+		hi = 0xbf;
+	}
+
+	return i;
+}
+
+static inline int uwu_classify(const u8 *p, unsigned int len)
+{
+	unsigned int i, n, ctrl = 0, high = 0;
+
+	if (uwu_classify_tls(p, len))
+		return UWU_CLASS_BINARY;
+	for (i = 0; i < ARRAY_SIZE(uwu_magics); i++) {
+		if (len >= uwu_magics[i].len &&
+		    !memcmp(p, uwu_magics[i].magic, uwu_magics[i].len))
+			return UWU_CLASS_BINARY;
+	}
+
+	if (len < UWU_CLASSIFY_MIN)
+		return UWU_CLASS_UNKNOWN;
+	len = min_t(unsigned int, len, UWU_CLASSIFY_LEN);
+	/* a TCP segment can start in the middle of a character */
+	for (i = 0; i < 3 && (p[i] & 0xc0) == 0x80; i++)
+		;
+	while (i < len) {
+		u8 c = p[i];
+
+		if (c >= 0x80) {
+			n = uwu_utf8_len(p + i, len - i);
+			if (n) {
+				i += n;
+				continue;
+			}
+			high++;
+		} else if ((c < 0x20 && c != '\t' && c != '\n' && c != '\r') ||
+			   c == 0x7f) {
+			ctrl++;
+		}
+		i++;
+	}
+	if (ctrl * 8 > len || high * 3 > len)
+		return UWU_CLASS_BINARY;
+
+	return UWU_CLASS_TEXT;
+}
+
+#endif /* _UWU_CORE_H */
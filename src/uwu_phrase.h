@@ -0,0 +1,185 @@
+/**
+ * uwu_phrase - matching the --uwu-phrase dictionary.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UWU_PHRASE_H
+#define _UWU_PHRASE_H
+
+#include "xt_payload_core.h"
+#include "xt_UWU.h"
+
+/* the most phrases rewritten in one packet, the rest is left alone */
+#define UWU_PHRASE_EDITS	16
+
+/**
+ * The matcher, fed the payload a chunk at a time. Once a phrase has
+ * matched, matching starts afresh after it, so the edits never overlap:
+ * the phrase that ends first wins, and of those ending at the same byte
+ * the longest. Without resize a phrase that would change the length of
+ * the payload doesn't count.
+ */
+struct uwu_phrase_state {
+	const struct xt_uwu_ac	*ac;
+	bool			resize;
+	u8			state;
+	/* offset of the first byte a match may start at */
+	unsigned int		start;
+	unsigned int		nr_edits;
+	int			delta;
+	struct xt_payload_edit	edits[UWU_PHRASE_EDITS];
+};
+
+/* off is that of p from the start of the payload, true once edits is full */
+static inline bool uwu_phrase_match(struct uwu_phrase_state *ps,
+		const u8 *p, unsigned int len, unsigned int off)
+{
+	const struct xt_uwu_ac *ac = ps->ac;
+	unsigned int state = ps->state, i, m;
+
+	for (i = 0; i < len; i++) {
+		const struct xt_uwu_phrase *ph;
+		struct xt_payload_edit *e;
+
+		state = ac->ac_next[state][ac->ac_class[p[i]]];
+		m = ac->ac_match[state];
+		if (!m)
+			continue;
+		ph = &ac->phrases[m - 1];
+		/* the table comes from userspace, don't take its word for it */
+		if (off + i + 1 < ps->start + ph->from_len)
+			continue;
+		if (!ps->resize && ph->to_len != ph->from_len)
+			continue;
+		e = &ps->edits[ps->nr_edits++];
+		e->off = off + i + 1 - ph->from_len;
+		e->len = ph->from_len;
+		e->data = ph->to;
+		e->data_len = ph->to_len;
+		ps->delta += (int)ph->to_len - ph->from_len;
+		ps->start = off + i + 1;
+		state = 0;
+		if (ps->nr_edits == UWU_PHRASE_EDITS)
+			break;
+	}
+	ps->state = state;
+
+	return ps->nr_edits == UWU_PHRASE_EDITS;
+}
+
+/**
+ * What the kernel checks of a table from userspace: that the matcher
+ * can't index out of it, nothing about whether it matches the phrases.
+ */
+static inline bool uwu_phrase_valid(const struct xt_uwu_ac *ac)
+{
+	unsigned int i, j;
+
+	if (ac->nr_phrases > XT_UWU_PHRASES)
+		return false;
+	for (i = 0; i < ac->nr_phrases; i++) {
+		if (!ac->phrases[i].from_len ||
+		    ac->phrases[i].from_len > XT_UWU_PHRASE_LEN ||
+		    ac->phrases[i].to_len > XT_UWU_PHRASE_LEN)
+			return false;
+	}
+	for (i = 0; i < 256; i++) {
+		if (ac->ac_class[i] >= XT_UWU_AC_CLASSES)
+			return false;
+	}
+	for (i = 0; i < XT_UWU_AC_STATES; i++) {
+		if (ac->ac_match[i] > ac->nr_phrases)
+			return false;
+		for (j = 0; j < XT_UWU_AC_CLASSES; j++) {
+			if (ac->ac_next[i][j] >= XT_UWU_AC_STATES)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+#ifndef __KERNEL__
+/**
+ * Build the DFA of ac from its phrases: the trie of them first, then
+ * breadth first the failure links, folded straight into the transitions
+ * the trie lacks, and the longest phrase ending in each state. Returns
+ * NULL or why the phrases don't fit.
+ */
+static inline const char *uwu_phrase_compile(struct xt_uwu_ac *ac)
+{
+	u8 fail[XT_UWU_AC_STATES], queue[XT_UWU_AC_STATES];
+	unsigned int nr_classes = 1, head = 0, tail = 0;
+	unsigned int i, j, k, s, t;
+
+	memset(ac->ac_class, 0, sizeof(ac->ac_class));
+	memset(ac->ac_match, 0, sizeof(ac->ac_match));
+	memset(ac->ac_next, 0, sizeof(ac->ac_next));
+	ac->nr_states = 1;
+	if (ac->nr_phrases > XT_UWU_PHRASES)
+		return "too many phrases";
+
+	for (i = 0; i < ac->nr_phrases; i++) {
+		const struct xt_uwu_phrase *ph = &ac->phrases[i];
+
+		if (!ph->from_len || ph->from_len > XT_UWU_PHRASE_LEN ||
+		    ph->to_len > XT_UWU_PHRASE_LEN)
+			return "phrase too long or empty";
+		for (s = 0, j = 0; j < ph->from_len; j++) {
+			k = ac->ac_class[ph->from[j]];
+			if (!k) {
+				if (nr_classes == XT_UWU_AC_CLASSES)
+					return "too many different bytes in the phrases";
+				k = ac->ac_class[ph->from[j]] = nr_classes++;
+			}
+			if (!ac->ac_next[s][k]) {
+				if (ac->nr_states == XT_UWU_AC_STATES)
+					return "the phrases are too long together";
+				ac->ac_next[s][k] = ac->nr_states++;
+			}
+			s = ac->ac_next[s][k];
+		}
+		ac->ac_match[s] = i + 1;
+	}
+
+	for (k = 1; k < nr_classes; k++) {
+		t = ac->ac_next[0][k];
+		if (t) {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		s = queue[head++];
+		if (!ac->ac_match[s])
+			ac->ac_match[s] = ac->ac_match[fail[s]];
+		for (k = 1; k < nr_classes; k++) {
+			t = ac->ac_next[s][k];
+			if (t) {
+				fail[t] = ac->ac_next[fail[s]][k];
+				queue[tail++] = t;
+			} else {
+				ac->ac_next[s][k] = ac->ac_next[fail[s]][k];
+			}
+		}
+	}
+
+	return NULL;
+}
+#endif /* !__KERNEL__ */
+
+#endif /* _UWU_PHRASE_H */
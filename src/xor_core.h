@@ -0,0 +1,99 @@
+/**
+ * xor_core - the XOR transform kernel.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ * Copyright (C) 2013 Changli Gao <xiaosuo@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XOR_CORE_H
+#define _XOR_CORE_H
+
+#include "xt_payload_core.h"
+
+/**
+ * The key written out over and over, so that for every phase of the key
+ * the next period bytes of keystream sit in one straight run from
+ * bytes[phase]: the hot loop XORs whole u64s against it at any phase and
+ * never has to check for the end of the key. period is a multiple of
+ * both the key length and 8, so the phase is the same again after each
+ * period and only the last few bytes of a chunk go one at a time. Built
+ * once per rule, when it is added.
+ */
+#define XOR_STREAM_LEN		1024
+#define XOR_MAX_KEY_LEN		32
+
+struct xor_keystream {
+	u8		bytes[XOR_STREAM_LEN] __aligned(64);
+	unsigned int	key_len;
+	unsigned int	period;
+};
+
+/* key_len is 1 to XOR_MAX_KEY_LEN */
+static inline void xor_keystream_init(struct xor_keystream *ks,
+		const u8 *key, unsigned int key_len)
+{
+	unsigned int i, step = key_len;
+
+	while (step % 8)
+		step += key_len;
+	ks->key_len = key_len;
+	ks->period = (XOR_STREAM_LEN - key_len) / step * step;
+	for (i = 0; i < XOR_STREAM_LEN; i++)
+		ks->bytes[i] = key[i % key_len];
+}
+
+struct xor_walk {
+	const struct xor_keystream	*ks;
+	/* the key phase, carried from one chunk to the next */
+	unsigned int			key_off;
+	struct xt_payload_csum		csum;
+};
+
+/* len bytes at p, which sit off bytes into the payload */
+static inline void xor_transform(struct xor_walk *w, u8 *p,
+		unsigned int len, unsigned int off)
+{
+	const struct xor_keystream *ks = w->ks;
+	const u8 *k = ks->bytes + w->key_off;
+	unsigned int start = off, i, n;
+	u64 from = 0, to = 0;
+
+	w->key_off = (w->key_off + len) % ks->key_len;
+	for (; len >= 8; p += n, len -= n) {
+		n = min_t(unsigned int, len & ~7U, ks->period);
+		for (i = 0; i < n; i += 8) {
+			u64 v = get_unaligned((u64 *)(p + i));
+			u64 x = v ^ get_unaligned((const u64 *)(k + i));
+
+			put_unaligned(x, (u64 *)(p + i));
+			from += (u32)v + (v >> 32);
+			to += (u32)x + (x >> 32);
+		}
+		off += n;
+	}
+	xt_payload_csum_add_words(&w->csum, start, from, to);
+
+	/* n is a whole number of periods unless this is the end */
+	k += (off - start) % ks->period;
+	for (i = 0; i < len; i++) {
+		u8 from = p[i];
+
+		p[i] ^= k[i];
+		xt_payload_csum_add(&w->csum, off + i, from, p[i]);
+	}
+}
+
+#endif /* _XOR_CORE_H */
@@ -18,168 +18,811 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
 #include "xt_UWU.h"
+#include "xt_payload.h"
+#include "xt_payload_stat.h"
+#include "uwu_core.h"
+#include "xor_core.h"
+#include "uwu_phrase.h"
+#include "xt_uwu_flow.h"
 
 #include <linux/module.h>
-#include <linux/ip.h>
-#include <net/ip.h>
 #include <linux/netfilter/x_tables.h>
-#include <net/netfilter/ipv4/nf_defrag_ipv4.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/proc_fs.h>
+#include <linux/timekeeping.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_seqadj.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Ben Cartwright-Cox <ben@benjojo.co.uk>");
 MODULE_DESCRIPTION("Xtables: uwu application data");
 MODULE_ALIAS("ipt_UWU");
 
-static unsigned int skb_uwu(struct sk_buff *skb, unsigned int offset)
-{
-	unsigned int headlen = skb_headlen(skb);
-	struct sk_buff *frag_iter;
-
-	// In order to preserve protocols like IRC, we must prevent the command word (like PRIVMSG)
-	// from being uwu'd (pwivmsg)
-	int uwu_mode = 0;
-
-	if (headlen > offset) {
-		headlen -= offset;
-
-		while (headlen-- > 0) {
-			offset++;
-			if (uwu_mode) {
-				switch (skb->data[offset]) 
-				{
-				case 'l':
-					skb->data[offset] = 'w';
-					break;
-				case 'r':
-					skb->data[offset] = 'w';
-					break;
-				case 'L':
-					skb->data[offset] = 'W';
-					break;
-				case 'R':
-					skb->data[offset] = 'W';
-					break;
-				case '\n':
-					uwu_mode = 0;
-					break;
-				default:
-					break;
-				}
-			} else {
-				if (!(skb->data[offset] >= 'A' && skb->data[offset] <= 'Z')) {
-					uwu_mode = 1;
-				}
+static const struct uwu_impl *uwu_impl __read_mostly = &uwu_impls[0];
+
+static char *impl;
+module_param(impl, charp, 0444);
+MODULE_PARM_DESC(impl, "transform variant to use instead of the fastest one");
+
+#define UWU_BENCH_SIZE	4096
+#define UWU_BENCH_LOOPS	64
+
+/**
+ * Pick the fastest usable variant, the same way lib/raid6 does: run each of
+ * them over a page of text a few times and keep the one that took the least
+ * time.
+ */
+static int uwu_select_impl(void)
+{
+	static const char text[] = "PRIVMSG #lobby :hello world, are rollers rare?\n";
+	const struct uwu_impl *best = NULL;
+	u64 best_ns = U64_MAX, t;
+	u8 *src, *buf;
+	int i, j;
+
+	if (impl) {
+		for (i = 0; i < ARRAY_SIZE(uwu_impls); i++) {
+			if (strcmp(impl, uwu_impls[i].name) == 0 &&
+			    (!uwu_impls[i].valid || uwu_impls[i].valid())) {
+				uwu_impl = &uwu_impls[i];
+				return 0;
 			}
+		}
+		pr_err("transform variant %s is not available\n", impl);
+		return -EINVAL;
+	}
+
+	src = kmalloc(UWU_BENCH_SIZE * 2, GFP_KERNEL);
+	if (!src)
+		return -ENOMEM;
+	buf = src + UWU_BENCH_SIZE;
+	for (i = 0; i < UWU_BENCH_SIZE; i++)
+		src[i] = text[i % (sizeof(text) - 1)];
+
+	for (i = 0; i < ARRAY_SIZE(uwu_impls); i++) {
+		if (uwu_impls[i].valid && !uwu_impls[i].valid())
+			continue;
+		t = ktime_get_ns();
+		for (j = 0; j < UWU_BENCH_LOOPS; j++) {
+			struct uwu_state st = { .uwu_mode = 1 };
 
-			// skb->data[offset++] ^= key[key_off++];
+			memcpy(buf, src, UWU_BENCH_SIZE);
+			uwu_impls[i].transform(&st, buf, UWU_BENCH_SIZE);
 		}
-		offset = 0;
-	} else {
-		offset -= headlen;
-	}
-	skb_walk_frags(skb, frag_iter) {
-		if (frag_iter->len > offset) {
-			skb_uwu(frag_iter, offset);
-			offset = 0;
-		} else {
-			offset -= frag_iter->len;
+		t = ktime_get_ns() - t;
+		if (t < best_ns) {
+			best_ns = t;
+			best = &uwu_impls[i];
 		}
 	}
+	kfree(src);
+
+	uwu_impl = best;
+	pr_info("using %s transform\n", best->name);
 
 	return 0;
 }
 
-static unsigned int uwu_tg(struct sk_buff *skb,
-		const struct xt_action_param *par)
+/**
+ * A rule's token bucket on one CPU, see xt_uwu_info.budget_rate, and how
+ * often a packet found it short. tokens is in HZ-ths of a byte, so that
+ * every jiffy credits budget_rate of them and no rate loses a remainder.
+ */
+struct uwu_budget {
+	u64		tokens;
+	unsigned long	stamp;
+	u64		hits;
+};
+
+/* Per-packet state of the walk */
+struct uwu_pkt {
+	struct uwu_state		st;
+	/* uwu_impl, or uwu_table_impl for a rule with its own map */
+	const struct uwu_impl		*impl;
+	/* the rule's bounds, NULL for none */
+	const struct xt_uwu_info	*info;
+	struct xt_payload_stats __percpu *stats;
+	struct nf_conn			*ct;
+	enum ip_conntrack_info		ctinfo;
+	u32				ct_id;
+	/* the XOR stage if xw.ks isn't NULL, and both stages' csum */
+	struct xor_walk			xw;
+	struct xt_payload_csum		csum;
+	/* the flow is binary, only the XOR stage runs */
+	bool				xor_only;
+	/* the rule's phrases if it has any, see uwu_phrases() */
+	const struct xt_uwu_ac		*ac;
+	/* the payload length before uwu_phrases(), and what it wrote */
+	unsigned int			len_in;
+	unsigned int			spliced;
+	/* the rule's buckets, NULL for no budget */
+	struct uwu_budget __percpu	*budget;
+};
+
+static bool uwu_scan(void *priv, const struct xt_payload_chunk *c)
 {
-	const struct xt_uwu_info *uwu_info = par->targinfo;
-	struct iphdr *iph, _iph;
-	unsigned int doff;
-	struct sk_buff *last_skb;
+	struct uwu_pkt *p = priv;
+	struct uwu_state *st = &p->st;
+
+	st->hit = false;
+	st->off = c->off;
+	p->impl->scan(st, c->data, c->len);
+
+	return st->hit;
+}
+
+static void uwu_reset(void *priv)
+{
+	struct uwu_state *st = &((struct uwu_pkt *)priv)->st;
+	int start_mode = st->start_mode;
+	const u8 *map = st->map;
+
+	memset(st, 0, sizeof(*st));
+	st->uwu_mode = st->start_mode = start_mode;
+	st->map = map;
+}
+
+static int uwu_mangle(void *priv, const struct xt_payload_chunk *c)
+{
+	struct uwu_pkt *p = priv;
+	struct uwu_state *st = &p->st;
+
+	st->off = c->off;
+	p->impl->transform(st, c->data, c->len);
+
+	return 0;
+}
+
+static const struct xt_payload_ops uwu_payload_ops = {
+	.scan	= uwu_scan,
+	.reset	= uwu_reset,
+	.mangle	= uwu_mangle,
+};
+
+/**
+ * Both stages one block at a time, so the XOR stage finds the bytes the
+ * uwu stage just wrote still in L1 however large the chunk is.
+ */
+#define UWU_PIPE_BLOCK	2048
+
+static int uwu_xor_mangle(void *priv, const struct xt_payload_chunk *c)
+{
+	struct uwu_pkt *p = priv;
+	unsigned int off, n;
+
+	for (off = 0; off < c->len; off += n) {
+		n = min_t(unsigned int, c->len - off, UWU_PIPE_BLOCK);
+		if (!p->xor_only) {
+			p->st.off = c->off + off;
+			p->impl->transform(&p->st, c->data + off, n);
+		}
+		xor_transform(&p->xw, c->data + off, n, c->off + off);
+	}
+	xt_payload_csum_chain(&p->csum, &p->st.csum, &p->xw.csum);
+
+	return 0;
+}
+
+/**
+ * With the XOR stage every byte changes, so there is nothing to scan for,
+ * and xor_transform() sums all of them.
+ */
+static const struct xt_payload_ops uwu_xor_payload_ops = {
+	.mangle		= uwu_xor_mangle,
+	.sums_all	= true,
+};
+
+static struct uwu_flow_table uwu_flows __read_mostly;
+
+static unsigned int flow_slots = 4096;
+module_param(flow_slots, uint, 0444);
+MODULE_PARM_DESC(flow_slots, "connections to keep uwu state across TCP "
+		 "segments for, 0 to disable");
+
+static bool skip_binary = true;
+module_param(skip_binary, bool, 0644);
+MODULE_PARM_DESC(skip_binary, "leave flows alone whose payload starts out "
+		 "looking binary");
+
+/**
+ * uwu_classify() on the start of the payload of pkt, or with tls_only
+ * just the check for a TLS record, which is how a flow that was text so
+ * far shows it has switched to TLS (STARTTLS).
+ */
+static int uwu_classify_pkt(const struct sk_buff *skb,
+		const struct xt_payload_pkt *pkt, bool tls_only)
+{
+	unsigned int len = min_t(unsigned int, pkt->len, UWU_CLASSIFY_LEN);
+	u8 buf[UWU_CLASSIFY_LEN];
+	const u8 *data;
 
-	iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
-	if (!iph) {
-			printk(KERN_ALERT "!iph");
-		goto err;
+	if (tls_only)
+		len = min(len, 3U);
+	data = skb_header_pointer(skb, pkt->doff, len, buf);
+	if (!data)
+		return UWU_CLASS_UNKNOWN;
+	if (tls_only)
+		return uwu_classify_tls(data, len) ? UWU_CLASS_BINARY :
+						     UWU_CLASS_TEXT;
+
+	return uwu_classify(data, len);
+}
+
+static int uwu_phrase_fn(void *priv, const struct xt_payload_chunk *c)
+{
+	return uwu_phrase_match(priv, c->data, c->len, c->off);
+}
+
+/**
+ * The --uwu-phrase pass, ahead of the walk: all the phrases matched in one
+ * go over the part of the payload the walk covers, and the replacements
+ * spliced in. A TCP payload can only change length if conntrack shifts the
+ * sequence numbers of the rest of the connection to match, for which it
+ * needs the seqadj extension added before the connection was confirmed,
+ * see xt_uwu_payload(). Otherwise, and for GSO skbs, only phrases as long
+ * as what they replace are rewritten, and none at all on a frag_list GSO
+ * skb, see xt_payload_splice(). Returns false if nothing is left for the
+ * walk.
+ */
+static bool uwu_phrases(struct uwu_pkt *p, struct sk_buff *skb,
+		struct xt_payload_pkt *pkt)
+{
+	struct uwu_phrase_state ps = { .ac = p->ac };
+	unsigned int len = pkt->len - pkt->skip, i;
+	int ret;
+
+	if (pkt->limit && pkt->limit < len)
+		len = pkt->limit;
+	ps.resize = !skb_is_gso(skb) && (pkt->protocol == IPPROTO_UDP ||
+					 (p->ct && nfct_seqadj(p->ct)));
+	ret = xt_payload_walk(skb, pkt->doff, pkt->skip, len, uwu_phrase_fn,
+			      &ps);
+	if (ret < 0 || !ps.nr_edits)
+		return true;
+	ret = xt_payload_splice(skb, pkt, ps.edits, ps.nr_edits, p->stats);
+	if (ret < 0)
+		return true;
+	if (ret && pkt->protocol == IPPROTO_TCP)
+		nf_ct_seqadj_set(p->ct, p->ctinfo, htonl(pkt->seq), ret);
+
+	pkt->spliced = true;
+	for (i = 0; i < ps.nr_edits; i++)
+		p->spliced += ps.edits[i].data_len;
+	/* 0 would mean up to the end */
+	if (pkt->limit) {
+		pkt->limit = len + ret;
+		if (!pkt->limit)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Take the bytes the walk over pkt is going to cover out of this CPU's
+ * bucket, first topping it up at budget_rate bytes a second for the
+ * jiffies since it was last used, as xt_limit does. This comes after the
+ * binary check, so only packets that are going to be walked pay. The
+ * phrases and the walk cost in proportion to those bytes, so a packet that
+ * doesn't fit is left alone right here, or with budget_cut gets its walk
+ * cut down to what is left. The targets run with BH disabled, which keeps
+ * this CPU's bucket to ourselves.
+ */
+static bool uwu_budget_take(struct uwu_pkt *p, struct xt_payload_pkt *pkt)
+{
+	const struct xt_uwu_info *info = p->info;
+	u64 cap = (u64)(info->budget_burst ?: info->budget_rate) * HZ;
+	struct uwu_budget *b = this_cpu_ptr(p->budget);
+	unsigned long now = jiffies, delta = now - b->stamp;
+	unsigned int walk, left;
+
+	/* past cap / rate jiffies the bucket is full, and rate * delta fits */
+	if (delta >= div_u64(cap, info->budget_rate))
+		b->tokens = cap;
+	else
+		b->tokens = min(cap, b->tokens + (u64)info->budget_rate * delta);
+	b->stamp = now;
+
+	walk = pkt->len > pkt->skip ? pkt->len - pkt->skip : 0;
+	if (pkt->limit)
+		walk = min(walk, pkt->limit);
+	if (b->tokens >= (u64)walk * HZ) {
+		b->tokens -= (u64)walk * HZ;
+		return true;
+	}
+
+	b->hits++;
+	left = div_u64(b->tokens, HZ);
+	if (!info->budget_cut || !left) {
+		xt_payload_stat_inc(p->stats, XT_PAYLOAD_STAT_SKIP_BUDGET);
+		return false;
+	}
+	xt_payload_stat_inc(p->stats, XT_PAYLOAD_STAT_BUDGET_CUT);
+	pkt->limit = left;
+	b->tokens -= (u64)left * HZ;
+
+	return true;
+}
+
+static bool uwu_prepare(void *priv, struct sk_buff *skb,
+		struct xt_payload_pkt *pkt)
+{
+	int class = UWU_CLASS_UNKNOWN, known, mode;
+	const struct xt_uwu_info *info;
+	struct uwu_pkt *p = priv;
+
+	p->len_in = pkt->len;
+	info = p->info;
+	if (info) {
+		if (pkt->len < info->min_len ||
+		    (info->max_len && pkt->len > info->max_len))
+			return false;
+		pkt->skip = info->offset;
+		pkt->limit = info->max_bytes;
+	}
+	pkt->csum = &p->st.csum;
+	if (p->xw.ks) {
+		pkt->ops = &uwu_xor_payload_ops;
+		pkt->csum = &p->csum;
+	}
+
+	if (uwu_flows.slots || p->ac)
+		p->ct = nf_ct_get(skb, &p->ctinfo);
+	if (p->ct && uwu_flows.slots) {
+		p->ct_id = nf_ct_get_id(p->ct);
+		mode = uwu_flow_lookup(&uwu_flows, p->ct, p->ct_id,
+				CTINFO2DIR(p->ctinfo), pkt->seq, &class);
+		/**
+		 * Pick the stream up where the previous segment left it.
+		 * That is only known at the start of a TCP segment.
+		 */
+		if (pkt->protocol == IPPROTO_TCP && !pkt->skip)
+			p->st.uwu_mode = p->st.start_mode = mode;
 	}
 
-	if (ip_is_fragment(iph)) {
-			printk(KERN_ALERT "ip_is_fragment");
-		goto err;
+	if (!READ_ONCE(skip_binary))
+		goto text;
+	/* a flow known to be binary costs the lookup above and nothing else */
+	if (class != UWU_CLASS_BINARY) {
+		known = class;
+		class = uwu_classify_pkt(skb, pkt, known == UWU_CLASS_TEXT);
+		if (p->ct && uwu_flows.slots && class != known &&
+		    class != UWU_CLASS_UNKNOWN)
+			uwu_flow_set_class(&uwu_flows, p->ct, p->ct_id,
+					CTINFO2DIR(p->ctinfo), class);
+	}
+	if (class == UWU_CLASS_BINARY) {
+		xt_payload_stat_inc(p->stats, XT_PAYLOAD_STAT_SKIP_BINARY);
+		xt_payload_stat_add(p->stats, XT_PAYLOAD_STAT_BYTES_SKIPPED,
+				    pkt->len);
+		/* a rule of its own would XOR binary flows too */
+		p->xor_only = true;
+		return p->xw.ks != NULL;
 	}
-	if (iph->protocol == IPPROTO_TCP) {
-		struct tcphdr *tcph, _tcph;
+text:
+	if (info && info->budget_rate && p->budget &&
+	    !uwu_budget_take(p, pkt))
+		return false;
+	if (p->ac)
+		return uwu_phrases(p, skb, pkt);
+
+	return true;
+}
+
+static void uwu_finish(void *priv, struct sk_buff *skb,
+		struct xt_payload_pkt *pkt, int ret)
+{
+	struct uwu_pkt *p = priv;
+
+	if (ret < 0)
+		return;
+	/**
+	 * A walk that stopped short doesn't know how the segment ended. The
+	 * next segment's sequence number is still the one from before the
+	 * phrases, seqadj only shifts it further down the path.
+	 */
+	if (p->ct && uwu_flows.slots && pkt->protocol == IPPROTO_TCP &&
+	    xt_payload_pkt_whole(pkt))
+		uwu_flow_update(&uwu_flows, p->ct, p->ct_id,
+				CTINFO2DIR(p->ctinfo), pkt->seq, p->len_in,
+				p->st.start_mode, p->st.uwu_mode);
+	if (!p->xw.ks)
+		pkt->rewritten = p->st.rewritten + p->spliced;
+}
+
+/**
+ * What the bounds, map, phrases and XOR key of a rule or of a named config
+ * come down to, see uwu_conf_build(). info is where they came from and
+ * lives at least as long.
+ */
+struct uwu_conf {
+	const struct xt_uwu_info	*info;
+	/* the XOR stage, built from info->xor_key */
+	struct xor_keystream		*ks;
+	/* uwu_map_init() of info->map, NULL for uwu_map */
+	u8				*map;
+};
+
+static void uwu_conf_free(void *data)
+{
+	struct uwu_conf *conf = data;
+
+	kfree(conf->map);
+	kfree(conf->ks);
+	kfree(conf);
+}
+
+static struct uwu_conf *uwu_conf_build(const struct xt_uwu_info *info)
+{
+	struct uwu_conf *conf;
+
+	if (info->max_len && info->min_len > info->max_len)
+		return ERR_PTR(-EINVAL);
+	if (info->xor_key_len > sizeof(info->xor_key))
+		return ERR_PTR(-EINVAL);
+	if (info->map_set > 1 || info->budget_cut > 1)
+		return ERR_PTR(-EINVAL);
+	/* without budget_cut a burst below one packet never lets any through */
+	if (info->budget_rate && !info->budget_cut &&
+	    (info->budget_burst ?: info->budget_rate) < xt_uwu_budget_need(info))
+		return ERR_PTR(-EINVAL);
+	if (!uwu_phrase_valid(&info->phrases))
+		return ERR_PTR(-EINVAL);
 
-		tcph = skb_header_pointer(skb, par->thoff, sizeof(_tcph),
-				&_tcph);
-		if (!tcph) {
-			printk(KERN_ALERT "tcph");
+	conf = kzalloc(sizeof(*conf), GFP_KERNEL);
+	if (!conf)
+		return ERR_PTR(-ENOMEM);
+	conf->info = info;
+	if (info->xor_key_len) {
+		conf->ks = kmalloc(sizeof(*conf->ks), GFP_KERNEL);
+		if (!conf->ks)
 			goto err;
+		xor_keystream_init(conf->ks, info->xor_key,
+				   info->xor_key_len);
+	}
+	/* the built in map is better served by the fastest variant */
+	if (info->map_set) {
+		conf->map = kmalloc(sizeof(uwu_map), GFP_KERNEL);
+		if (!conf->map)
+			goto err;
+		uwu_map_init(conf->map, info->map);
+		if (!memcmp(conf->map, uwu_map, sizeof(uwu_map))) {
+			kfree(conf->map);
+			conf->map = NULL;
 		}
-		doff = tcph->doff * 4;
-	} else if (iph->protocol == IPPROTO_UDP) {
-		doff = sizeof(struct udphdr);
-	} else {
-		goto out;
 	}
-	doff += par->thoff;
-	if (skb->len < doff) {
-			printk(KERN_ALERT "skb->len < doff");
-		goto err;
+
+	return conf;
+
+err:
+	uwu_conf_free(conf);
+	return ERR_PTR(-ENOMEM);
+}
+
+/* A named config, which can't name another one in turn */
+static void *uwu_conf_build_named(const void *data)
+{
+	const struct xt_uwu_info *info = data;
+
+	if (info->conf[0])
+		return ERR_PTR(-EINVAL);
+
+	return uwu_conf_build(info);
+}
+
+static struct xt_payload_target uwu_payload = {
+	.name		= "xt_uwu",
+	.ops		= &uwu_payload_ops,
+	.prepare	= uwu_prepare,
+	.finish		= uwu_finish,
+	.conf_size	= offsetof(struct xt_uwu_info, id),
+	.conf_build	= uwu_conf_build_named,
+	.conf_free	= uwu_conf_free,
+};
+
+struct xt_uwu_rule_stats {
+	u64	packets;
+	u64	bytes;
+};
+
+/**
+ * The counters of a rule and its budget, shared by every instance of the
+ * rule: iptables checks each rule of a table again whenever anything in
+ * it changes, and the new instance takes over those of the old one.
+ */
+struct uwu_rule_ctr {
+	refcount_t				refs;
+	struct xt_uwu_rule_stats __percpu	*stats;
+	/* for a budget in the config, which a named one can get any time */
+	struct uwu_budget __percpu		*budget;
+};
+
+/**
+ * Kernel side of a rule. The id is handed back to userspace in
+ * xt_uwu_info so libxt_UWU can find the rule in /proc/net/xt_uwu_rules,
+ * and comes back in it with the rule when iptables replaces the table.
+ * 0 is no id yet.
+ */
+struct xt_uwu_priv {
+	struct list_head			list;
+	u32					id;
+	struct uwu_rule_ctr			*ctr;
+	/* the rule's own config, or NULL if it names one */
+	struct uwu_conf				*conf;
+	struct xt_payload_conf			*named;
+};
+
+struct uwu_net {
+	struct xt_payload_net			payload;
+	/* all the rules of this netns, under uwu_rules_mutex */
+	struct list_head			rules;
+	u32					next_id;
+};
+
+static unsigned int uwu_net_id __read_mostly;
+static DEFINE_MUTEX(uwu_rules_mutex);
+
+/**
+ * Phrases can change the length of a TCP segment only on connections that
+ * carry the seqadj extension, which has to be added while the connection
+ * is new: on its first packet, before conntrack confirms it.
+ */
+static void uwu_seqadj_init(struct sk_buff *skb)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct = nf_ct_get(skb, &ctinfo);
+
+	if (ct && !nf_ct_is_confirmed(ct) && !nfct_seqadj(ct) &&
+	    nf_ct_protonum(ct) == IPPROTO_TCP)
+		nfct_seqadj_ext_add(ct);
+}
+
+/**
+ * Everything past the IPv4 header, shared by the UWU target and the nft
+ * uwu expression, with what conf says if it isn't NULL and its budget
+ * taken from budget. Returns NF_DROP or NF_ACCEPT, the latter meaning
+ * carry on with the next rule, and if @rewritten isn't NULL the bytes
+ * uwu'd.
+ */
+unsigned int xt_uwu_payload(struct sk_buff *skb, struct net *net,
+		unsigned int thoff, const struct uwu_conf *conf,
+		struct uwu_budget __percpu *budget, unsigned int *rewritten)
+{
+	struct uwu_net *un = net_generic(net, uwu_net_id);
+	struct uwu_pkt p = {
+		.st.uwu_mode	= 0,
+		.impl		= uwu_impl,
+		.info		= conf ? conf->info : NULL,
+		.stats		= un->payload.stats,
+		.xw.ks		= conf ? conf->ks : NULL,
+		.budget		= budget,
+	};
+
+	if (conf && conf->map) {
+		p.impl = &uwu_table_impl;
+		p.st.map = conf->map;
 	}
+	if (conf && conf->info->phrases.nr_phrases) {
+		p.ac = &conf->info->phrases;
+		uwu_seqadj_init(skb);
+	}
+
+	return xt_payload_run(&uwu_payload, &un->payload, skb, thoff, &p,
+			      rewritten);
+}
+EXPORT_SYMBOL_GPL(xt_uwu_payload);
 
-	if (skb_cow_data(skb, 0, &last_skb) < 0) {
-			printk(KERN_ALERT "skb_cow_data");
-		goto err;
+/**
+ * Takes what a rule using xt_uwu_payload() needs from @net: defrag, and
+ * conntrack when the stream state is on.
+ */
+int xt_uwu_net_get(struct net *net, u8 family)
+{
+	int ret;
+
+	ret = xt_payload_defrag_get(net);
+	if (ret || !uwu_flows.slots)
+		return ret;
+	ret = nf_ct_netns_get(net, family);
+	if (ret)
+		xt_payload_defrag_put(net);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(xt_uwu_net_get);
+
+void xt_uwu_net_put(struct net *net, u8 family)
+{
+	if (uwu_flows.slots)
+		nf_ct_netns_put(net, family);
+	xt_payload_defrag_put(net);
+}
+EXPORT_SYMBOL_GPL(xt_uwu_net_put);
+
+static unsigned int uwu_tg(struct sk_buff *skb,
+		const struct xt_action_param *par)
+{
+	const struct xt_uwu_info *uwu_info = par->targinfo;
+	const struct xt_uwu_priv *priv = uwu_info->priv;
+	struct xt_uwu_rule_stats __percpu *rule_stats = priv->ctr->stats;
+	const struct uwu_conf *conf = priv->conf;
+	unsigned int rewritten = 0;
+
+	/**
+	 * A named config can be set again at any time, the RCU read side
+	 * the hooks run in keeps the one this packet got.
+	 */
+	if (priv->named)
+		conf = xt_payload_conf_deref(priv->named);
+	if (xt_uwu_payload(skb, xt_net(par), par->thoff, conf,
+			   priv->ctr->budget, &rewritten) == NF_DROP)
+		return NF_DROP;
+	if (rewritten) {
+		this_cpu_inc(rule_stats->packets);
+		this_cpu_add(rule_stats->bytes, rewritten);
 	}
-	skb_uwu(skb, doff);
 
-	iph = ip_hdr(skb);
-	if (iph->protocol == IPPROTO_TCP) {
-		struct tcphdr *tcph;
-		int skfail = skb_ensure_writable(skb, par->thoff + sizeof(*tcph));
-		if (skfail < 0) {
-			printk(KERN_ALERT "skb_ensure_writable %d", skfail);
-			goto err;
+	return XT_CONTINUE;
+}
+
+/**
+ * conntrack keys the stream state and carries the seqadj for phrases,
+ * which a named config can get at any time.
+ */
+static bool uwu_tg_needs_ct(const struct xt_uwu_info *uwu_info)
+{
+	return uwu_flows.slots || uwu_info->phrases.nr_phrases ||
+	       uwu_info->conf[0];
+}
+
+static void uwu_tg_conf_put(struct xt_uwu_priv *priv)
+{
+	if (priv->named)
+		xt_payload_conf_put(priv->named);
+	if (priv->conf)
+		uwu_conf_free(priv->conf);
+}
+
+static void uwu_rule_ctr_put(struct uwu_rule_ctr *ctr)
+{
+	if (!refcount_dec_and_test(&ctr->refs))
+		return;
+	free_percpu(ctr->budget);
+	free_percpu(ctr->stats);
+	kfree(ctr);
+}
+
+/**
+ * Number priv and give it its counters, those of the instance of the rule
+ * that had id before if there is exactly one, so that a rule which comes
+ * back twice in the same table doesn't count for both. Called with
+ * uwu_rules_mutex held.
+ */
+static int uwu_rule_ctr_get(struct uwu_net *un, struct xt_uwu_priv *priv,
+		u32 id)
+{
+	struct xt_uwu_priv *old, *found = NULL;
+	struct uwu_rule_ctr *ctr;
+
+	if (id) {
+		list_for_each_entry(old, &un->rules, list) {
+			if (old->id != id)
+				continue;
+			if (found) {
+				found = NULL;
+				break;
+			}
+			found = old;
 		}
-		iph = ip_hdr(skb);
-		tcph = (struct tcphdr *)(skb->data + par->thoff);
-		tcph->check = ~csum_tcpudp_magic(iph->saddr,
-				iph->daddr, skb->len - par->thoff,
-				IPPROTO_TCP, 0);
-		skb->ip_summed = CHECKSUM_PARTIAL;
-		skb->csum_start = (unsigned char *)tcph - skb->head;
-		skb->csum_offset = offsetof(struct tcphdr, check);
-	} else {
-		struct udphdr *udph;
+	}
+	if (found) {
+		refcount_inc(&found->ctr->refs);
+		priv->ctr = found->ctr;
+		priv->id = id;
+		return 0;
+	}
 
-		if (skb_ensure_writable(skb, doff)) {
-			printk(KERN_ALERT "skb_ensure_writable 2");
-			goto err;
+	ctr = kzalloc(sizeof(*ctr), GFP_KERNEL);
+	if (!ctr)
+		return -ENOMEM;
+	ctr->stats = alloc_percpu(struct xt_uwu_rule_stats);
+	ctr->budget = alloc_percpu(struct uwu_budget);
+	if (!ctr->stats || !ctr->budget) {
+		free_percpu(ctr->budget);
+		free_percpu(ctr->stats);
+		kfree(ctr);
+		return -ENOMEM;
+	}
+	refcount_set(&ctr->refs, 1);
+	priv->ctr = ctr;
+	priv->id = ++un->next_id;
+
+	return 0;
+}
+
+static int uwu_tg_check(const struct xt_tgchk_param *par)
+{
+	struct uwu_net *un = net_generic(par->net, uwu_net_id);
+	struct xt_uwu_info *uwu_info = par->targinfo;
+	struct xt_uwu_priv *priv;
+	int ret;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	if (uwu_info->conf[0]) {
+		priv->named = xt_payload_conf_get(&un->payload, uwu_info->conf);
+		if (IS_ERR(priv->named)) {
+			ret = PTR_ERR(priv->named);
+			priv->named = NULL;
+			goto err_priv;
 		}
-		iph = ip_hdr(skb);
-		udph = (struct udphdr *)(skb->data + par->thoff);
-		if (udph->check) {
-			udph->check = ~csum_tcpudp_magic(iph->saddr,
-					iph->daddr, skb->len - par->thoff,
-					IPPROTO_UDP, 0);
-			skb->ip_summed = CHECKSUM_PARTIAL;
-			skb->csum_start = (unsigned char *)udph - skb->head;
-			skb->csum_offset = offsetof(struct udphdr, check);
+	} else {
+		priv->conf = uwu_conf_build(uwu_info);
+		if (IS_ERR(priv->conf)) {
+			ret = PTR_ERR(priv->conf);
+			priv->conf = NULL;
+			goto err_priv;
 		}
 	}
-out:
-	return XT_CONTINUE;
-err:
-	printk(KERN_ALERT "owo no");
-	return NF_DROP;
+	ret = xt_payload_defrag_get(par->net);
+	if (ret)
+		goto err_conf;
+	if (uwu_tg_needs_ct(uwu_info)) {
+		ret = nf_ct_netns_get(par->net, par->family);
+		if (ret)
+			goto err_defrag;
+	}
+
+	mutex_lock(&uwu_rules_mutex);
+	ret = uwu_rule_ctr_get(un, priv, uwu_info->id);
+	if (!ret)
+		list_add_tail(&priv->list, &un->rules);
+	mutex_unlock(&uwu_rules_mutex);
+	if (ret)
+		goto err_ct;
+
+	uwu_info->id = priv->id;
+	uwu_info->priv = priv;
+
+	return 0;
+
+err_ct:
+	if (uwu_tg_needs_ct(uwu_info))
+		nf_ct_netns_put(par->net, par->family);
+err_defrag:
+	xt_payload_defrag_put(par->net);
+err_conf:
+	uwu_tg_conf_put(priv);
+err_priv:
+	kfree(priv);
+	return ret;
 }
 
-static int uwu_tg_check(const struct xt_tgchk_param *par)
+static void uwu_tg_destroy(const struct xt_tgdtor_param *par)
 {
 	const struct xt_uwu_info *uwu_info = par->targinfo;
-	return 0;
+	struct xt_uwu_priv *priv = uwu_info->priv;
+
+	mutex_lock(&uwu_rules_mutex);
+	list_del(&priv->list);
+	mutex_unlock(&uwu_rules_mutex);
+
+	if (uwu_tg_needs_ct(uwu_info))
+		nf_ct_netns_put(par->net, par->family);
+	xt_payload_defrag_put(par->net);
+	uwu_tg_conf_put(priv);
+	uwu_rule_ctr_put(priv->ctr);
+	kfree(priv);
 }
 
 static struct xt_target uwu_tg_reg __read_mostly = {
@@ -188,18 +831,113 @@ static struct xt_target uwu_tg_reg __read_mostly = {
 	.family		= NFPROTO_IPV4,
 	.target		= uwu_tg,
 	.targetsize	= sizeof(struct xt_uwu_info),
+	.usersize	= offsetof(struct xt_uwu_info, priv),
 	.checkentry	= uwu_tg_check,
+	.destroy	= uwu_tg_destroy,
 	.me		= THIS_MODULE
 };
 
+static int uwu_rules_show(struct seq_file *seq, void *v)
+{
+	struct uwu_net *un = net_generic(seq_file_single_net(seq), uwu_net_id);
+	struct xt_uwu_priv *priv;
+	int cpu;
+
+	seq_puts(seq, "id packets bytes budget_hits\n");
+	mutex_lock(&uwu_rules_mutex);
+	list_for_each_entry(priv, &un->rules, list) {
+		u64 packets = 0, bytes = 0, hits = 0;
+
+		for_each_possible_cpu(cpu) {
+			const struct xt_uwu_rule_stats *rs;
+
+			rs = per_cpu_ptr(priv->ctr->stats, cpu);
+			packets += READ_ONCE(rs->packets);
+			bytes += READ_ONCE(rs->bytes);
+			hits += READ_ONCE(per_cpu_ptr(priv->ctr->budget,
+						      cpu)->hits);
+		}
+		seq_printf(seq, "%u %llu %llu %llu\n", priv->id, packets,
+			   bytes, hits);
+	}
+	mutex_unlock(&uwu_rules_mutex);
+
+	return 0;
+}
+
+static int __net_init uwu_net_init(struct net *net)
+{
+	struct uwu_net *un = net_generic(net, uwu_net_id);
+
+	int ret;
+
+	INIT_LIST_HEAD(&un->rules);
+	ret = xt_payload_net_init(&uwu_payload, &un->payload, net);
+	if (ret)
+		return ret;
+	if (!proc_create_net_single("xt_uwu_rules", 0444, net->proc_net,
+				    uwu_rules_show, NULL)) {
+		xt_payload_net_exit(&uwu_payload, &un->payload, net);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void __net_exit uwu_net_exit(struct net *net)
+{
+	struct uwu_net *un = net_generic(net, uwu_net_id);
+
+	remove_proc_entry("xt_uwu_rules", net->proc_net);
+	xt_payload_net_exit(&uwu_payload, &un->payload, net);
+}
+
+static struct pernet_operations uwu_net_ops = {
+	.init	= uwu_net_init,
+	.exit	= uwu_net_exit,
+	.id	= &uwu_net_id,
+	.size	= sizeof(struct uwu_net),
+};
+
 static int __init uwu_tg_init(void)
 {
-	return xt_register_target(&uwu_tg_reg);
+	int ret;
+
+	uwu_tables_init();
+	ret = uwu_select_impl();
+	if (ret)
+		return ret;
+
+	ret = uwu_flow_table_init(&uwu_flows, flow_slots);
+	if (ret)
+		return ret;
+	ret = xt_payload_register(&uwu_payload);
+	if (ret)
+		goto err_flows;
+	ret = register_pernet_subsys(&uwu_net_ops);
+	if (ret)
+		goto err_payload;
+	ret = xt_register_target(&uwu_tg_reg);
+	if (ret)
+		goto err_pernet;
+
+	return 0;
+
+err_pernet:
+	unregister_pernet_subsys(&uwu_net_ops);
+err_payload:
+	xt_payload_unregister(&uwu_payload);
+err_flows:
+	uwu_flow_table_free(&uwu_flows);
+	return ret;
 }
 
 static void __exit uwu_tg_exit(void)
 {
 	xt_unregister_target(&uwu_tg_reg);
+	unregister_pernet_subsys(&uwu_net_ops);
+	xt_payload_unregister(&uwu_payload);
+	uwu_flow_table_free(&uwu_flows);
 }
 
 module_init(uwu_tg_init);
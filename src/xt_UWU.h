@@ -23,7 +23,121 @@
 
 #include <linux/types.h>
 
+#include "xt_payload_conf.h"
+
+struct xt_uwu_priv;
+
+/* The most payload a packet has, GRO ones included, short of BIG TCP */
+#define XT_UWU_MAX_PAYLOAD	0xffff
+
+/**
+ * --uwu-phrase FROM:TO rewrites every FROM in the payload to TO, which can
+ * be of a different length. libxt_UWU compiles the phrases into a DFA
+ * (Aho-Corasick with the failure links folded into the transitions) over
+ * byte classes: ac_class maps every byte to the class it has in the
+ * phrases, 0 for bytes in none of them, and ac_next[state][class] is the
+ * next state, 0 being the start. ac_match[state] is one more than the
+ * phrase that ends there, the longest one if several do, or 0.
+ */
+#define XT_UWU_PHRASES		16
+#define XT_UWU_PHRASE_LEN	16
+#define XT_UWU_AC_STATES	64
+#define XT_UWU_AC_CLASSES	32
+
+struct xt_uwu_phrase {
+	__u8			from_len;
+	__u8			to_len;
+	__u8			from[XT_UWU_PHRASE_LEN];
+	__u8			to[XT_UWU_PHRASE_LEN];
+};
+
+struct xt_uwu_ac {
+	__u8			nr_phrases;
+	__u8			nr_states;
+	__u8			__hole[2];
+	struct xt_uwu_phrase	phrases[XT_UWU_PHRASES];
+	__u8			ac_class[256];
+	__u8			ac_match[XT_UWU_AC_STATES];
+	__u8			ac_next[XT_UWU_AC_STATES][XT_UWU_AC_CLASSES];
+};
+
+/**
+ * Bounds on the work done per packet, all in bytes of L4 payload and 0 for
+ * no bound. Packets shorter than min_len or longer than max_len are left
+ * alone. Otherwise the transform skips the first offset bytes and stops
+ * after max_bytes more.
+ *
+ * With map_set the bytes are rewritten through map, which libxt_UWU builds
+ * from --uwu-map, instead of the built in l/r to w. '\n' always maps to
+ * itself as it ends the line first.
+ *
+ * With phrases.nr_phrases the phrases are rewritten first, see above.
+ *
+ * With a non-zero xor_key_len the same bytes are XORed with xor_key right
+ * after being uwu'd, in the same pass, as -j XOR would in a second rule.
+ *
+ * With a non-empty conf the rule does what the named config of that name
+ * says instead, see xt_payload_conf.h, and the rest is ignored.
+ *
+ * With a non-zero budget_rate each CPU walks at most budget_rate bytes of
+ * payload a second for the rule, in bursts of up to budget_burst bytes
+ * (budget_rate if 0). A packet that needs more than is left passes
+ * untouched, or with budget_cut is transformed up to what is left. Without
+ * budget_cut the burst has to cover the most one packet can need, see
+ * xt_uwu_budget_need().
+ */
 struct xt_uwu_info {
+	__u32			offset;
+	__u32			max_bytes;
+	__u32			min_len;
+	__u32			max_len;
+	__u8			map[256];
+	__u8			xor_key[32];
+	__u8			xor_key_len;
+	__u8			map_set;
+	__u8			__hole[2];
+	struct xt_uwu_ac	phrases;
+	char			conf[XT_PAYLOAD_CONF_NAME];
+	__u32			budget_rate;
+	__u32			budget_burst;
+	__u8			budget_cut;
+	__u8			__hole2[3];
+
+	/* Used internally by the kernel */
+	__u32			id;
+	struct xt_uwu_priv	*priv __attribute__((aligned(8)));
+};
+
+/* The most bytes the walk over one packet can cover, for the budget */
+static inline __u32 xt_uwu_budget_need(const struct xt_uwu_info *info)
+{
+	__u32 len = info->max_len ? info->max_len : XT_UWU_MAX_PAYLOAD;
+
+	len = len > info->offset ? len - info->offset : 0;
+	if (info->max_bytes && info->max_bytes < len)
+		len = info->max_bytes;
+
+	return len;
+}
+
+/* netlink attributes of the nft uwu expression, see nft_uwu.c */
+enum nft_uwu_attributes {
+	NFTA_UWU_UNSPEC,
+	__NFTA_UWU_MAX
 };
+#define NFTA_UWU_MAX		(__NFTA_UWU_MAX - 1)
+
+#ifdef __KERNEL__
+struct sk_buff;
+struct net;
+struct uwu_conf;
+struct uwu_budget;
+
+unsigned int xt_uwu_payload(struct sk_buff *skb, struct net *net,
+		unsigned int thoff, const struct uwu_conf *conf,
+		struct uwu_budget __percpu *budget, unsigned int *rewritten);
+int xt_uwu_net_get(struct net *net, u8 family);
+void xt_uwu_net_put(struct net *net, u8 family);
+#endif
 
 #endif /* _XT_UWU_H */
@@ -18,130 +18,164 @@
  */
 
 #include "xt_XOR.h"
+#include "xt_payload.h"
+#include "xor_core.h"
 
 #include <linux/module.h>
-#include <linux/ip.h>
-#include <net/ip.h>
 #include <linux/netfilter/x_tables.h>
-#include <net/netfilter/ipv4/nf_defrag_ipv4.h>
+#include <linux/slab.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Changli Gao <xiaosuo@gmail.com>");
 MODULE_DESCRIPTION("Xtables: XOR the application data");
 MODULE_ALIAS("ipt_XOR");
 
-static unsigned int skb_xor(struct sk_buff *skb, unsigned int offset,
-		const u8 *key, unsigned int key_len, unsigned int key_off)
+static int xor_mangle(void *priv, const struct xt_payload_chunk *c)
 {
-	unsigned int headlen = skb_headlen(skb);
-	struct sk_buff *frag_iter;
-
-	if (headlen > offset) {
-		headlen -= offset;
-		while (headlen-- > 0) {
-			skb->data[offset++] ^= key[key_off++];
-			if (key_off == key_len)
-				key_off = 0;
-		}
-		offset = 0;
-	} else {
-		offset -= headlen;
-	}
-	skb_walk_frags(skb, frag_iter) {
-		if (frag_iter->len > offset) {
-			key_off = skb_xor(frag_iter, offset, key, key_len,
-					key_off);
-			offset = 0;
-		} else {
-			offset -= frag_iter->len;
-		}
-	}
+	xor_transform(priv, c->data, c->len, c->off);
+
+	return 0;
+}
+
+/**
+ * Every byte changes, so there is nothing for a scan() to find, and
+ * xor_transform() sums all of them.
+ */
+static const struct xt_payload_ops xor_payload_ops = {
+	.mangle		= xor_mangle,
+	.sums_all	= true,
+};
+
+static bool xor_prepare(void *priv, struct sk_buff *skb,
+		struct xt_payload_pkt *pkt)
+{
+	struct xor_walk *w = priv;
+
+	pkt->csum = &w->csum;
+
+	return true;
+}
+
+static struct xor_keystream *xor_conf_build(const struct xt_xor_info *info)
+{
+	struct xor_keystream *ks;
 
-	return key_off;
+	if (info->key_len <= 0 || info->key_len > sizeof(info->key))
+		return ERR_PTR(-EINVAL);
+
+	ks = kmalloc(sizeof(*ks), GFP_KERNEL);
+	if (!ks)
+		return ERR_PTR(-ENOMEM);
+	xor_keystream_init(ks, info->key, info->key_len);
+
+	return ks;
+}
+
+static void xor_conf_free(void *conf)
+{
+	kfree(conf);
 }
 
+/* A named config, which can't name another one in turn */
+static void *xor_conf_build_named(const void *data)
+{
+	const struct xt_xor_info *info = data;
+
+	if (info->conf[0])
+		return ERR_PTR(-EINVAL);
+
+	return xor_conf_build(info);
+}
+
+static struct xt_payload_target xor_payload = {
+	.name		= "xt_xor",
+	.ops		= &xor_payload_ops,
+	.prepare	= xor_prepare,
+	.conf_size	= offsetof(struct xt_xor_info, ks),
+	.conf_build	= xor_conf_build_named,
+	.conf_free	= xor_conf_free,
+};
+
+struct xor_net {
+	struct xt_payload_net	payload;
+};
+
+static unsigned int xor_net_id __read_mostly;
+
+/**
+ * Everything past the IPv4 header, shared by the XOR target and the nft
+ * xor expression. Returns NF_DROP or NF_ACCEPT, the latter meaning carry
+ * on with the next rule.
+ */
+unsigned int xt_xor_payload(struct sk_buff *skb, struct net *net,
+		unsigned int thoff, const struct xor_keystream *ks)
+{
+	struct xor_net *xn = net_generic(net, xor_net_id);
+	struct xor_walk w = {
+		.ks		= ks,
+	};
+
+	return xt_payload_run(&xor_payload, &xn->payload, skb, thoff, &w,
+			      NULL);
+}
+EXPORT_SYMBOL_GPL(xt_xor_payload);
+
 static unsigned int xor_tg(struct sk_buff *skb,
 		const struct xt_action_param *par)
 {
 	const struct xt_xor_info *xor_info = par->targinfo;
-	struct iphdr *iph, _iph;
-	unsigned int doff;
-	struct sk_buff *last_skb;
-
-	iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
-	if (!iph)
-		goto err;
-	/**
-	 * This check is redundant, since we speficy the dependency on
-	 * nf_defrag_ipv4 explicitly in xor_tg_init().
-	 */
-	if (ip_is_fragment(iph))
-		goto err;
-	if (iph->protocol == IPPROTO_TCP) {
-		struct tcphdr *tcph, _tcph;
-
-		tcph = skb_header_pointer(skb, par->thoff, sizeof(_tcph),
-				&_tcph);
-		if (!tcph)
-			goto err;
-		doff = tcph->doff * 4;
-	} else if (iph->protocol == IPPROTO_UDP) {
-		doff = sizeof(struct udphdr);
-	} else {
-		goto out;
-	}
-	doff += par->thoff;
-	if (skb->len < doff)
-		goto err;
-
-	if (skb_cow_data(skb, 0, &last_skb) < 0)
-		goto err;
-	skb_xor(skb, doff, xor_info->key, xor_info->key_len, 0);
-
-	iph = ip_hdr(skb);
-	if (iph->protocol == IPPROTO_TCP) {
-		struct tcphdr *tcph;
-
-		if (!skb_try_make_writable(skb, par->thoff + sizeof(*tcph)))
-			goto err;
-		iph = ip_hdr(skb);
-		tcph = (struct tcphdr *)(skb->data + par->thoff);
-		tcph->check = ~csum_tcpudp_magic(iph->saddr,
-				iph->daddr, skb->len - par->thoff,
-				IPPROTO_TCP, 0);
-		skb->ip_summed = CHECKSUM_PARTIAL;
-		skb->csum_start = (unsigned char *)tcph - skb->head;
-		skb->csum_offset = offsetof(struct tcphdr, check);
-	} else {
-		struct udphdr *udph;
-
-		if (!skb_try_make_writable(skb, doff))
-			goto err;
-		iph = ip_hdr(skb);
-		udph = (struct udphdr *)(skb->data + par->thoff);
-		if (udph->check) {
-			udph->check = ~csum_tcpudp_magic(iph->saddr,
-					iph->daddr, skb->len - par->thoff,
-					IPPROTO_UDP, 0);
-			skb->ip_summed = CHECKSUM_PARTIAL;
-			skb->csum_start = (unsigned char *)udph - skb->head;
-			skb->csum_offset = offsetof(struct udphdr, check);
-		}
-	}
-out:
+	const struct xor_keystream *ks = xor_info->ks;
+
+	/* see uwu_tg() */
+	if (xor_info->named)
+		ks = xt_payload_conf_deref(xor_info->named);
+	if (xt_xor_payload(skb, xt_net(par), par->thoff, ks) == NF_DROP)
+		return NF_DROP;
+
 	return XT_CONTINUE;
-err:
-	return NF_DROP;
 }
 
 static int xor_tg_check(const struct xt_tgchk_param *par)
 {
-	const struct xt_xor_info *xor_info = par->targinfo;
-
-	if (xor_info->key_len <= 0 || xor_info->key_len > sizeof(xor_info->key))
-		return -EINVAL;
+	struct xor_net *xn = net_generic(par->net, xor_net_id);
+	struct xt_xor_info *xor_info = par->targinfo;
+	int ret;
+
+	xor_info->ks = NULL;
+	xor_info->named = NULL;
+	if (xor_info->conf[0]) {
+		xor_info->named = xt_payload_conf_get(&xn->payload,
+						      xor_info->conf);
+		if (IS_ERR(xor_info->named))
+			return PTR_ERR(xor_info->named);
+	} else {
+		xor_info->ks = xor_conf_build(xor_info);
+		if (IS_ERR(xor_info->ks))
+			return PTR_ERR(xor_info->ks);
+	}
+	ret = xt_payload_defrag_get(par->net);
+	if (ret)
+		goto err_conf;
 
 	return 0;
+
+err_conf:
+	if (xor_info->named)
+		xt_payload_conf_put(xor_info->named);
+	kfree(xor_info->ks);
+	return ret;
+}
+
+static void xor_tg_destroy(const struct xt_tgdtor_param *par)
+{
+	const struct xt_xor_info *xor_info = par->targinfo;
+
+	xt_payload_defrag_put(par->net);
+	if (xor_info->named)
+		xt_payload_conf_put(xor_info->named);
+	kfree(xor_info->ks);
 }
 
 static struct xt_target xor_tg_reg __read_mostly = {
@@ -150,18 +184,61 @@ static struct xt_target xor_tg_reg __read_mostly = {
 	.family		= NFPROTO_IPV4,
 	.target		= xor_tg,
 	.targetsize	= sizeof(struct xt_xor_info),
+	.usersize	= offsetof(struct xt_xor_info, ks),
 	.checkentry	= xor_tg_check,
+	.destroy	= xor_tg_destroy,
 	.me		= THIS_MODULE
 };
 
+static int __net_init xor_net_init(struct net *net)
+{
+	struct xor_net *xn = net_generic(net, xor_net_id);
+
+	return xt_payload_net_init(&xor_payload, &xn->payload, net);
+}
+
+static void __net_exit xor_net_exit(struct net *net)
+{
+	struct xor_net *xn = net_generic(net, xor_net_id);
+
+	xt_payload_net_exit(&xor_payload, &xn->payload, net);
+}
+
+static struct pernet_operations xor_net_ops = {
+	.init	= xor_net_init,
+	.exit	= xor_net_exit,
+	.id	= &xor_net_id,
+	.size	= sizeof(struct xor_net),
+};
+
 static int __init xor_tg_init(void)
 {
-	return xt_register_target(&xor_tg_reg);
+	int ret;
+
+	ret = xt_payload_register(&xor_payload);
+	if (ret)
+		return ret;
+	ret = register_pernet_subsys(&xor_net_ops);
+	if (ret)
+		goto err_payload;
+	ret = xt_register_target(&xor_tg_reg);
+	if (ret)
+		goto err_pernet;
+
+	return 0;
+
+err_pernet:
+	unregister_pernet_subsys(&xor_net_ops);
+err_payload:
+	xt_payload_unregister(&xor_payload);
+	return ret;
 }
 
 static void __exit xor_tg_exit(void)
 {
 	xt_unregister_target(&xor_tg_reg);
+	unregister_pernet_subsys(&xor_net_ops);
+	xt_payload_unregister(&xor_payload);
 }
 
 module_init(xor_tg_init);
@@ -22,10 +22,40 @@
 
 #include <linux/types.h>
 
+#include "xt_payload_conf.h"
+
+struct xor_keystream;
+struct xt_payload_conf;
+
+/**
+ * With a non-empty conf the rule XORs with the key of the named config of
+ * that name instead, see xt_payload_conf.h, and key is ignored.
+ */
 struct xt_xor_info {
-	__u8	key[32];
-	__u8	key_len;
-	__u8	__hole[7];
+	__u8			key[32];
+	__u8			key_len;
+	__u8			__hole[7];
+	char			conf[XT_PAYLOAD_CONF_NAME];
+
+	/* Used internally by the kernel */
+	struct xor_keystream	*ks __attribute__((aligned(8)));
+	struct xt_payload_conf	*named;
 };
 
+/* netlink attributes of the nft xor expression, see nft_xor.c */
+enum nft_xor_attributes {
+	NFTA_XOR_UNSPEC,
+	NFTA_XOR_KEY,		/* binary, 1 to 32 bytes */
+	__NFTA_XOR_MAX
+};
+#define NFTA_XOR_MAX		(__NFTA_XOR_MAX - 1)
+
+#ifdef __KERNEL__
+struct sk_buff;
+struct net;
+
+unsigned int xt_xor_payload(struct sk_buff *skb, struct net *net,
+		unsigned int thoff, const struct xor_keystream *ks);
+#endif
+
 #endif /* _XT_XOR_H */
@@ -0,0 +1,1124 @@
+/**
+ * xt_payload - the payload mangling core shared by the targets.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "xt_payload.h"
+#include "xt_payload_stat.h"
+#include "xt_payload_hist.h"
+
+#include <linux/module.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/highmem.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/capability.h>
+#include <linux/netfilter.h>
+#include <linux/netdevice.h>
+#include <net/dst.h>
+#include <net/ip.h>
+#include <net/checksum.h>
+#include <net/netfilter/ipv4/nf_defrag_ipv4.h>
+
+#define CREATE_TRACE_POINTS
+#include "trace_payload.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Ben Cartwright-Cox <ben@benjojo.co.uk>");
+MODULE_DESCRIPTION("Xtables: payload mangling core for the UWU and XOR targets");
+
+/**
+ * The stack never builds frag_lists more than a level or two deep, this
+ * only bounds the walk on a malformed skb.
+ */
+#define XT_PAYLOAD_MAX_DEPTH	8
+
+static int xt_payload_walk_one(struct sk_buff *skb, bool head,
+		unsigned int *offset, unsigned int *left,
+		struct xt_payload_chunk *c, xt_payload_fn fn, void *priv)
+{
+	unsigned int headlen = skb_headlen(skb);
+	int i, ret;
+
+	if (headlen > *offset) {
+		c->data = skb->data + *offset;
+		c->len = min(headlen - *offset, *left);
+		c->frag = head ? XT_PAYLOAD_LINEAR : XT_PAYLOAD_LIST;
+		ret = fn(priv, c);
+		if (ret)
+			return ret;
+		c->off += c->len;
+		*left -= c->len;
+		*offset = 0;
+	} else {
+		*offset -= headlen;
+	}
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags && *left; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		unsigned int size = skb_frag_size(frag), len;
+		u32 p_off, p_len, copied;
+		struct page *p;
+		u8 *vaddr;
+
+		if (*offset >= size) {
+			*offset -= size;
+			continue;
+		}
+		len = min(size - *offset, *left);
+		c->frag = head ? i : XT_PAYLOAD_LIST;
+		skb_frag_foreach_page(frag, skb_frag_off(frag) + *offset,
+				len, p, p_off, p_len, copied) {
+			vaddr = kmap_local_page(p);
+			c->data = vaddr + p_off;
+			c->len = p_len;
+			ret = fn(priv, c);
+			kunmap_local(vaddr);
+			if (ret)
+				return ret;
+			c->off += p_len;
+		}
+		*left -= len;
+		*offset = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Hand len bytes of skb to fn, starting skip bytes past offset: the linear
+ * area, the page frags and then the frag_list members, depth first, until
+ * len runs out. Chunk offsets count from offset, not from where the walk
+ * starts. The frag_list is followed with an explicit stack rather than by
+ * recursion, so a long or nested list costs no softirq stack.
+ */
+int xt_payload_walk(struct sk_buff *skb, unsigned int offset,
+		unsigned int skip, unsigned int len, xt_payload_fn fn,
+		void *priv)
+{
+	struct sk_buff *stack[XT_PAYLOAD_MAX_DEPTH];
+	struct sk_buff *iter = skb, *next;
+	struct xt_payload_chunk c = { .off = skip };
+	int depth = 0, ret;
+
+	offset += skip;
+	while (iter && len) {
+		ret = xt_payload_walk_one(iter, iter == skb, &offset, &len, &c,
+				fn, priv);
+		if (ret)
+			return ret;
+
+		next = iter == skb ? NULL : iter->next;
+		if (skb_has_frag_list(iter)) {
+			if (depth == XT_PAYLOAD_MAX_DEPTH)
+				return -E2BIG;
+			stack[depth++] = next;
+			next = skb_shinfo(iter)->frag_list;
+		}
+		while (!next && depth > 0)
+			next = stack[--depth];
+		iter = next;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(xt_payload_walk);
+
+struct xt_payload_need {
+	const struct xt_payload_ops	*ops;
+	void				*priv;
+	/* if not NULL, where to sum the payload as it is now */
+	__wsum				*sum;
+	bool				linear;
+	bool				list;
+	DECLARE_BITMAP(frags, MAX_SKB_FRAGS);
+};
+
+static int xt_payload_need_fn(void *priv,
+		const struct xt_payload_chunk *c)
+{
+	struct xt_payload_need *need = priv;
+	bool hit = need->ops->scan(need->priv, c);
+
+	if (need->sum)
+		*need->sum = csum_block_add(*need->sum,
+				csum_partial(c->data, c->len, 0), c->off);
+	if (!hit)
+		return 0;
+	if (c->frag == XT_PAYLOAD_LINEAR)
+		need->linear = true;
+	else if (c->frag == XT_PAYLOAD_LIST)
+		need->list = true;
+	else
+		__set_bit(c->frag, need->frags);
+
+	return 0;
+}
+
+/**
+ * Replace frag i of skb with a private copy. Used on frags whose page may
+ * also be in use elsewhere: the retransmit queue of a cloned TCP skb, the
+ * page cache behind sendfile() and the like.
+ */
+static int xt_payload_copy_frag(struct sk_buff *skb, int i)
+{
+	skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+	unsigned int size = skb_frag_size(frag);
+	u32 p_off, p_len, copied;
+	struct page *page, *p;
+	u8 *dst, *vaddr;
+
+	page = alloc_pages(GFP_ATOMIC | __GFP_NOWARN | __GFP_COMP,
+			get_order(size));
+	if (!page)
+		return -ENOMEM;
+	dst = page_address(page);
+	skb_frag_foreach_page(frag, skb_frag_off(frag), size,
+			p, p_off, p_len, copied) {
+		vaddr = kmap_local_page(p);
+		memcpy(dst + copied, vaddr + p_off, p_len);
+		kunmap_local(vaddr);
+	}
+	__skb_frag_unref(frag, skb->pp_recycle);
+	skb_frag_fill_page_desc(frag, page, 0, size);
+
+	return 0;
+}
+
+static int xt_payload_make_writable(struct sk_buff *skb,
+		const struct xt_payload_need *need,
+		struct xt_payload_stats __percpu *stats)
+{
+	struct sk_buff *trailer;
+	bool shared;
+	int i, ret;
+
+	/**
+	 * frag_list members may be shared with other skbs in ways that
+	 * can't be untangled one piece at a time, so copy the lot.
+	 */
+	if (need->list) {
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_COW);
+		return skb_cow_data(skb, 0, &trailer) < 0 ? -ENOMEM : 0;
+	}
+
+	shared = skb_cloned(skb) || skb_has_shared_frag(skb);
+	if (skb_cloned(skb)) {
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_COW);
+		ret = pskb_expand_head(skb, 0, 0, GFP_ATOMIC);
+		if (ret)
+			return ret;
+	}
+
+	if (bitmap_empty(need->frags, MAX_SKB_FRAGS))
+		return 0;
+	if (skb_zcopy(skb)) {
+		/* this copies every frag into pages of our own */
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_COW);
+		return skb_orphan_frags(skb, GFP_ATOMIC);
+	}
+	if (!shared)
+		return 0;
+	for_each_set_bit(i, need->frags, skb_shinfo(skb)->nr_frags) {
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_COW);
+		ret = xt_payload_copy_frag(skb, i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * First step of xt_payload_mangle(): work out which parts of the walk over
+ * pkt the transform is going to change, and if sum isn't NULL add up the
+ * payload on the way. Returns 1 if there are any, 0 if there are none or
+ * a negative errno.
+ */
+static int xt_payload_plan(struct sk_buff *skb,
+		const struct xt_payload_pkt *pkt,
+		const struct xt_payload_ops *ops, void *priv,
+		struct xt_payload_need *need, __wsum *sum)
+{
+	int ret;
+
+	memset(need, 0, sizeof(*need));
+	need->ops = ops;
+	need->priv = priv;
+	need->sum = sum;
+	if (!ops->scan) {
+		need->linear = true;
+		need->list = skb_has_frag_list(skb);
+		bitmap_set(need->frags, 0, skb_shinfo(skb)->nr_frags);
+		return 1;
+	}
+
+	ret = xt_payload_walk(skb, pkt->doff, pkt->skip, pkt->limit,
+			      xt_payload_need_fn, need);
+	if (ret)
+		return ret;
+	if (!need->linear && !need->list &&
+	    bitmap_empty(need->frags, MAX_SKB_FRAGS))
+		return 0;
+	ops->reset(priv);
+
+	return 1;
+}
+
+/**
+ * Whether the members of the SKB_GSO_FRAGLIST skb pkt is about are what
+ * GRO builds: segments of their own, each with a copy of the headers of
+ * skb pulled but still in front of its data, and nothing below them. A
+ * clone of skb shares its members, which can't be unshared one by one, so
+ * that has to wait until the clone is gone.
+ */
+static bool xt_payload_list_ok(const struct sk_buff *skb,
+		const struct xt_payload_pkt *pkt)
+{
+	const struct sk_buff *iter;
+	unsigned int len = 0;
+
+	if (skb_cloned(skb))
+		return false;
+	skb_walk_frags(skb, iter) {
+		if (skb_has_frag_list(iter) || skb_shared(iter) ||
+		    skb_headroom(iter) < pkt->doff ||
+		    skb_network_offset(iter) != -(int)pkt->doff)
+			return false;
+		len += iter->len;
+	}
+
+	return len <= skb->len - pkt->doff;
+}
+
+/**
+ * Whether the checksum and GSO state of skb let us change the payload of
+ * pkt in place and fix the checksum up afterwards.
+ *
+ * A GSO super-packet is transformed once as a whole. Its length doesn't
+ * change, so gso_size and gso_segs stay valid, and as long as it is
+ * CHECKSUM_PARTIAL against our L4 header the segmentation code (or the
+ * NIC) sums every segment's payload itself, the UDP_SEGMENT case included.
+ * GRO leaves the TCP and UDP packets it merges on receive in that state as
+ * well, so the same goes for them: on the way in they are taken as they
+ * are, forwarded ones get segmented again on the way out. The frag_list
+ * GRO does for forwarding is the exception, the segments keep their own
+ * headers and checksums and get them fixed up one by one, see
+ * xt_payload_segs. A GSO skb in any other checksum state can't be fixed
+ * up per segment.
+ */
+static bool xt_payload_can_mangle(const struct sk_buff *skb,
+		const struct xt_payload_pkt *pkt)
+{
+	/**
+	 * With local checksum offload the outer checksum of a tunnel is
+	 * derived from the inner one, changing the payload would break it.
+	 */
+	if (skb->encapsulation)
+		return false;
+	if (skb->ip_summed == CHECKSUM_PARTIAL &&
+	    skb_checksum_start_offset(skb) != pkt->thoff)
+		return false;
+	if (!skb_is_gso(skb))
+		return true;
+	if (skb_shinfo(skb)->gso_type & SKB_GSO_FRAGLIST)
+		return skb->ip_summed != CHECKSUM_PARTIAL &&
+		       xt_payload_list_ok(skb, pkt);
+
+	return skb->ip_summed == CHECKSUM_PARTIAL;
+}
+
+static __wsum xt_payload_csum_fold(u64 sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return csum_unfold((__force __sum16)htons(sum));
+}
+
+/* Patch check of skb, in place, for the changes recorded in csum */
+static void xt_payload_csum_patch(struct sk_buff *skb, __sum16 *check,
+		const struct xt_payload_csum *csum, bool udp)
+{
+	/* a zero UDP checksum means the sender didn't compute one */
+	if (udp && !*check)
+		return;
+	inet_proto_csum_replace_by_diff(check, skb,
+			csum_sub(xt_payload_csum_fold(csum->to),
+				 xt_payload_csum_fold(csum->from)), false);
+	if (udp && !*check)
+		*check = CSUM_MANGLED_0;
+}
+
+/**
+ * Patch the L4 checksum at check_off for the changes recorded in csum, in
+ * O(1) rather than by summing the payload again. Under CHECKSUM_PARTIAL the
+ * field only holds the pseudo header sum and the payload gets summed later
+ * by the device or the GSO code, so there is nothing to do. In every other
+ * state the field is adjusted in place, which leaves a CHECKSUM_COMPLETE
+ * skb->csum valid too, as the payload and field changes cancel out.
+ */
+static int xt_payload_csum_update(struct sk_buff *skb,
+		unsigned int check_off, const struct xt_payload_csum *csum,
+		bool udp)
+{
+	int ret;
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL)
+		return 0;
+	ret = skb_ensure_writable(skb, check_off + sizeof(__sum16));
+	if (ret)
+		return ret;
+	xt_payload_csum_patch(skb, (__sum16 *)(skb->data + check_off), csum,
+			      udp);
+
+	return 0;
+}
+
+/**
+ * The segments of a frag_list GSO skb while the transform walks them:
+ * skb holds the first one and each frag_list member another, see
+ * xt_payload_list_ok(). Segmentation only splits the list up again and
+ * sends every member with the checksum it has, so each member's has to be
+ * patched for the changes to its own payload. The transform keeps one
+ * accumulator for the whole walk, so at every boundary what it gained
+ * since the last one is what changed in the segment just left.
+ */
+struct xt_payload_segs {
+	struct sk_buff			*skb;
+	const struct xt_payload_pkt	*pkt;
+	void				*priv;
+	/* offset of the check field from the L4 header */
+	unsigned int			check;
+	/* the segment the walk is in, and where its payload starts and ends */
+	struct sk_buff			*seg;
+	unsigned int			start;
+	unsigned int			end;
+	/* *pkt->csum as it was at start */
+	struct xt_payload_csum		last;
+	/**
+	 * The changes to the checksum of skb itself: *pkt->csum until the
+	 * walk leaves the first segment, head after that.
+	 */
+	const struct xt_payload_csum	*csum;
+	struct xt_payload_csum		head;
+};
+
+/* Point segs at the first segment, once skb is writable */
+static void xt_payload_segs_start(struct xt_payload_segs *segs)
+{
+	struct sk_buff *iter;
+
+	segs->seg = segs->skb;
+	segs->start = 0;
+	segs->end = segs->pkt->len;
+	skb_walk_frags(segs->skb, iter)
+		segs->end -= iter->len;
+	segs->last = *segs->pkt->csum;
+	segs->csum = segs->pkt->csum;
+	memset(&segs->head, 0, sizeof(segs->head));
+}
+
+/* Apply what changed in the segment the walk is in */
+static void xt_payload_segs_flush(struct xt_payload_segs *segs)
+{
+	const struct xt_payload_pkt *pkt = segs->pkt;
+	const struct xt_payload_csum *now = pkt->csum;
+	struct xt_payload_csum d;
+
+	if (segs->seg == segs->skb)
+		segs->csum = &segs->head;
+	if (now->from == segs->last.from && now->to == segs->last.to)
+		return;
+	xt_payload_csum_since(&d, now, &segs->last, segs->start);
+	if (segs->seg == segs->skb) {
+		segs->head = d;
+		return;
+	}
+	xt_payload_csum_patch(segs->seg, (__sum16 *)(segs->seg->data -
+			pkt->doff + pkt->thoff + segs->check), &d,
+			pkt->protocol == IPPROTO_UDP);
+}
+
+static int xt_payload_segs_fn(void *priv, const struct xt_payload_chunk *c)
+{
+	struct xt_payload_segs *segs = priv;
+
+	/* a chunk never spans two skbs */
+	while (c->off >= segs->end) {
+		xt_payload_segs_flush(segs);
+		segs->seg = segs->seg == segs->skb ?
+			    skb_shinfo(segs->skb)->frag_list : segs->seg->next;
+		segs->start = segs->end;
+		segs->end += segs->seg->len;
+		segs->last = *segs->pkt->csum;
+	}
+
+	return segs->pkt->ops->mangle(segs->priv, c);
+}
+
+static int fuse_csum = 1;
+module_param(fuse_csum, int, 0644);
+MODULE_PARM_DESC(fuse_csum, "finish CHECKSUM_PARTIAL checksums while "
+		 "transforming: 0 never, 1 if the device can't (default), "
+		 "2 always");
+
+/**
+ * Whether to sum the payload of skb as the transform goes and finish its
+ * checksum with xt_payload_csum_finish(). That only pays off if the
+ * payload would otherwise be read once more by skb_checksum_help(), which
+ * is the case for a CHECKSUM_PARTIAL skb routed to a device that can't
+ * checksum IPv4. A GSO skb gets its checksums per segment, later. Tunnels
+ * are only known to need it once they have encapsulated the packet, so
+ * for them the mode has to be forced.
+ */
+static bool xt_payload_want_sum(const struct xt_payload_ops *ops,
+		const struct sk_buff *skb)
+{
+	int mode = READ_ONCE(fuse_csum);
+	const struct net_device *dev;
+
+	if (!mode || skb->ip_summed != CHECKSUM_PARTIAL || skb_is_gso(skb))
+		return false;
+	if (!ops->scan && !ops->sums_all)
+		return false;
+	if (mode > 1)
+		return true;
+	dev = skb_dst(skb) ? skb_dst(skb)->dev : skb->dev;
+
+	return dev && !can_checksum_protocol(dev->features, htons(ETH_P_IP));
+}
+
+/**
+ * What skb_checksum_help() would do later, given sum, the sum of the
+ * payload from pkt->doff onwards: add the L4 header, which holds the
+ * pseudo header sum in its check field under CHECKSUM_PARTIAL, write the
+ * result and mark the checksum done.
+ */
+static int xt_payload_csum_finish(struct sk_buff *skb,
+		const struct xt_payload_pkt *pkt, unsigned int check_off,
+		__wsum sum)
+{
+	__sum16 *check;
+	int ret;
+
+	ret = skb_ensure_writable(skb, check_off + sizeof(*check));
+	if (ret)
+		return ret;
+	sum = csum_add(skb_checksum(skb, pkt->thoff, pkt->doff - pkt->thoff,
+				    0), sum);
+	check = (__sum16 *)(skb->data + check_off);
+	*check = csum_fold(sum) ?: CSUM_MANGLED_0;
+	skb->ip_summed = CHECKSUM_NONE;
+
+	return 0;
+}
+
+/**
+ * Replace the n runs of the payload of pkt that edits lists, in order and
+ * not overlapping, with the bytes given for each, which needn't be as many.
+ * The skb gets linear and private, the IPv4 and UDP lengths follow and the
+ * L4 checksum is redone: under CHECKSUM_PARTIAL only its pseudo header part
+ * changes, otherwise the segment gets summed again, which costs little
+ * next to moving everything after the first edit. Updates pkt->len and
+ * returns the change in length, or a negative errno with the payload left
+ * as it was.
+ *
+ * The segments of a GSO skb are cut by length, so for those the edits must
+ * keep it, and a frag_list one would lose its segments to the linearizing.
+ */
+int xt_payload_splice(struct sk_buff *skb, struct xt_payload_pkt *pkt,
+		const struct xt_payload_edit *edits, unsigned int n,
+		struct xt_payload_stats __percpu *stats)
+{
+	unsigned int first = edits[0].off, src = first, i, l4len;
+	struct iphdr *iph;
+	int delta = 0, ret;
+	__sum16 *check;
+	u8 *buf, *dst;
+
+	for (i = 0; i < n; i++)
+		delta += (int)edits[i].data_len - (int)edits[i].len;
+	if (skb_is_gso(skb) &&
+	    (delta || skb_shinfo(skb)->gso_type & SKB_GSO_FRAGLIST))
+		return -EINVAL;
+	if (skb->len + delta > IP_MAX_MTU)
+		return -E2BIG;
+
+	buf = kmalloc(pkt->len - first, GFP_ATOMIC);
+	if (!buf)
+		return -ENOMEM;
+	ret = skb_copy_bits(skb, pkt->doff + first, buf, pkt->len - first);
+	if (ret)
+		goto out;
+	ret = skb_linearize_cow(skb);
+	if (ret)
+		goto out;
+	if (delta > (int)skb_tailroom(skb)) {
+		ret = pskb_expand_head(skb, 0, delta - skb_tailroom(skb),
+				       GFP_ATOMIC);
+		if (ret)
+			goto out;
+	}
+	if (delta > 0)
+		skb_put(skb, delta);
+	else
+		__skb_trim(skb, skb->len + delta);
+
+	dst = skb->data + pkt->doff + first;
+	for (i = 0; i < n; i++) {
+		memcpy(dst, buf + src - first, edits[i].off - src);
+		dst += edits[i].off - src;
+		memcpy(dst, edits[i].data, edits[i].data_len);
+		dst += edits[i].data_len;
+		src = edits[i].off + edits[i].len;
+	}
+	memcpy(dst, buf + src - first, pkt->len - src);
+	pkt->len += delta;
+	xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_SPLICED);
+	ret = delta;
+
+	iph = (struct iphdr *)skb->data;
+	iph->tot_len = htons(skb->len);
+	ip_send_check(iph);
+	l4len = skb->len - pkt->thoff;
+	if (pkt->protocol == IPPROTO_UDP) {
+		struct udphdr *uh = (struct udphdr *)(skb->data + pkt->thoff);
+
+		uh->len = htons(l4len);
+		check = &uh->check;
+	} else {
+		check = &((struct tcphdr *)(skb->data + pkt->thoff))->check;
+	}
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		inet_proto_csum_replace2(check, skb, htons(l4len - delta),
+					 htons(l4len), true);
+		goto out;
+	}
+	/* a zero UDP checksum means the sender didn't compute one */
+	if (pkt->protocol != IPPROTO_UDP || *check) {
+		*check = 0;
+		*check = csum_tcpudp_magic(iph->saddr, iph->daddr, l4len,
+				pkt->protocol,
+				csum_partial(skb->data + pkt->thoff, l4len, 0));
+		if (!*check)
+			*check = CSUM_MANGLED_0;
+	}
+	skb->ip_summed = CHECKSUM_NONE;
+out:
+	kfree(buf);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(xt_payload_splice);
+
+/**
+ * Run the transform of t over the part of the payload of skb that pkt
+ * says, copying only the bits of it that are going to change. Returns 1
+ * if the payload was changed, 0 if it was left alone or a negative errno.
+ * Every copy made is counted in stats. If sum isn't NULL the payload as
+ * it was before is added to it, see xt_payload_plan(). If segs isn't NULL
+ * skb is a frag_list GSO skb whose members get their checksums patched on
+ * the way, see xt_payload_segs.
+ */
+static int xt_payload_mangle(const struct xt_payload_target *t,
+		struct sk_buff *skb, const struct xt_payload_pkt *pkt,
+		void *priv, struct xt_payload_stats __percpu *stats,
+		__wsum *sum, struct xt_payload_segs *segs)
+{
+	struct xt_payload_need need;
+	int ret;
+
+	trace_payload_mangle_entry(t->name, skb, pkt->limit);
+	ret = xt_payload_plan(skb, pkt, pkt->ops, priv, &need, sum);
+	if (ret <= 0)
+		goto out;
+
+	trace_payload_cow_entry(t->name, skb, pkt->limit);
+	ret = xt_payload_make_writable(skb, &need, stats);
+	trace_payload_cow_exit(t->name, skb, ret);
+	if (ret)
+		goto out;
+
+	if (segs) {
+		/* skb_cow_data() may have replaced the members */
+		xt_payload_segs_start(segs);
+		ret = xt_payload_walk(skb, pkt->doff, pkt->skip, pkt->limit,
+				      xt_payload_segs_fn, segs);
+		if (!ret && segs->seg != skb)
+			xt_payload_segs_flush(segs);
+	} else {
+		ret = xt_payload_walk(skb, pkt->doff, pkt->skip, pkt->limit,
+				      pkt->ops->mangle, priv);
+	}
+	if (!ret)
+		ret = 1;
+out:
+	trace_payload_mangle_exit(t->name, skb, ret);
+	return ret;
+}
+
+/**
+ * Everything past the IPv4 header of skb, whose L4 header is at thoff.
+ * priv is the per-packet state of t, which t->prepare() sets up. Returns
+ * NF_DROP or NF_ACCEPT, the latter meaning carry on with the next rule,
+ * and if @rewritten isn't NULL the number of bytes changed.
+ */
+unsigned int xt_payload_run(struct xt_payload_target *t,
+		struct xt_payload_net *pn, struct sk_buff *skb,
+		unsigned int thoff, void *priv, unsigned int *rewritten)
+{
+	struct xt_payload_stats __percpu *stats = pn->stats;
+	struct xt_payload_pkt pkt = {
+		.thoff		= thoff,
+		.ops		= t->ops,
+	};
+	u64 start = xt_payload_hist_start(t->hist);
+	unsigned int verdict = NF_ACCEPT, check;
+	struct xt_payload_segs segs, *list = NULL;
+	const struct xt_payload_csum *csum;
+	struct iphdr *iph, _iph;
+	bool fuse, changed;
+	__wsum sum = 0;
+	int ret, reason;
+
+	trace_payload_tg_entry(t->name, skb, skb->len);
+	xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_PACKETS);
+
+	iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+	if (!iph) {
+		reason = XT_PAYLOAD_STAT_DROP_HDR;
+		goto err;
+	}
+	/**
+	 * The L4 checksum covers the whole datagram, so fragments can't be
+	 * fixed up one at a time. With nf_defrag_ipv4 loaded (the targets
+	 * take it, see xt_payload_defrag_get()) they only see whole
+	 * datagrams.
+	 */
+	if (ip_is_fragment(iph)) {
+		reason = XT_PAYLOAD_STAT_DROP_FRAG;
+		goto err;
+	}
+	pkt.protocol = iph->protocol;
+	if (pkt.protocol == IPPROTO_TCP) {
+		struct tcphdr *tcph, _tcph;
+
+		tcph = skb_header_pointer(skb, thoff, sizeof(_tcph), &_tcph);
+		if (!tcph) {
+			reason = XT_PAYLOAD_STAT_DROP_HDR;
+			goto err;
+		}
+		pkt.doff = tcph->doff * 4;
+		pkt.seq = ntohl(tcph->seq);
+		check = offsetof(struct tcphdr, check);
+	} else if (pkt.protocol == IPPROTO_UDP) {
+		pkt.doff = sizeof(struct udphdr);
+		check = offsetof(struct udphdr, check);
+	} else {
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_SKIP_PROTO);
+		goto out;
+	}
+	pkt.doff += thoff;
+	if (skb->len < pkt.doff) {
+		reason = XT_PAYLOAD_STAT_DROP_HDR;
+		goto err;
+	}
+
+	if (!xt_payload_can_mangle(skb, &pkt)) {
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_SKIP_OFFLOAD);
+		goto out;
+	}
+
+	pkt.len = skb->len - pkt.doff;
+	if (!pkt.len || !t->prepare(priv, skb, &pkt) || pkt.skip >= pkt.len)
+		goto out;
+	if (!pkt.limit || pkt.limit > pkt.len - pkt.skip)
+		pkt.limit = pkt.len - pkt.skip;
+	pkt.rewritten = pkt.limit;
+	xt_payload_stat_add(stats, XT_PAYLOAD_STAT_BYTES_SCANNED, pkt.limit);
+	if (skb_is_gso(skb) &&
+	    skb_shinfo(skb)->gso_type & SKB_GSO_FRAGLIST) {
+		segs.skb = skb;
+		segs.pkt = &pkt;
+		segs.priv = priv;
+		segs.check = check;
+		list = &segs;
+	}
+	/* a sum of part of the payload is no use for the checksum */
+	fuse = xt_payload_pkt_whole(&pkt) && xt_payload_want_sum(pkt.ops, skb);
+	ret = xt_payload_mangle(t, skb, &pkt, priv, stats,
+				fuse && !pkt.ops->sums_all ? &sum : NULL, list);
+	if (t->finish)
+		t->finish(priv, skb, &pkt, ret);
+	if (ret < 0) {
+		reason = ret == -E2BIG ? XT_PAYLOAD_STAT_DROP_LAYOUT :
+					 XT_PAYLOAD_STAT_DROP_NOMEM;
+		goto err;
+	}
+	changed = ret || pkt.spliced;
+	if (!changed) {
+		xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_UNCHANGED);
+		/* scan() summed it already, spare skb_checksum_help() */
+		if (!fuse || pkt.ops->sums_all)
+			goto out;
+	}
+
+	trace_payload_csum_entry(t->name, skb, skb->ip_summed);
+	if (fuse) {
+		if (pkt.ops->sums_all)
+			sum = xt_payload_csum_fold(pkt.csum->to);
+		else if (changed)
+			sum = csum_add(sum, csum_sub(
+					xt_payload_csum_fold(pkt.csum->to),
+					xt_payload_csum_fold(pkt.csum->from)));
+		ret = xt_payload_csum_finish(skb, &pkt, thoff + check, sum);
+		if (!ret)
+			xt_payload_stat_inc(stats, XT_PAYLOAD_STAT_CSUM_FUSED);
+	} else {
+		csum = list ? list->csum : pkt.csum;
+		ret = xt_payload_csum_update(skb, thoff + check, csum,
+					     pkt.protocol == IPPROTO_UDP);
+	}
+	trace_payload_csum_exit(t->name, skb, ret);
+	if (ret < 0) {
+		reason = XT_PAYLOAD_STAT_DROP_NOMEM;
+		goto err;
+	}
+	if (!changed)
+		goto out;
+	xt_payload_stat_add(stats, XT_PAYLOAD_STAT_BYTES_REWRITTEN,
+			    pkt.rewritten);
+	if (rewritten)
+		*rewritten = pkt.rewritten;
+out:
+	trace_payload_tg_exit(t->name, skb, verdict);
+	xt_payload_hist_record(t->hist, start, pkt.len);
+	return verdict;
+err:
+	xt_payload_stat_inc(stats, reason);
+	net_dbg_ratelimited("%s: owo no: %s\n", t->name,
+			    xt_payload_stat_names[reason]);
+	verdict = NF_DROP;
+	goto out;
+}
+EXPORT_SYMBOL_GPL(xt_payload_run);
+
+/**
+ * xt_payload_run() drops IP fragments, which a rule on the way out only
+ * gets if something fragments ahead of it, but one on the way in gets
+ * every fragment that arrives. A rule takes nf_defrag_ipv4 with this, the
+ * way xt_socket does, so that they get reassembled ahead of every table,
+ * and drops it with xt_payload_defrag_put(). It costs nothing for packets
+ * that aren't fragments.
+ */
+int xt_payload_defrag_get(struct net *net)
+{
+	return nf_defrag_ipv4_enable(net);
+}
+EXPORT_SYMBOL_GPL(xt_payload_defrag_get);
+
+void xt_payload_defrag_put(struct net *net)
+{
+	nf_defrag_ipv4_disable(net);
+}
+EXPORT_SYMBOL_GPL(xt_payload_defrag_put);
+
+/* guards every netns's list of named configs */
+static DEFINE_MUTEX(xt_payload_conf_mutex);
+
+static void xt_payload_conf_data_free(struct rcu_head *head)
+{
+	struct xt_payload_conf_data *d;
+
+	d = container_of(head, struct xt_payload_conf_data, rcu);
+	d->t->conf_free(d->conf);
+	kfree(d);
+}
+
+static struct xt_payload_conf *xt_payload_conf_find(
+		struct xt_payload_net *pn, const char *name)
+{
+	struct xt_payload_conf *conf;
+
+	list_for_each_entry(conf, &pn->confs, list) {
+		if (!strcmp(conf->name, name))
+			return conf;
+	}
+
+	return NULL;
+}
+
+/**
+ * Takes a reference on the config called name for a rule to use, with
+ * xt_payload_conf_deref() on every packet. Returns it or an ERR_PTR.
+ */
+struct xt_payload_conf *xt_payload_conf_get(struct xt_payload_net *pn,
+		const char *name)
+{
+	struct xt_payload_conf *conf;
+
+	if (!memchr(name, 0, XT_PAYLOAD_CONF_NAME))
+		return ERR_PTR(-EINVAL);
+	mutex_lock(&xt_payload_conf_mutex);
+	conf = xt_payload_conf_find(pn, name);
+	if (conf)
+		refcount_inc(&conf->refs);
+	mutex_unlock(&xt_payload_conf_mutex);
+
+	return conf ?: ERR_PTR(-ENOENT);
+}
+EXPORT_SYMBOL_GPL(xt_payload_conf_get);
+
+/**
+ * Nothing can be looking at a config whose last reference is gone: rules
+ * only let go of theirs once no packet can reach them.
+ */
+void xt_payload_conf_put(struct xt_payload_conf *conf)
+{
+	struct xt_payload_conf_data *d;
+
+	if (!refcount_dec_and_test(&conf->refs))
+		return;
+	d = rcu_dereference_protected(conf->data, 1);
+	call_rcu(&d->rcu, xt_payload_conf_data_free);
+	kfree(conf);
+}
+EXPORT_SYMBOL_GPL(xt_payload_conf_put);
+
+/* Make name hold d from now on, setting it up if there is no such config */
+static int xt_payload_conf_set(struct xt_payload_net *pn, const char *name,
+		struct xt_payload_conf_data *d)
+{
+	struct xt_payload_conf *conf;
+
+	mutex_lock(&xt_payload_conf_mutex);
+	conf = xt_payload_conf_find(pn, name);
+	if (conf) {
+		d = rcu_replace_pointer(conf->data, d,
+				lockdep_is_held(&xt_payload_conf_mutex));
+		mutex_unlock(&xt_payload_conf_mutex);
+		call_rcu(&d->rcu, xt_payload_conf_data_free);
+		return 0;
+	}
+
+	conf = kzalloc(sizeof(*conf), GFP_KERNEL);
+	if (!conf) {
+		mutex_unlock(&xt_payload_conf_mutex);
+		return -ENOMEM;
+	}
+	refcount_set(&conf->refs, 1);
+	strscpy(conf->name, name, sizeof(conf->name));
+	RCU_INIT_POINTER(conf->data, d);
+	list_add_tail(&conf->list, &pn->confs);
+	mutex_unlock(&xt_payload_conf_mutex);
+
+	return 0;
+}
+
+static int xt_payload_conf_del(struct xt_payload_net *pn, const char *name)
+{
+	struct xt_payload_conf *conf;
+	int ret = 0;
+
+	mutex_lock(&xt_payload_conf_mutex);
+	conf = xt_payload_conf_find(pn, name);
+	if (!conf)
+		ret = -ENOENT;
+	else if (refcount_read(&conf->refs) > 1)
+		ret = -EBUSY;
+	else
+		list_del(&conf->list);
+	mutex_unlock(&xt_payload_conf_mutex);
+	if (!ret)
+		xt_payload_conf_put(conf);
+
+	return ret;
+}
+
+static int xt_payload_conf_show(struct seq_file *seq, void *v)
+{
+	struct xt_payload_net *pn = pde_data(file_inode(seq->file));
+	const struct xt_payload_conf_data *d;
+	struct xt_payload_conf *conf;
+	unsigned int i;
+
+	seq_puts(seq, "name rules config\n");
+	mutex_lock(&xt_payload_conf_mutex);
+	list_for_each_entry(conf, &pn->confs, list) {
+		d = rcu_dereference_protected(conf->data,
+				lockdep_is_held(&xt_payload_conf_mutex));
+		seq_printf(seq, "%s %u ", conf->name,
+			   refcount_read(&conf->refs) - 1);
+		for (i = 0; i < pn->t->conf_size; i++)
+			seq_printf(seq, "%02x", d->data[i]);
+		seq_putc(seq, '\n');
+	}
+	mutex_unlock(&xt_payload_conf_mutex);
+
+	return 0;
+}
+
+/* see xt_payload_conf.h */
+static int xt_payload_conf_write(struct file *file, char *buf, size_t size)
+{
+	struct xt_payload_net *pn = pde_data(file_inode(file));
+	const struct xt_payload_conf_msg *msg = (const void *)buf;
+	struct net *net = seq_file_single_net(file->private_data);
+	const struct xt_payload_target *t = pn->t;
+	struct xt_payload_conf_data *d;
+	int ret;
+
+	if (!ns_capable(net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+	if (size != sizeof(*msg) && size != sizeof(*msg) + t->conf_size)
+		return -EINVAL;
+	if (!msg->name[0] || !memchr(msg->name, 0, sizeof(msg->name)))
+		return -EINVAL;
+	if (size == sizeof(*msg))
+		return xt_payload_conf_del(pn, msg->name);
+
+	d = kmalloc(struct_size(d, data, t->conf_size), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	d->t = t;
+	memcpy(d->data, msg->data, t->conf_size);
+	d->conf = t->conf_build(d->data);
+	if (IS_ERR(d->conf)) {
+		ret = PTR_ERR(d->conf);
+		goto err;
+	}
+	ret = xt_payload_conf_set(pn, msg->name, d);
+	if (ret) {
+		t->conf_free(d->conf);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	kfree(d);
+	return ret;
+}
+
+/* The configs that no rule holds go with the netns */
+static void xt_payload_conf_net_exit(struct xt_payload_net *pn)
+{
+	struct xt_payload_conf *conf, *next;
+
+	mutex_lock(&xt_payload_conf_mutex);
+	list_for_each_entry_safe(conf, next, &pn->confs, list) {
+		list_del(&conf->list);
+		xt_payload_conf_put(conf);
+	}
+	mutex_unlock(&xt_payload_conf_mutex);
+}
+
+static int xt_payload_stat_seq_show(struct seq_file *seq, void *v)
+{
+	struct xt_payload_net *pn = pde_data(file_inode(seq->file));
+
+	return xt_payload_stat_show(seq, pn->stats);
+}
+
+/**
+ * Creates the stats of t in net and /proc/net/<name>_stat to show them,
+ * and /proc/net/<name>_conf if t has named configs.
+ */
+int xt_payload_net_init(struct xt_payload_target *t,
+		struct xt_payload_net *pn, struct net *net)
+{
+	pn->t = t;
+	INIT_LIST_HEAD(&pn->confs);
+	pn->stats = alloc_percpu(struct xt_payload_stats);
+	if (!pn->stats)
+		return -ENOMEM;
+	if (!proc_create_net_single(t->stat_name, 0444, net->proc_net,
+				    xt_payload_stat_seq_show, pn))
+		goto err_stats;
+	if (t->conf_size &&
+	    !proc_create_net_single_write(t->conf_name, 0600, net->proc_net,
+					  xt_payload_conf_show,
+					  xt_payload_conf_write, pn))
+		goto err_proc;
+
+	return 0;
+
+err_proc:
+	remove_proc_entry(t->stat_name, net->proc_net);
+err_stats:
+	free_percpu(pn->stats);
+	return -ENOMEM;
+}
+EXPORT_SYMBOL_GPL(xt_payload_net_init);
+
+void xt_payload_net_exit(struct xt_payload_target *t,
+		struct xt_payload_net *pn, struct net *net)
+{
+	if (t->conf_size) {
+		remove_proc_entry(t->conf_name, net->proc_net);
+		xt_payload_conf_net_exit(pn);
+	}
+	remove_proc_entry(t->stat_name, net->proc_net);
+	free_percpu(pn->stats);
+}
+EXPORT_SYMBOL_GPL(xt_payload_net_exit);
+
+/**
+ * To be called before the target registers its pernet_operations, which
+ * call xt_payload_net_init(), and anything that can reach
+ * xt_payload_run().
+ */
+int xt_payload_register(struct xt_payload_target *t)
+{
+	int ret;
+
+	/* proc hands writes of up to a page less one byte over */
+	if (WARN_ON(t->conf_size && sizeof(struct xt_payload_conf_msg) +
+		    t->conf_size >= PAGE_SIZE))
+		return -EINVAL;
+	snprintf(t->stat_name, sizeof(t->stat_name), "%s_stat", t->name);
+	snprintf(t->conf_name, sizeof(t->conf_name), "%s_conf", t->name);
+	t->hist = kzalloc(sizeof(*t->hist), GFP_KERNEL);
+	if (!t->hist)
+		return -ENOMEM;
+	ret = xt_payload_hist_init(t->hist, t->name);
+	if (ret) {
+		kfree(t->hist);
+		return ret;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(xt_payload_register);
+
+void xt_payload_unregister(struct xt_payload_target *t)
+{
+	xt_payload_hist_exit(t->hist);
+	kfree(t->hist);
+	/* configs dropped on the way out still call t->conf_free() */
+	if (t->conf_size)
+		rcu_barrier();
+}
+EXPORT_SYMBOL_GPL(xt_payload_unregister);
@@ -0,0 +1,216 @@
+/**
+ * xt_payload - the payload mangling core shared by the targets.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XT_PAYLOAD_H
+#define _XT_PAYLOAD_H
+
+#include <linux/skbuff.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <net/net_namespace.h>
+
+#include "xt_payload_core.h"
+#include "xt_payload_conf.h"
+
+/**
+ * xt_payload.ko does everything a payload target does apart from the
+ * transform itself: it parses the IPv4 and TCP/UDP headers, decides whether
+ * the checksum state allows the payload to change, walks the linear area,
+ * page frags and frag_list, copies only what is going to be written to,
+ * fixes the L4 checksum up and keeps the stats, tracepoints and latency
+ * histogram. A target is an xt_payload_ops and a few hooks.
+ */
+
+/* Where a chunk lives, see xt_payload_chunk.frag */
+#define XT_PAYLOAD_LINEAR	-1
+#define XT_PAYLOAD_LIST		-2
+
+struct xt_payload_chunk {
+	u8		*data;
+	unsigned int	len;
+	/* offset of data from the start of the walk */
+	unsigned int	off;
+	/**
+	 * index into skb_shinfo(skb)->frags[] of the skb the walk started
+	 * at, XT_PAYLOAD_LINEAR for its linear area or XT_PAYLOAD_LIST for
+	 * anything in its frag_list
+	 */
+	int		frag;
+};
+
+/**
+ * Called once per contiguous chunk of payload, in order. A non-zero return
+ * value stops the walk and is passed back to the caller.
+ */
+typedef int (*xt_payload_fn)(void *priv, const struct xt_payload_chunk *c);
+
+/**
+ * A transform as seen by xt_payload_run(). scan() runs over the payload
+ * first without writing to it and returns true for every chunk mangle()
+ * would change, reset() then rewinds the per-packet state and mangle() does
+ * the real work. mangle() must not write to a chunk scan() passed over,
+ * since that chunk may still be shared with another skb. A transform that
+ * changes every byte can leave scan() NULL.
+ *
+ * sums_all says mangle() adds every byte of the payload to the checksum
+ * accumulator, changed or not, so that its to half ends up as the sum of
+ * the whole new payload. Otherwise the core sums the payload itself while
+ * scan() has it in cache, and applies the transform's changes on top.
+ */
+struct xt_payload_ops {
+	bool	(*scan)(void *priv, const struct xt_payload_chunk *c);
+	void	(*reset)(void *priv);
+	xt_payload_fn mangle;
+	bool	sums_all;
+};
+
+/* What xt_payload_run() found out about a packet */
+struct xt_payload_pkt {
+	/* offsets from skb->data of the L4 header and of the payload */
+	unsigned int		thoff;
+	unsigned int		doff;
+	unsigned int		len;
+	u8			protocol;
+	/* host order, TCP only */
+	u32			seq;
+	/**
+	 * The part of the payload the walk covers, which prepare() can
+	 * narrow: it starts skip bytes in and is at most limit bytes long,
+	 * 0 meaning up to the end. After prepare() limit is the exact
+	 * length of the walk.
+	 */
+	unsigned int		skip;
+	unsigned int		limit;
+	/* the target's ops, prepare() can swap in others for this packet */
+	const struct xt_payload_ops	*ops;
+	/**
+	 * Where the ops keep the checksum changes they make, set by
+	 * prepare(). It has to be up to date after every mangle() call,
+	 * the segments of a frag_list GSO skb each get their checksum
+	 * patched for what the calls over them added. rewritten starts out
+	 * as limit, finish() can lower it.
+	 */
+	struct xt_payload_csum	*csum;
+	unsigned int		rewritten;
+	/* prepare() changed the payload with xt_payload_splice() already */
+	bool			spliced;
+};
+
+/* Whether the walk over pkt covers all of its payload */
+static inline bool xt_payload_pkt_whole(const struct xt_payload_pkt *pkt)
+{
+	return !pkt->skip && pkt->limit == pkt->len;
+}
+
+struct xt_payload_hist_ctl;
+struct xt_payload_stats;
+
+struct xt_payload_target {
+	/* names /proc/net/<name>_stat, /sys/kernel/debug/<name>/ */
+	const char			*name;
+	const struct xt_payload_ops	*ops;
+	/**
+	 * Sets up the per-packet state the ops get for pkt, which has a
+	 * payload, and may narrow the walk. Returning false leaves the
+	 * packet alone.
+	 */
+	bool	(*prepare)(void *priv, struct sk_buff *skb,
+			   struct xt_payload_pkt *pkt);
+	/**
+	 * Optional, called after the walk with its result: 1 if the payload
+	 * changed, 0 if there was nothing to change, or a negative errno.
+	 */
+	void	(*finish)(void *priv, struct sk_buff *skb,
+			  struct xt_payload_pkt *pkt, int ret);
+	/**
+	 * Optional, named configs, see xt_payload_conf.h: conf_size bytes
+	 * from userspace to build one from, conf_build() turning them into
+	 * what the target's rules use (or an ERR_PTR) and conf_free()
+	 * freeing that once no packet can see it anymore. The bytes stay
+	 * around as long as what was built from them.
+	 */
+	unsigned int	conf_size;
+	void	*(*conf_build)(const void *data);
+	void	(*conf_free)(void *conf);
+
+	/* set up by xt_payload_register() */
+	struct xt_payload_hist_ctl	*hist;
+	char				stat_name[32];
+	char				conf_name[32];
+};
+
+/* A target's state in each netns, for its pernet_operations to embed */
+struct xt_payload_net {
+	struct xt_payload_target		*t;
+	struct xt_payload_stats __percpu	*stats;
+	/* the named configs, under xt_payload_conf_mutex */
+	struct list_head			confs;
+};
+
+/* What a named config holds, replaced as a whole when it is set again */
+struct xt_payload_conf_data {
+	struct rcu_head				rcu;
+	const struct xt_payload_target		*t;
+	/* what t->conf_build() made of data */
+	void					*conf;
+	u8					data[] __aligned(8);
+};
+
+/**
+ * A named config, which lives as long as it is set or a rule holds it,
+ * see xt_payload_conf_get().
+ */
+struct xt_payload_conf {
+	struct list_head			list;
+	refcount_t				refs;
+	char					name[XT_PAYLOAD_CONF_NAME];
+	struct xt_payload_conf_data __rcu	*data;
+};
+
+/**
+ * What conf holds at the moment, for a packet to use until it leaves the
+ * RCU read side section the hooks run in.
+ */
+static inline void *xt_payload_conf_deref(const struct xt_payload_conf *conf)
+{
+	return rcu_dereference(conf->data)->conf;
+}
+
+int xt_payload_register(struct xt_payload_target *t);
+void xt_payload_unregister(struct xt_payload_target *t);
+int xt_payload_net_init(struct xt_payload_target *t,
+		struct xt_payload_net *pn, struct net *net);
+void xt_payload_net_exit(struct xt_payload_target *t,
+		struct xt_payload_net *pn, struct net *net);
+int xt_payload_walk(struct sk_buff *skb, unsigned int offset,
+		unsigned int skip, unsigned int len, xt_payload_fn fn,
+		void *priv);
+int xt_payload_splice(struct sk_buff *skb, struct xt_payload_pkt *pkt,
+		const struct xt_payload_edit *edits, unsigned int n,
+		struct xt_payload_stats __percpu *stats);
+struct xt_payload_conf *xt_payload_conf_get(struct xt_payload_net *pn,
+		const char *name);
+void xt_payload_conf_put(struct xt_payload_conf *conf);
+int xt_payload_defrag_get(struct net *net);
+void xt_payload_defrag_put(struct net *net);
+unsigned int xt_payload_run(struct xt_payload_target *t,
+		struct xt_payload_net *pn, struct sk_buff *skb,
+		unsigned int thoff, void *priv, unsigned int *rewritten);
+
+#endif /* _XT_PAYLOAD_H */
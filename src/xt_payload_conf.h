@@ -0,0 +1,50 @@
+/**
+ * xt_payload_conf - named configs for the payload targets.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XT_PAYLOAD_CONF_H
+#define _XT_PAYLOAD_CONF_H
+
+#include <linux/types.h>
+
+/**
+ * A rule can name a config instead of carrying its own options, and then
+ * does what the config says at the time each packet goes through. A
+ * config is the part of the target's info struct that comes from
+ * userspace (its userspacesize bytes), minus the name, and lives in
+ * /proc/net/<target>_conf of the netns, e.g. /proc/net/xt_uwu_conf:
+ *
+ * - writing an xt_payload_conf_msg with the config right after it sets
+ *   name to that config, replacing the one before at once for every rule
+ *   using it
+ * - writing just the xt_payload_conf_msg deletes name, which fails with
+ *   EBUSY while rules use it
+ * - reading lists one "name rules config" line per config, the config in
+ *   hex
+ *
+ * payload-conf does all that with the options the iptables extension
+ * knows.
+ */
+#define XT_PAYLOAD_CONF_NAME	32
+
+struct xt_payload_conf_msg {
+	char			name[XT_PAYLOAD_CONF_NAME];
+	__u8			data[];
+};
+
+#endif /* _XT_PAYLOAD_CONF_H */
@@ -0,0 +1,206 @@
+/**
+ * xt_payload_core - the parts of the payload targets that don't need an skb.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XT_PAYLOAD_CORE_H
+#define _XT_PAYLOAD_CORE_H
+
+/**
+ * uwu_core.h and xor_core.h hold the byte kernels and build both in the
+ * kernel and, for test/, in userspace. This maps what they use onto the
+ * kernel or onto libc and the compiler.
+ *
+ * The vector kernels keep constants in xmm4-11/ymm4-11 across asm statements
+ * the way lib/raid6 does, which relies on the compiler never using those
+ * registers itself. The kernel is built that way anyway, userspace code
+ * including these headers has to be built with -mgeneral-regs-only.
+ */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+/* moved out of asm/ in 6.12 */
+#if __has_include(<linux/unaligned.h>)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#ifdef CONFIG_X86_64
+#include <asm/fpu/api.h>
+#include <asm/cpufeature.h>
+
+#define XT_PAYLOAD_X86		1
+#define xt_payload_has_sse2()	boot_cpu_has(X86_FEATURE_XMM2)
+#define xt_payload_has_avx2()	(boot_cpu_has(X86_FEATURE_AVX2) &&	\
+				 cpu_has_xfeatures(XFEATURE_MASK_SSE |	\
+						   XFEATURE_MASK_YMM, NULL))
+#endif
+#else /* !__KERNEL__ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+typedef int64_t		s64;
+
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+#define __maybe_unused		__attribute__((unused))
+#define __aligned(x)		__attribute__((aligned(x)))
+#define __read_mostly
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#endif
+#define min_t(type, a, b)	((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define get_unaligned(p)	({ __typeof__(*(p) + 0) __v;		\
+				   memcpy(&__v, (p), sizeof(__v)); __v; })
+#define put_unaligned(v, p)	({ __typeof__(*(p)) __v = (v);		\
+				   memcpy((p), &__v, sizeof(__v)); })
+#define __ffs(x)		((unsigned long)__builtin_ctzl(x))
+#define hweight32(x)		((unsigned int)__builtin_popcount(x))
+
+#ifdef __x86_64__
+#define XT_PAYLOAD_X86		1
+#define xt_payload_has_sse2()	__builtin_cpu_supports("sse2")
+#define xt_payload_has_avx2()	__builtin_cpu_supports("avx2")
+
+/* the whole process is ours, there is no FPU state to save */
+static inline bool irq_fpu_usable(void)
+{
+	return true;
+}
+
+static inline void kernel_fpu_begin(void)
+{
+}
+
+static inline void kernel_fpu_end(void)
+{
+}
+#endif
+#endif /* __KERNEL__ */
+
+/**
+ * What a transform did to the L4 checksum: the bytes it replaced and the
+ * bytes it wrote in their place, each summed as big endian 16 bit words
+ * the way the checksum sees them. The payload starts at an even offset
+ * from the L4 header for both TCP and UDP, so the parity of the payload
+ * offset says which half of a word a byte lands in.
+ */
+struct xt_payload_csum {
+	u64	from;
+	u64	to;
+};
+
+static __always_inline void xt_payload_csum_add(struct xt_payload_csum *csum,
+		unsigned int off, u8 from, u8 to)
+{
+	unsigned int shift = off & 1 ? 0 : 8;
+
+	csum->from += (u32)from << shift;
+	csum->to += (u32)to << shift;
+}
+
+static __always_inline u16 xt_payload_csum_fold16(u64 sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/**
+ * The same for whole runs of bytes starting off bytes into the payload,
+ * given as sums of 16 bit words loaded in native byte order (sums of u32s
+ * do as well). The ones' complement sum only cares about byte order in
+ * that the halves of the result swap, so that is all that happens when
+ * native order puts byte off in the other half of a word than the
+ * checksum does.
+ */
+static __always_inline void xt_payload_csum_add_words(
+		struct xt_payload_csum *csum, unsigned int off, u64 from, u64 to)
+{
+	u16 f = xt_payload_csum_fold16(from), t = xt_payload_csum_fold16(to);
+
+	if (!(off & 1) == !!(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) {
+		f = f << 8 | f >> 8;
+		t = t << 8 | t >> 8;
+	}
+	csum->from += f;
+	csum->to += t;
+}
+
+/**
+ * The change of two transforms run one after the other over the same
+ * bytes, where the second one sums every byte: it saw from as the first
+ * one left it, so taking what the first one changed back out of that
+ * leaves the sum of the original bytes. to stays the sum of the whole
+ * result.
+ */
+static __always_inline void xt_payload_csum_chain(struct xt_payload_csum *out,
+		const struct xt_payload_csum *first,
+		const struct xt_payload_csum *second)
+{
+	out->from = xt_payload_csum_fold16(second->from) +
+		    xt_payload_csum_fold16(first->from) +
+		    (u16)~xt_payload_csum_fold16(first->to);
+	out->to = second->to;
+}
+
+/**
+ * What an accumulator gained between then and now, for a checksum over
+ * bytes that start start bytes into the payload rather than at its start:
+ * the segments of a frag_list GSO skb each have their own, see
+ * xt_payload_segs. The difference is taken in ones' complement, so it
+ * holds for accumulators put together with xt_payload_csum_chain() too.
+ */
+static __always_inline void xt_payload_csum_since(struct xt_payload_csum *out,
+		const struct xt_payload_csum *now,
+		const struct xt_payload_csum *then, unsigned int start)
+{
+	u16 from = xt_payload_csum_fold16(xt_payload_csum_fold16(now->from) +
+			(u16)~xt_payload_csum_fold16(then->from));
+	u16 to = xt_payload_csum_fold16(xt_payload_csum_fold16(now->to) +
+			(u16)~xt_payload_csum_fold16(then->to));
+
+	if (start & 1) {
+		from = from << 8 | from >> 8;
+		to = to << 8 | to >> 8;
+	}
+	out->from = from;
+	out->to = to;
+}
+
+/**
+ * len bytes off bytes into the payload to be replaced with the data_len
+ * bytes at data, see xt_payload_splice().
+ */
+struct xt_payload_edit {
+	unsigned int	off;
+	unsigned int	len;
+	const u8	*data;
+	unsigned int	data_len;
+};
+
+#endif /* _XT_PAYLOAD_CORE_H */
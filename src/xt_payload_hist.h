@@ -0,0 +1,190 @@
+/**
+ * xt_payload_hist - per-packet latency histograms for the payload targets.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XT_PAYLOAD_HIST_H
+#define _XT_PAYLOAD_HIST_H
+
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/jump_label.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+
+/**
+ * Time spent in the target per packet, bucketed by log2 of the nanoseconds
+ * and by payload size class. Recording is behind a static key, so with the
+ * histogram switched off (the default) the target only pays for a nop.
+ * The key is xt_payload.ko's, on while any target has its histogram on,
+ * and each target has a flag of its own on top.
+ */
+#define XT_PAYLOAD_HIST_SIZES	7
+#define XT_PAYLOAD_HIST_BUCKETS	32
+
+static const unsigned int xt_payload_hist_size_max[XT_PAYLOAD_HIST_SIZES] = {
+	0, 64, 256, 1024, 4096, 16384, UINT_MAX,
+};
+
+struct xt_payload_hist {
+	u64	cnt[XT_PAYLOAD_HIST_SIZES][XT_PAYLOAD_HIST_BUCKETS];
+};
+
+struct xt_payload_hist_ctl {
+	int					enabled;
+	struct xt_payload_hist __percpu		*hist;
+	struct dentry				*dir;
+};
+
+static DEFINE_STATIC_KEY_FALSE(xt_payload_hist_key);
+
+/* Returns the start time to pass to xt_payload_hist_record(), or 0 */
+static __always_inline u64 xt_payload_hist_start(struct xt_payload_hist_ctl *ctl)
+{
+	if (static_branch_unlikely(&xt_payload_hist_key) &&
+	    READ_ONCE(ctl->enabled))
+		return ktime_get_ns();
+
+	return 0;
+}
+
+static __always_inline void xt_payload_hist_record(
+		struct xt_payload_hist_ctl *ctl, u64 start, unsigned int len)
+{
+	u64 ns;
+	int size = 0, bucket = 0;
+
+	if (!start)
+		return;
+	ns = ktime_get_ns() - start;
+	while (len > xt_payload_hist_size_max[size])
+		size++;
+	if (ns)
+		bucket = min_t(int, ilog2(ns), XT_PAYLOAD_HIST_BUCKETS - 1);
+	this_cpu_inc(ctl->hist->cnt[size][bucket]);
+}
+
+/**
+ * One line per size class, holding the largest payload in the class and
+ * then the number of packets that took [2^i, 2^(i+1)) ns for every i.
+ */
+static inline int xt_payload_hist_show(struct seq_file *seq, void *v)
+{
+	struct xt_payload_hist_ctl *ctl = seq->private;
+	int cpu, size, i;
+
+	for (size = 0; size < XT_PAYLOAD_HIST_SIZES; size++) {
+		seq_printf(seq, "%u", xt_payload_hist_size_max[size]);
+		for (i = 0; i < XT_PAYLOAD_HIST_BUCKETS; i++) {
+			u64 n = 0;
+
+			for_each_possible_cpu(cpu)
+				n += READ_ONCE(per_cpu_ptr(ctl->hist,
+							cpu)->cnt[size][i]);
+			seq_printf(seq, " %llu", n);
+		}
+		seq_putc(seq, '\n');
+	}
+
+	return 0;
+}
+
+static inline int xt_payload_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, xt_payload_hist_show, inode->i_private);
+}
+
+/* Any write clears the histogram */
+static inline ssize_t xt_payload_hist_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct xt_payload_hist_ctl *ctl =
+		((struct seq_file *)file->private_data)->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(ctl->hist, cpu), 0,
+		       sizeof(struct xt_payload_hist));
+
+	return count;
+}
+
+static const struct file_operations xt_payload_hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= xt_payload_hist_open,
+	.read		= seq_read,
+	.write		= xt_payload_hist_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static inline int xt_payload_hist_enable_get(void *data, u64 *val)
+{
+	struct xt_payload_hist_ctl *ctl = data;
+
+	*val = READ_ONCE(ctl->enabled);
+
+	return 0;
+}
+
+static inline int xt_payload_hist_enable_set(void *data, u64 val)
+{
+	struct xt_payload_hist_ctl *ctl = data;
+
+	if (xchg(&ctl->enabled, !!val) == !!val)
+		return 0;
+	if (val)
+		static_branch_inc(&xt_payload_hist_key);
+	else
+		static_branch_dec(&xt_payload_hist_key);
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(xt_payload_hist_enable_fops,
+		xt_payload_hist_enable_get, xt_payload_hist_enable_set,
+		"%llu\n");
+
+/**
+ * Creates /sys/kernel/debug/<name>/latency_hist and latency_hist_enable.
+ * debugfs being unavailable isn't an error, the histogram just can't be
+ * switched on then.
+ */
+static inline int xt_payload_hist_init(struct xt_payload_hist_ctl *ctl,
+		const char *name)
+{
+	ctl->hist = alloc_percpu(struct xt_payload_hist);
+	if (!ctl->hist)
+		return -ENOMEM;
+	ctl->dir = debugfs_create_dir(name, NULL);
+	debugfs_create_file("latency_hist", 0600, ctl->dir, ctl,
+			    &xt_payload_hist_fops);
+	debugfs_create_file_unsafe("latency_hist_enable", 0600, ctl->dir, ctl,
+				   &xt_payload_hist_enable_fops);
+
+	return 0;
+}
+
+static inline void xt_payload_hist_exit(struct xt_payload_hist_ctl *ctl)
+{
+	debugfs_remove_recursive(ctl->dir);
+	xt_payload_hist_enable_set(ctl, 0);
+	free_percpu(ctl->hist);
+}
+
+#endif /* _XT_PAYLOAD_HIST_H */
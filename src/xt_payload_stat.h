@@ -0,0 +1,125 @@
+/**
+ * xt_payload_stat - per-CPU counters for the payload mangling targets.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XT_PAYLOAD_STAT_H
+#define _XT_PAYLOAD_STAT_H
+
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+enum {
+	XT_PAYLOAD_STAT_PACKETS,
+	XT_PAYLOAD_STAT_SKIP_PROTO,
+	XT_PAYLOAD_STAT_SKIP_OFFLOAD,
+	XT_PAYLOAD_STAT_SKIP_BINARY,
+	XT_PAYLOAD_STAT_SKIP_BUDGET,
+	XT_PAYLOAD_STAT_BUDGET_CUT,
+	XT_PAYLOAD_STAT_UNCHANGED,
+	XT_PAYLOAD_STAT_BYTES_SCANNED,
+	XT_PAYLOAD_STAT_BYTES_REWRITTEN,
+	XT_PAYLOAD_STAT_BYTES_SKIPPED,
+	XT_PAYLOAD_STAT_COW,
+	XT_PAYLOAD_STAT_CSUM_FUSED,
+	XT_PAYLOAD_STAT_SPLICED,
+	XT_PAYLOAD_STAT_DROP_HDR,
+	XT_PAYLOAD_STAT_DROP_FRAG,
+	XT_PAYLOAD_STAT_DROP_NOMEM,
+	XT_PAYLOAD_STAT_DROP_LAYOUT,
+	__XT_PAYLOAD_STAT_MAX
+};
+
+static const char * const xt_payload_stat_names[__XT_PAYLOAD_STAT_MAX] = {
+	[XT_PAYLOAD_STAT_PACKETS]		= "packets",
+	[XT_PAYLOAD_STAT_SKIP_PROTO]		= "skip_proto",
+	[XT_PAYLOAD_STAT_SKIP_OFFLOAD]		= "skip_offload",
+	[XT_PAYLOAD_STAT_SKIP_BINARY]		= "skip_binary",
+	[XT_PAYLOAD_STAT_SKIP_BUDGET]		= "skip_budget",
+	[XT_PAYLOAD_STAT_BUDGET_CUT]		= "budget_cut",
+	[XT_PAYLOAD_STAT_UNCHANGED]		= "unchanged",
+	[XT_PAYLOAD_STAT_BYTES_SCANNED]		= "bytes_scanned",
+	[XT_PAYLOAD_STAT_BYTES_REWRITTEN]	= "bytes_rewritten",
+	[XT_PAYLOAD_STAT_BYTES_SKIPPED]		= "bytes_skipped",
+	[XT_PAYLOAD_STAT_COW]			= "cow",
+	[XT_PAYLOAD_STAT_CSUM_FUSED]		= "csum_fused",
+	[XT_PAYLOAD_STAT_SPLICED]		= "spliced",
+	[XT_PAYLOAD_STAT_DROP_HDR]		= "drop_hdr",
+	[XT_PAYLOAD_STAT_DROP_FRAG]		= "drop_frag",
+	[XT_PAYLOAD_STAT_DROP_NOMEM]		= "drop_nomem",
+	[XT_PAYLOAD_STAT_DROP_LAYOUT]		= "drop_layout",
+};
+
+struct xt_payload_stats {
+	u64	cnt[__XT_PAYLOAD_STAT_MAX];
+};
+
+/**
+ * this_cpu_add() rather than __this_cpu_add(): the xtables targets run with
+ * BH disabled under ipt_do_table(), but nft_do_chain() on the output path
+ * doesn't, so a softirq can land in the middle of the update.
+ */
+static inline void xt_payload_stat_add(struct xt_payload_stats __percpu *stats,
+		int item, u64 n)
+{
+	if (stats)
+		this_cpu_add(stats->cnt[item], n);
+}
+
+static inline void xt_payload_stat_inc(struct xt_payload_stats __percpu *stats,
+		int item)
+{
+	xt_payload_stat_add(stats, item, 1);
+}
+
+/**
+ * Same layout as /proc/net/stat/nf_conntrack: a header line naming the
+ * columns, one line per possible CPU and a total at the end.
+ */
+static inline int xt_payload_stat_show(struct seq_file *seq,
+		struct xt_payload_stats __percpu *stats)
+{
+	u64 total[__XT_PAYLOAD_STAT_MAX] = { 0 };
+	int cpu, i;
+
+	seq_puts(seq, "cpu");
+	for (i = 0; i < __XT_PAYLOAD_STAT_MAX; i++)
+		seq_printf(seq, " %s", xt_payload_stat_names[i]);
+	seq_putc(seq, '\n');
+
+	for_each_possible_cpu(cpu) {
+		const struct xt_payload_stats *st = per_cpu_ptr(stats, cpu);
+
+		seq_printf(seq, "%d", cpu);
+		for (i = 0; i < __XT_PAYLOAD_STAT_MAX; i++) {
+			u64 v = READ_ONCE(st->cnt[i]);
+
+			seq_printf(seq, " %llu", v);
+			total[i] += v;
+		}
+		seq_putc(seq, '\n');
+	}
+
+	seq_puts(seq, "total");
+	for (i = 0; i < __XT_PAYLOAD_STAT_MAX; i++)
+		seq_printf(seq, " %llu", total[i]);
+	seq_putc(seq, '\n');
+
+	return 0;
+}
+
+#endif /* _XT_PAYLOAD_STAT_H */
@@ -0,0 +1,202 @@
+/**
+ * xt_uwu_flow - per-connection stream state for the UWU target.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _XT_UWU_FLOW_H
+#define _XT_UWU_FLOW_H
+
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <net/tcp.h>
+#include <net/netfilter/nf_conntrack.h>
+
+#include "uwu_core.h"
+
+/**
+ * Where the uwu state machine was at a given TCP sequence number of one
+ * direction of a connection. Out of tree modules can't add a conntrack
+ * extension, so instead of hanging off the nf_conn this lives in a fixed
+ * size table indexed by the conntrack id. Two connections hashing to the
+ * same slot simply evict each other, which costs nothing worse than the
+ * old behaviour of starting every segment afresh.
+ */
+#define UWU_FLOW_CKPTS	4
+
+struct uwu_flow_ckpt {
+	u32	seq;
+	u8	mode;
+};
+
+struct uwu_flow_dir {
+	/* the sequence number following the last byte we saw */
+	u32			next_seq;
+	/* uwu_mode at next_seq */
+	u8			mode;
+	u8			valid;
+	/* UWU_CLASS_*, what the start of the payload looked like */
+	u8			class;
+	/* starts of recent segments, so retransmits can pick up there */
+	u8			nr_ckpts;
+	u8			ckpt_head;
+	struct uwu_flow_ckpt	ckpts[UWU_FLOW_CKPTS];
+};
+
+struct uwu_flow {
+	spinlock_t		lock;
+	/* only ever compared, never dereferenced */
+	const struct nf_conn	*ct;
+	u32			ct_id;
+	struct uwu_flow_dir	dir[IP_CT_DIR_MAX];
+};
+
+struct uwu_flow_table {
+	struct uwu_flow		*slots;
+	unsigned int		bits;
+};
+
+static inline int uwu_flow_table_init(struct uwu_flow_table *t,
+		unsigned int nr_slots)
+{
+	unsigned int i;
+
+	if (!nr_slots)
+		return 0;
+	t->bits = order_base_2(nr_slots);
+	t->slots = kvcalloc(1U << t->bits, sizeof(*t->slots), GFP_KERNEL);
+	if (!t->slots)
+		return -ENOMEM;
+	for (i = 0; i < (1U << t->bits); i++)
+		spin_lock_init(&t->slots[i].lock);
+
+	return 0;
+}
+
+static inline void uwu_flow_table_free(struct uwu_flow_table *t)
+{
+	kvfree(t->slots);
+	t->slots = NULL;
+}
+
+static inline struct uwu_flow *uwu_flow_slot(const struct uwu_flow_table *t,
+		u32 ct_id)
+{
+	return &t->slots[hash_32(ct_id, t->bits)];
+}
+
+/**
+ * The uwu_mode a segment of ct starting at seq should start in: the state
+ * we left off in if it follows on from the last one, the state recorded for
+ * its start if it is a retransmit, else 0 as for a fresh line. Also
+ * returns the class recorded for this direction in *class, which is all
+ * a UDP flow looks up.
+ */
+static inline int uwu_flow_lookup(const struct uwu_flow_table *t,
+		const struct nf_conn *ct, u32 ct_id,
+		enum ip_conntrack_dir dir, u32 seq, int *class)
+{
+	struct uwu_flow *flow = uwu_flow_slot(t, ct_id);
+	const struct uwu_flow_dir *d = &flow->dir[dir];
+	int i, mode = 0;
+
+	*class = UWU_CLASS_UNKNOWN;
+	spin_lock_bh(&flow->lock);
+	if (flow->ct != ct || flow->ct_id != ct_id)
+		goto out;
+	*class = d->class;
+	if (d->valid) {
+		if (seq == d->next_seq) {
+			mode = d->mode;
+		} else {
+			for (i = 0; i < d->nr_ckpts; i++) {
+				if (d->ckpts[i].seq == seq) {
+					mode = d->ckpts[i].mode;
+					break;
+				}
+			}
+		}
+	}
+out:
+	spin_unlock_bh(&flow->lock);
+
+	return mode;
+}
+
+/* Under flow->lock: evict whatever else hashed to the slot of ct */
+static inline void uwu_flow_claim(struct uwu_flow *flow,
+		const struct nf_conn *ct, u32 ct_id)
+{
+	if (flow->ct != ct || flow->ct_id != ct_id) {
+		memset(flow->dir, 0, sizeof(flow->dir));
+		flow->ct = ct;
+		flow->ct_id = ct_id;
+	}
+}
+
+/**
+ * Record that the len bytes at seq were processed starting in start_mode
+ * and ending in end_mode.
+ */
+static inline void uwu_flow_update(const struct uwu_flow_table *t,
+		const struct nf_conn *ct, u32 ct_id,
+		enum ip_conntrack_dir dir, u32 seq, u32 len,
+		int start_mode, int end_mode)
+{
+	struct uwu_flow *flow = uwu_flow_slot(t, ct_id);
+	struct uwu_flow_dir *d = &flow->dir[dir];
+	u32 end_seq = seq + len;
+	int i;
+
+	spin_lock_bh(&flow->lock);
+	uwu_flow_claim(flow, ct, ct_id);
+
+	for (i = 0; i < d->nr_ckpts; i++) {
+		if (d->ckpts[i].seq == seq)
+			break;
+	}
+	if (i == d->nr_ckpts) {
+		d->ckpts[d->ckpt_head].seq = seq;
+		d->ckpts[d->ckpt_head].mode = start_mode;
+		d->ckpt_head = (d->ckpt_head + 1) % UWU_FLOW_CKPTS;
+		if (d->nr_ckpts < UWU_FLOW_CKPTS)
+			d->nr_ckpts++;
+	}
+
+	if (!d->valid || !before(end_seq, d->next_seq)) {
+		d->next_seq = end_seq;
+		d->mode = end_mode;
+		d->valid = 1;
+	}
+	spin_unlock_bh(&flow->lock);
+}
+
+/* Remember what uwu_classify() made of this direction of ct */
+static inline void uwu_flow_set_class(const struct uwu_flow_table *t,
+		const struct nf_conn *ct, u32 ct_id,
+		enum ip_conntrack_dir dir, int class)
+{
+	struct uwu_flow *flow = uwu_flow_slot(t, ct_id);
+
+	spin_lock_bh(&flow->lock);
+	uwu_flow_claim(flow, ct, ct_id);
+	flow->dir[dir].class = class;
+	spin_unlock_bh(&flow->lock);
+}
+
+#endif /* _XT_UWU_FLOW_H */
@@ -0,0 +1,201 @@
+#!/bin/bash
+#
+# End to end cost of the UWU and XOR targets: TCP and UDP over a veth pair
+# between two netns, with the target in the sender's mangle OUTPUT or
+# POSTROUTING chain, for several payload sizes and 1..N parallel flows,
+# each flow pinned to its own core. Every combination is also run without
+# a rule as the baseline.
+#
+# The output is JSON Lines, one object per run, so results from different
+# kernels or commits can be appended to one file and compared:
+#
+#   {"time":..., "kernel":..., "commit":..., "target":"uwu",
+#    "chain":"OUTPUT", "proto":"udp", "size":1400, "flows":2,
+#    "seconds":5, "pps":..., "gbps":..., "softirq_ms":[cpu0, cpu1, ...]}
+#
+# pps is what the receiving veth counted, gbps what iperf3 got through and
+# softirq_ms the softirq time each CPU spent during the run. The sender's
+# veth gets one queue per CPU with XPS mapping queue i to CPU i, and RPS
+# spreads the receive side over every CPU.
+#
+# The rule only matches iperf3's data streams, which get client ports of
+# their own, so the control connection and its JSON go through untouched.
+# iperf3 sends random bytes, so skip_binary is turned off for the run
+# (and restored at the end), otherwise UWU would only classify and skip.
+#
+# Runs offline. Needs root, iperf3, jq, iptables and xt_UWU/xt_XOR loaded.
+# Settings come from the environment:
+#
+#   TARGETS   "none uwu xor"          CHAINS  "OUTPUT"   (or POSTROUTING)
+#   PROTOS    "udp tcp"               SIZES   "64 512 1400 8192"
+#   FLOWS     "1 2 4 .. nproc"        SECONDS_PER_RUN 5
+#   OUT       file to append to, stdout by default
+#
+# UDP sizes above what fits the MTU are skipped: the targets drop
+# fragments.
+
+TARGETS=${TARGETS:-none uwu xor}
+CHAINS=${CHAINS:-OUTPUT}
+PROTOS=${PROTOS:-udp tcp}
+SIZES=${SIZES:-64 512 1400 8192}
+NCPU=$(nproc)
+if [ -z "$FLOWS" ]; then
+	FLOWS=1
+	for ((n = 2; n <= NCPU; n *= 2)); do
+		FLOWS="$FLOWS $n"
+	done
+fi
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-5}
+IPTABLES=${IPTABLES:-iptables}
+OUT=${OUT:-/dev/stdout}
+
+TX=uwu-e2e-tx
+RX=uwu-e2e-rx
+SRC=10.13.152.1
+DST=10.13.152.2
+MTU=1500
+PORT0=5201
+# client ports of the data streams, a new range every run so none of them
+# is still in TIME_WAIT from the last one
+CPORT0=6201
+CPORT_RUNS=100
+SKIP_BINARY=/sys/module/xt_UWU/parameters/skip_binary
+
+for tool in iperf3 jq $IPTABLES; do
+	command -v $tool > /dev/null || { echo "$tool not found" >&2; exit 1; }
+done
+
+KERNEL=$(uname -r)
+COMMIT=$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null)
+
+if [ $NCPU -gt 256 ]; then
+	echo "more than 256 flows don't fit a run's client ports" >&2
+	exit 1
+fi
+
+skip_binary=
+if [[ " $TARGETS " = *" uwu "* ]] && [ -w $SKIP_BINARY ]; then
+	skip_binary=$(cat $SKIP_BINARY)
+	echo 0 > $SKIP_BINARY
+fi
+
+cleanup() {
+	ip netns pids $RX 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns del $TX 2>/dev/null
+	ip netns del $RX 2>/dev/null
+	[ -n "$skip_binary" ] && echo $skip_binary > $SKIP_BINARY
+}
+trap cleanup EXIT
+
+setup() {
+	local q mask
+
+	ip netns add $TX || exit 1
+	ip netns add $RX || exit 1
+	ip -n $TX link add veth0 numtxqueues $NCPU numrxqueues $NCPU \
+		type veth peer name veth1 numtxqueues $NCPU \
+		numrxqueues $NCPU netns $RX || exit 1
+	ip -n $TX addr add $SRC/24 dev veth0
+	ip -n $RX addr add $DST/24 dev veth1
+	ip -n $TX link set veth0 mtu $MTU up
+	ip -n $RX link set veth1 mtu $MTU up
+
+	mask=$(printf "%x" $(((1 << NCPU) - 1)))
+	for ((q = 0; q < NCPU; q++)); do
+		ip netns exec $TX sh -c "echo $(printf "%x" $((1 << q))) > \
+			/sys/class/net/veth0/queues/tx-$q/xps_cpus"
+		ip netns exec $RX sh -c "echo $mask > \
+			/sys/class/net/veth1/queues/rx-$q/rps_cpus"
+	done
+}
+
+rx_packets() {
+	ip netns exec $RX cat /sys/class/net/veth1/statistics/rx_packets
+}
+
+# softirq ticks of each CPU, space separated
+softirq_ticks() {
+	awk '/^cpu[0-9]/ { printf "%s ", $8 }' /proc/stat
+}
+
+install_rule() {
+	local target=$1 chain=$2 proto=$3 cport=$4 flows=$5
+
+	case $target in
+	none)	return 0 ;;
+	uwu)	set -- -j UWU ;;
+	xor)	set -- -j XOR --xor-key uwu ;;
+	esac
+	ip netns exec $TX $IPTABLES -t mangle -A $chain -o veth0 -p $proto \
+		--sport $cport:$((cport + flows - 1)) "$@"
+}
+
+runs=0
+
+run() {
+	local target=$1 chain=$2 proto=$3 size=$4 flows=$5
+	local i rx0 rx1 sirq0 sirq1 bps=0 opts dir pids=() cport
+
+	dir=$(mktemp -d)
+	cport=$((CPORT0 + runs++ % CPORT_RUNS * 256))
+	opts="-t $SECONDS_PER_RUN -l $size --json"
+	[ $proto = udp ] && opts="$opts -u -b 0"
+
+	for ((i = 0; i < flows; i++)); do
+		ip netns exec $RX iperf3 -s -1 -p $((PORT0 + i)) \
+			-A $((i % NCPU)) > /dev/null 2>&1 &
+	done
+	sleep 0.5
+
+	install_rule $target $chain $proto $cport $flows || exit 1
+	rx0=$(rx_packets)
+	sirq0=($(softirq_ticks))
+	for ((i = 0; i < flows; i++)); do
+		ip netns exec $TX iperf3 -c $DST -p $((PORT0 + i)) \
+			--cport $((cport + i)) -A $((i % NCPU)) $opts \
+			> $dir/$i.json &
+		pids+=($!)
+	done
+	wait "${pids[@]}"
+	sirq1=($(softirq_ticks))
+	rx1=$(rx_packets)
+	ip netns exec $TX $IPTABLES -t mangle -F $chain
+	wait
+
+	for ((i = 0; i < flows; i++)); do
+		bps=$(jq -r --argjson acc $bps '$acc +
+			(.end.sum_received.bits_per_second //
+			 .end.sum.bits_per_second // 0)' $dir/$i.json)
+	done
+	rm -rf $dir
+
+	printf '{"time":%d,"kernel":"%s","commit":"%s","target":"%s",' \
+		$(date +%s) "$KERNEL" "$COMMIT" $target
+	printf '"chain":"%s","proto":"%s","size":%d,"flows":%d,' \
+		$chain $proto $size $flows
+	printf '"seconds":%d,"pps":%.0f,"gbps":%.3f,"softirq_ms":[' \
+		$SECONDS_PER_RUN $(((rx1 - rx0) / SECONDS_PER_RUN)) \
+		$(echo "$bps" | awk '{ print $1 / 1e9 }')
+	for ((i = 0; i < NCPU; i++)); do
+		[ $i -gt 0 ] && printf ','
+		printf '%d' $(((sirq1[i] - sirq0[i]) * 1000 / $(getconf CLK_TCK)))
+	done
+	printf ']}\n'
+}
+
+setup
+for proto in $PROTOS; do
+	for size in $SIZES; do
+		if [ $proto = udp ] && [ $size -gt $((MTU - 28)) ]; then
+			continue
+		fi
+		for flows in $FLOWS; do
+			for chain in $CHAINS; do
+				for target in $TARGETS; do
+					run $target $chain $proto $size \
+						$flows >> $OUT
+				done
+			done
+		done
+	done
+done
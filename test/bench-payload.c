@@ -0,0 +1,179 @@
+/**
+ * bench-payload - time the transform variants outside the kernel.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * Every uwu variant, the table one --uwu-map rules use, and XOR, over payloads of a few sizes and of three
+ * kinds: IRC text, random bytes, and the two alternating in 512 byte
+ * blocks. Each packet is copied in from a pristine buffer before it is
+ * transformed, as a transform would otherwise leave nothing to do for
+ * the next round; the "copy" line is that alone.
+ */
+
+#include "payload_lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define die(fmt, args...) \
+do { \
+	fprintf(stderr, fmt "\n", ##args); \
+	exit(EXIT_FAILURE); \
+} while (0)
+
+#define BENCH_MAX_SIZE	65536
+
+enum { MIX_TEXT, MIX_BINARY, MIX_MIXED, __MIX_MAX };
+
+static const char * const mix_names[__MIX_MAX] = {
+	[MIX_TEXT]	= "text",
+	[MIX_BINARY]	= "binary",
+	[MIX_MIXED]	= "mixed",
+};
+
+static const unsigned int sizes[] = { 64, 256, 1460, 9000, 65536 };
+
+static u8 src[__MIX_MAX][BENCH_MAX_SIZE];
+static u8 buf[BENCH_MAX_SIZE];
+
+static const u8 xor_key[] = "0123456789abcdef";
+static struct xor_keystream xor_ks;
+
+static void fill(void)
+{
+	static const char text[] =
+		"PRIVMSG #lobby :hello world, are rollers rare?\r\n";
+	unsigned int i;
+
+	for (i = 0; i < BENCH_MAX_SIZE; i++) {
+		src[MIX_TEXT][i] = text[i % (sizeof(text) - 1)];
+		src[MIX_BINARY][i] = rand();
+		src[MIX_MIXED][i] = (i / 512) & 1 ? src[MIX_BINARY][i] :
+						    src[MIX_TEXT][i];
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* impl NULL is the copy alone, xor true is XOR */
+static void run(const char *name, const struct uwu_impl *impl, bool xor,
+		int mix, unsigned int size, double budget)
+{
+	unsigned long n = 0, i, batch = 1 + (1 << 20) / size;
+	double t0 = now(), t;
+
+	do {
+		for (i = 0; i < batch; i++) {
+			memcpy(buf, src[mix], size);
+			if (impl) {
+				struct uwu_state st = { .uwu_mode = 0 };
+
+				impl->transform(&st, buf, size);
+			} else if (xor) {
+				struct xor_walk w = { .ks = &xor_ks };
+
+				payload_xor(&w, buf, size, 0);
+			}
+		}
+		n += batch;
+		t = now() - t0;
+	} while (t < budget);
+
+	printf("%-8s %-7s %6u %10.1f %8.2f\n", name, mix_names[mix], size,
+	       t * 1e9 / n, (double)n * size / t / 1e9);
+}
+
+static void usage(const char *argv0, int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+"Usage: %s [OPTIONS]\n"
+"\n"
+"Options:\n"
+"  -h  show this message\n"
+"  -t  seconds per measurement, 0.2 by default\n"
+"  -v  only this uwu variant (or copy, table, or xor)\n",
+		argv0);
+	exit(error_code);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only = NULL;
+	double budget = 0.2;
+	unsigned int i, s;
+	int opt, mix;
+
+	while ((opt = getopt(argc, argv, "ht:v:")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		case 't':
+			budget = atof(optarg);
+			if (budget <= 0)
+				die("Invalid time: %s", optarg);
+			break;
+		case 'v':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	payload_init();
+	fill();
+	xor_keystream_init(&xor_ks, xor_key, sizeof(xor_key) - 1);
+
+	printf("%-8s %-7s %6s %10s %8s\n", "variant", "mix", "size",
+	       "ns/pkt", "GB/s");
+	for (mix = 0; mix < __MIX_MAX; mix++) {
+		for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+			if (!only || !strcmp(only, "copy"))
+				run("copy", NULL, false, mix, sizes[s], budget);
+			for (i = 0; i < payload_uwu_nr_impls; i++) {
+				const struct uwu_impl *impl;
+
+				impl = &payload_uwu_impls[i];
+				if (!payload_uwu_valid(impl) ||
+				    (only && strcmp(only, impl->name)))
+					continue;
+				run(impl->name, impl, false, mix, sizes[s],
+				    budget);
+			}
+			if (!only || !strcmp(only, "table"))
+				run("table", payload_uwu_table, false, mix,
+				    sizes[s], budget);
+			if (!only || !strcmp(only, "xor"))
+				run("xor", NULL, true, mix, sizes[s], budget);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
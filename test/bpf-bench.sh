@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# pps and CPU per payload byte of uwu'ing UDP over a veth pair, for
+#
+#   none  nothing, the baseline
+#   xt    the UWU target in the sender's mangle OUTPUT
+#   tc    uwu_bpf.o at clsact egress of the sender's veth
+#   xdp   uwu_bpf.o on XDP of the receiver's veth
+#
+# The sender sits in one netns and the receiver, which drops everything in
+# raw PREROUTING, in another. CPU time is all of /proc/stat's non-idle time
+# while the send runs, so keep the box otherwise quiet. Needs root,
+# xt_UWU loaded, iptables, nft, tc and bpf/uwu_bpf.o built.
+
+COUNT=${COUNT:-500000}
+SIZE=${SIZE:-1400}
+IPTABLES=${IPTABLES:-iptables}
+TX=uwu-tx
+RX=uwu-rx
+SRC=10.13.151.1
+DST=10.13.151.2
+PORT=6667
+
+cd "$(dirname "$0")"
+make -s udp-send || exit 1
+LOADER=../bpf/uwu-bpf.sh
+[ -f ../bpf/uwu_bpf.o ] || { echo "run make -C bpf first" >&2; exit 1; }
+
+cleanup() {
+	ip netns del $TX 2>/dev/null
+	ip netns del $RX 2>/dev/null
+	rm -f payload
+}
+trap cleanup EXIT
+
+cpu_busy() {
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 }' /proc/stat
+}
+
+rx_packets() {
+	ip netns exec $RX cat /sys/class/net/veth1/statistics/rx_packets
+}
+
+run() {
+	local busy0 busy1 rx0 rx1 out
+
+	rx0=$(rx_packets)
+	busy0=$(cpu_busy)
+	out=$(ip netns exec $TX ./udp-send -c $COUNT $DST $PORT < payload)
+	busy1=$(cpu_busy)
+	rx1=$(rx_packets)
+	echo "$out" | awk -v mode=$1 -v hz=$(getconf CLK_TCK) \
+		-v busy=$((busy1 - busy0)) -v rx=$((rx1 - rx0)) \
+		-v count=$COUNT -v size=$SIZE '{
+		ns = $6 + 0
+		printf "%-4s %10.0f pps %8.3f ns cpu/byte %d/%d received\n",
+			mode, 1e9 / ns, busy * 1e9 / hz / (count * size),
+			rx, count
+	}'
+}
+
+# IRC-ish lines, so the command word rule gets exercised too
+yes "PRIVMSG #uwu :hello world, really really lovely weather" |
+	head -c $SIZE > payload
+
+ip netns add $TX || exit 1
+ip netns add $RX || exit 1
+ip -n $TX link add veth0 type veth peer name veth1 netns $RX
+ip -n $TX addr add $SRC/24 dev veth0
+ip -n $RX addr add $DST/24 dev veth1
+ip -n $TX link set veth0 up
+ip -n $RX link set veth1 up
+ip netns exec $RX nft -f - <<EOF || exit 1
+table ip sink {
+	chain pre {
+		type filter hook prerouting priority raw;
+		udp dport $PORT drop
+	}
+}
+EOF
+# resolve the neighbour before timing anything
+ip netns exec $TX ./udp-send $DST $PORT warmup > /dev/null
+
+run none
+
+ip netns exec $TX $IPTABLES -t mangle -A OUTPUT -p udp --dport $PORT \
+	-j UWU || exit 1
+run xt
+ip netns exec $TX $IPTABLES -t mangle -F OUTPUT
+
+ip netns exec $TX $LOADER attach tc veth0 || exit 1
+run tc
+ip netns exec $TX $LOADER detach tc veth0
+
+ip netns exec $RX $LOADER attach xdp veth1 || exit 1
+run xdp
+ip netns exec $RX $LOADER detach xdp veth1
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Checks that binary traffic doesn't use up a rule's --uwu-budget: UDP
+# datagrams of random bytes, well past the budget, are sent over a veth
+# pair through an UWU rule, and the rule's budget_hits in
+# /proc/net/xt_uwu_rules has to stay at 0 while skip_binary counts them.
+# The same amount of text afterwards has to run the budget out, so a
+# budget that never applied doesn't pass either.
+#
+# Runs offline. Needs root, iptables and xt_UWU loaded with skip_binary
+# on (the default).
+
+IPTABLES=${IPTABLES:-iptables}
+COUNT=${COUNT:-200}
+SIZE=1000
+# per CPU, a tenth of what is sent, cut so the burst can be this small
+BUDGET=$((COUNT * SIZE / 10))
+
+TX=uwu-budget-tx
+RX=uwu-budget-rx
+SRC=10.13.153.1
+DST=10.13.153.2
+PORT=7000
+
+command -v $IPTABLES > /dev/null || { echo "$IPTABLES not found" >&2; exit 1; }
+
+dir=$(mktemp -d)
+cleanup() {
+	ip netns del $TX 2>/dev/null
+	ip netns del $RX 2>/dev/null
+	rm -rf $dir
+}
+trap cleanup EXIT
+
+ip netns add $TX || exit 1
+ip netns add $RX || exit 1
+ip -n $TX link add veth0 type veth peer name veth1 netns $RX || exit 1
+ip -n $TX addr add $SRC/24 dev veth0
+ip -n $RX addr add $DST/24 dev veth1
+ip -n $TX link set veth0 up
+ip -n $RX link set veth1 up
+
+ip netns exec $TX $IPTABLES -t mangle -A OUTPUT -o veth0 -p udp \
+	--dport $PORT -j UWU --uwu-budget $BUDGET --uwu-budget-cut || exit 1
+
+head -c $SIZE /dev/urandom > $dir/binary
+yes "hello there, how are you doing today?" | head -c $SIZE > $dir/text
+
+# COUNT datagrams of file, all from CPU 0 so they share one bucket
+send() {
+	ip netns exec $TX taskset -c 0 bash -c "
+		for ((i = 0; i < $COUNT; i++)); do
+			cat $1 > /dev/udp/$DST/$PORT
+		done" 2>/dev/null
+}
+
+budget_hits() {
+	ip netns exec $TX awk 'NR > 1 { print $4; exit }' \
+		/proc/net/xt_uwu_rules
+}
+
+skip_binary() {
+	ip netns exec $TX awk '
+		NR == 1 { for (i = 1; i <= NF; i++) if ($i == "skip_binary") c = i }
+		$1 == "total" { print $c }' /proc/net/xt_uwu_stat
+}
+
+fail=0
+skipped=$(skip_binary)
+send $dir/binary
+hits=$(budget_hits)
+skipped=$(($(skip_binary) - skipped))
+echo "binary: $skipped skipped as binary, $hits budget hits"
+[ "$hits" = 0 ] || fail=1
+[ $skipped -ge $COUNT ] || fail=1
+
+send $dir/text
+hits=$(budget_hits)
+echo "text: $hits budget hits"
+[ "${hits:-0}" -gt 0 ] || fail=1
+
+if [ $fail = 0 ]; then
+	echo ok
+else
+	echo FAIL
+fi
+exit $fail
@@ -0,0 +1,618 @@
+/**
+ * fuzz-payload - check every transform variant against the reference loop.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * Built with -DFUZZ_LIBFUZZER this is a libFuzzer target. Otherwise it has
+ * its own main(): with file arguments it runs each file once ("-" is stdin,
+ * which is what afl-fuzz wants), with none it runs -n random inputs.
+ *
+ * An input is a control byte, a seed for how the payload gets cut into
+ * chunks (the way frags and frag_list members cut it in the kernel), a XOR
+ * key length and then the payload, whose first bytes double as the key.
+ * Every variant of uwu_core.h, transform and scan, has to agree with the
+ * reference loop on the bytes, the state left behind, the count of bytes
+ * rewritten and the checksum delta, and transform mustn't write to the
+ * chunks scan passed over. The table variant is checked the same
+ * way with a map made up from the seed as well, the way --uwu-map would,
+ * and the --uwu-phrase matcher against a brute force search for phrases
+ * made up from the seed.
+ */
+
+#include "payload_lib.h"
+#include "payload_ref.h"
+#include "uwu_phrase.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define die(fmt, args...) \
+do { \
+	fprintf(stderr, fmt "\n", ##args); \
+	abort(); \
+} while (0)
+
+#define FUZZ_MAX_LEN	(1 << 17)
+
+/**
+ * The csum deltas only have to agree once folded: the reference skips the
+ * bytes that didn't change and the kernels needn't.
+ */
+static u16 fold(u64 sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static void check_csum(const char *what, const struct xt_payload_csum *a,
+		const struct xt_payload_csum *b)
+{
+	u32 da = fold(a->to) + (u16)~fold(a->from);
+	u32 db = fold(b->to) + (u16)~fold(b->from);
+
+	if (fold(da) % 0xffff != fold(db) % 0xffff)
+		die("%s: checksum delta %04x, want %04x", what, fold(da),
+		    fold(db));
+}
+
+static unsigned int next_rand(u32 *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return *seed >> 16;
+}
+
+/* chunk lengths around the SWAR word and the SIMD thresholds */
+static unsigned int next_chunk(u32 *seed, unsigned int left)
+{
+	static const unsigned int sizes[] = {
+		1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64,
+		255, 256, 257, 1000, 1500, 4096,
+	};
+	unsigned int n;
+
+	n = sizes[next_rand(seed) % ARRAY_SIZE(sizes)];
+
+	return n < left ? n : left;
+}
+
+static void check_uwu(const struct uwu_impl *impl, const u8 *map,
+		const u8 *data, unsigned int len, int start_mode,
+		unsigned int base, u32 seed, const u8 *want,
+		const struct ref_result *ref)
+{
+	struct uwu_state st = { .uwu_mode = start_mode, .map = map };
+	struct uwu_state sc = { .uwu_mode = start_mode, .map = map };
+	size_t ro_size = len + getpagesize();
+	unsigned int off, n;
+	bool hit = false;
+	u8 *buf, *ro;
+
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		die("OOM");
+	memcpy(buf, data, len);
+	/**
+	 * A read-only copy, which the chunks scan passed over get transformed
+	 * in, so that a store to one faults like it would corrupt a shared
+	 * page in the kernel.
+	 */
+	ro = mmap(NULL, ro_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ro == MAP_FAILED)
+		die("OOM");
+	memcpy(ro, data, len);
+	if (mprotect(ro, ro_size, PROT_READ))
+		die("Failed to mprotect");
+	for (off = 0; off < len; off += n) {
+		n = next_chunk(&seed, len - off);
+		sc.hit = false;
+		sc.off = base + off;
+		impl->scan(&sc, data + off, n);
+		hit |= sc.hit;
+		st.off = base + off;
+		impl->transform(&st, (sc.hit ? buf : ro) + off, n);
+	}
+	munmap(ro, ro_size);
+
+	if (memcmp(buf, want, len)) {
+		for (off = 0; buf[off] == want[off]; off++)
+			;
+		die("%s: byte %u is %02x, want %02x", impl->name, off,
+		    buf[off], want[off]);
+	}
+	if (st.uwu_mode != ref->mode || sc.uwu_mode != ref->mode)
+		die("%s: mode %d/%d after the payload, want %d", impl->name,
+		    st.uwu_mode, sc.uwu_mode, ref->mode);
+	if (st.rewritten != ref->rewritten)
+		die("%s: rewrote %u bytes, want %u", impl->name, st.rewritten,
+		    ref->rewritten);
+	if (hit != !!ref->rewritten)
+		die("%s: scan says %d, want %d", impl->name, hit,
+		    !!ref->rewritten);
+	check_csum(impl->name, &st.csum, &ref->csum);
+	free(buf);
+}
+
+static void check_xor(const u8 *data, unsigned int len, unsigned int base,
+		u32 seed, const u8 *key, unsigned int key_len)
+{
+	static struct xor_keystream ks;
+	struct xor_walk w = { .ks = &ks };
+	struct ref_result ref = { 0 };
+	unsigned int off, n;
+	u8 *buf, *want;
+
+	buf = malloc(len ? len * 2 : 1);
+	if (!buf)
+		die("OOM");
+	want = buf + len;
+	xor_keystream_init(&ks, key, key_len);
+	memcpy(buf, data, len);
+	memcpy(want, data, len);
+	ref_xor(want, len, key, key_len);
+	for (off = 0; off < len; off++)
+		xt_payload_csum_add(&ref.csum, base + off, data[off],
+				    want[off]);
+
+	for (off = 0; off < len; off += n) {
+		n = next_chunk(&seed, len - off);
+		payload_xor(&w, buf + off, n, base + off);
+	}
+	if (memcmp(buf, want, len))
+		die("xor: output differs");
+	check_csum("xor", &w.csum, &ref.csum);
+	/* .sums_all: the core takes csum.to as the sum of the new payload */
+	if (fold(w.csum.to) % 0xffff != fold(ref.csum.to) % 0xffff)
+		die("xor: payload sum %04x, want %04x", fold(w.csum.to),
+		    fold(ref.csum.to));
+	free(buf);
+}
+
+/**
+ * UWU --then-xor: both stages chunk by chunk, with the checksum of the
+ * pair put together the way the target does.
+ */
+static void check_pipeline(const u8 *data, unsigned int len, int start_mode,
+		unsigned int base, u32 seed, const u8 *uwu_want,
+		const u8 *key, unsigned int key_len)
+{
+	const struct uwu_impl *impl = &payload_uwu_impls[0];
+	struct uwu_state st = { .uwu_mode = start_mode };
+	static struct xor_keystream ks;
+	struct xor_walk w = { .ks = &ks };
+	struct ref_result ref = { 0 };
+	struct xt_payload_csum csum;
+	unsigned int off, n;
+	u8 *buf, *want;
+
+	buf = malloc(len ? len * 2 : 1);
+	if (!buf)
+		die("OOM");
+	want = buf + len;
+	xor_keystream_init(&ks, key, key_len);
+	memcpy(buf, data, len);
+	memcpy(want, uwu_want, len);
+	ref_xor(want, len, key, key_len);
+	for (off = 0; off < len; off++)
+		xt_payload_csum_add(&ref.csum, base + off, data[off],
+				    want[off]);
+
+	for (off = 0; off < len; off += n) {
+		n = next_chunk(&seed, len - off);
+		st.off = base + off;
+		impl->transform(&st, buf + off, n);
+		payload_xor(&w, buf + off, n, base + off);
+	}
+	if (memcmp(buf, want, len))
+		die("pipeline: output differs");
+	xt_payload_csum_chain(&csum, &st.csum, &w.csum);
+	check_csum("pipeline", &csum, &ref.csum);
+	if (fold(csum.to) % 0xffff != fold(ref.csum.to) % 0xffff)
+		die("pipeline: payload sum %04x, want %04x", fold(csum.to),
+		    fold(ref.csum.to));
+	free(buf);
+}
+
+/**
+ * The payload cut into the segments of a frag_list GSO skb, each of which
+ * gets its checksum from what the accumulator gained over it, see
+ * xt_payload_segs: for the uwu stage on its own, and with key_len for the
+ * pipeline whose csum is chained after every chunk.
+ */
+static void check_segments(const u8 *data, unsigned int len, int start_mode,
+		unsigned int base, u32 seed, const u8 *key,
+		unsigned int key_len)
+{
+	const struct uwu_impl *impl = &payload_uwu_impls[0];
+	struct uwu_state st = { .uwu_mode = start_mode };
+	struct xt_payload_csum csum = { 0 }, last = { 0 }, seg, ref;
+	static struct xor_keystream ks;
+	struct xor_walk w = { .ks = &ks };
+	unsigned int start, end, off, n;
+	u8 *buf;
+
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		die("OOM");
+	memcpy(buf, data, len);
+	if (key_len)
+		xor_keystream_init(&ks, key, key_len);
+
+	for (start = 0; start < len; start = end) {
+		seed = seed * 1103515245 + 12345;
+		end = start + 1 + (seed >> 16) % 3000;
+		if (end > len)
+			end = len;
+		/* the walk never hands over a chunk that spans two skbs */
+		for (off = start; off < end; off += n) {
+			n = next_chunk(&seed, end - off);
+			st.off = base + off;
+			impl->transform(&st, buf + off, n);
+			if (!key_len) {
+				csum = st.csum;
+				continue;
+			}
+			payload_xor(&w, buf + off, n, base + off);
+			xt_payload_csum_chain(&csum, &st.csum, &w.csum);
+		}
+		xt_payload_csum_since(&seg, &csum, &last, base + start);
+		last = csum;
+
+		memset(&ref, 0, sizeof(ref));
+		for (off = start; off < end; off++)
+			xt_payload_csum_add(&ref, off - start, data[off],
+					    buf[off]);
+		check_csum(key_len ? "segments+xor" : "segments", &seg, &ref);
+	}
+	free(buf);
+}
+
+/* a few bytes of the identity map changed, '\n' and 'A'-'Z' among them */
+static void make_map(u8 *map, u32 seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++)
+		map[i] = i;
+	for (i = 0; i < 24; i++) {
+		seed = seed * 1103515245 + 12345;
+		map[(seed >> 8) & 0xff] = seed >> 24;
+		map[i % 2 ? '\n' : 'A' + i] = seed >> 16;
+	}
+}
+
+static void check_map(const u8 *data, unsigned int len, int start_mode,
+		unsigned int base, u32 seed)
+{
+	struct ref_result ref = { .mode = start_mode };
+	u8 rule_map[256], map[256], *want;
+
+	want = malloc(len ? len : 1);
+	if (!want)
+		die("OOM");
+	make_map(rule_map, seed);
+	uwu_map_init(map, rule_map);
+	memcpy(want, data, len);
+	ref_uwu_map(want, len, base, rule_map, &ref);
+	check_uwu(payload_uwu_table, map, data, len, start_mode, base, seed,
+		  want, &ref);
+	free(want);
+}
+
+/* what xt_payload_splice() does to the payload */
+static unsigned int splice(const u8 *in, unsigned int len,
+		const struct uwu_phrase_state *ps, u8 *out)
+{
+	unsigned int i, src = 0, o = 0;
+
+	for (i = 0; i < ps->nr_edits; i++) {
+		const struct xt_payload_edit *e = &ps->edits[i];
+
+		if (e->off < src || e->off + e->len > len)
+			die("phrase: edit %u at %u+%u out of order", i, e->off,
+			    e->len);
+		memcpy(out + o, in + src, e->off - src);
+		o += e->off - src;
+		memcpy(out + o, e->data, e->data_len);
+		o += e->data_len;
+		src = e->off + e->len;
+	}
+	memcpy(out + o, in + src, len - src);
+
+	return o + len - src;
+}
+
+/* short phrases over the bytes random_input() favours, so they match */
+static void check_phrases(const u8 *data, unsigned int len, u32 seed)
+{
+	static const char alphabet[] = "lrL PRIV\n:ab";
+	static struct xt_uwu_ac ac;
+	unsigned int i, j, n, want_len, out_len, off;
+	struct uwu_phrase_state ps;
+	u8 *want, *out;
+	int resize;
+
+	memset(&ac, 0, sizeof(ac));
+	seed = seed * 1103515245 + 12345;
+	ac.nr_phrases = 1 + (seed >> 16) % XT_UWU_PHRASES;
+	for (i = 0; i < ac.nr_phrases; i++) {
+		struct xt_uwu_phrase *ph = &ac.phrases[i];
+
+		seed = seed * 1103515245 + 12345;
+		ph->from_len = 1 + (seed >> 12) % 4;
+		ph->to_len = (seed >> 20) % 7;
+		for (j = 0; j < ph->from_len; j++) {
+			seed = seed * 1103515245 + 12345;
+			ph->from[j] = alphabet[(seed >> 16) %
+					       (sizeof(alphabet) - 1)];
+		}
+		for (j = 0; j < ph->to_len; j++) {
+			seed = seed * 1103515245 + 12345;
+			ph->to[j] = seed >> 16;
+		}
+	}
+	/* only ever too many states for 4 byte phrases */
+	if (uwu_phrase_compile(&ac))
+		return;
+	if (!uwu_phrase_valid(&ac))
+		die("phrase: compiled table is not valid");
+
+	n = len + UWU_PHRASE_EDITS * XT_UWU_PHRASE_LEN;
+	want = malloc(n * 2);
+	if (!want)
+		die("OOM");
+	out = want + n;
+	for (resize = 0; resize < 2; resize++) {
+		memset(&ps, 0, sizeof(ps));
+		ps.ac = &ac;
+		ps.resize = resize;
+		for (off = 0; off < len; off += n) {
+			n = next_chunk(&seed, len - off);
+			if (uwu_phrase_match(&ps, data + off, n, off))
+				break;
+		}
+		want_len = ref_phrases(data, len, ac.phrases, ac.nr_phrases,
+				       resize, UWU_PHRASE_EDITS, want);
+		out_len = splice(data, len, &ps, out);
+		if (out_len != want_len || memcmp(out, want, out_len))
+			die("phrase: %u bytes out of %u, want %u (resize %d)",
+			    out_len, len, want_len, resize);
+		if ((int)len + ps.delta != out_len)
+			die("phrase: delta %d, length went from %u to %u",
+			    ps.delta, len, out_len);
+	}
+	free(want);
+}
+
+/* printable ASCII and whitespace must never be taken for binary */
+static void check_classify(const u8 *data, unsigned int len)
+{
+	int class = uwu_classify(data, len);
+	unsigned int i;
+
+	for (i = 0; i < len && i < UWU_CLASSIFY_LEN; i++) {
+		if ((data[i] < 0x20 && (!data[i] || !strchr("\t\n\r", data[i]))) ||
+		    data[i] >= 0x7f)
+			return;
+	}
+	if (class == UWU_CLASS_BINARY)
+		die("classify: %u bytes of text taken for binary", len);
+}
+
+/**
+ * Nor must UTF-8 text in any script, made up from the seed out of code
+ * points of every length and cut anywhere, the start included. The ASCII
+ * in it stays off the magic numbers uwu_classify() knows.
+ */
+static void check_classify_utf8(u32 seed)
+{
+	static const char ascii[] = "abcdefghijklmnopqrstuvwxyz0123456789 .,!?\n";
+	u8 buf[UWU_CLASSIFY_LEN + 8];
+	unsigned int len = 0, start, end;
+	u32 cp;
+
+	while (len + 4 <= sizeof(buf)) {
+		switch (next_rand(&seed) % 4) {
+		case 0:
+			buf[len++] = ascii[next_rand(&seed) % (sizeof(ascii) - 1)];
+			break;
+		case 1:
+			cp = 0x80 + next_rand(&seed) % (0x800 - 0x80);
+			buf[len++] = 0xc0 | cp >> 6;
+			buf[len++] = 0x80 | (cp & 0x3f);
+			break;
+		case 2:
+			cp = 0x800 + next_rand(&seed) % (0x10000 - 0x800);
+			if (cp >= 0xd800 && cp <= 0xdfff)
+				cp -= 0x800;
+			buf[len++] = 0xe0 | cp >> 12;
+			buf[len++] = 0x80 | ((cp >> 6) & 0x3f);
+			buf[len++] = 0x80 | (cp & 0x3f);
+			break;
+		case 3:
+			cp = 0x10000 + (next_rand(&seed) << 5 ^ next_rand(&seed)) %
+				       (0x110000 - 0x10000);
+			buf[len++] = 0xf0 | cp >> 18;
+			buf[len++] = 0x80 | ((cp >> 12) & 0x3f);
+			buf[len++] = 0x80 | ((cp >> 6) & 0x3f);
+			buf[len++] = 0x80 | (cp & 0x3f);
+			break;
+		}
+	}
+
+	start = next_rand(&seed) % 4;
+	end = start + next_rand(&seed) % (len - start + 1);
+	if (uwu_classify(buf + start, end - start) == UWU_CLASS_BINARY)
+		die("classify: %u bytes of UTF-8 taken for binary",
+		    end - start);
+}
+
+static void fuzz_one(const u8 *in, size_t size)
+{
+	struct ref_result ref = { 0 };
+	unsigned int len, base, key_len, i;
+	int start_mode;
+	u8 *want;
+	u32 seed;
+
+	if (size < 4 || size - 4 > FUZZ_MAX_LEN)
+		return;
+	start_mode = in[0] & 1;
+	base = (in[0] >> 1) & 1;
+	seed = in[1] | in[2] << 8;
+	key_len = in[3] % 32 + 1;
+	in += 4;
+	len = size - 4;
+
+	want = malloc(len ? len : 1);
+	if (!want)
+		die("OOM");
+	memcpy(want, in, len);
+	ref.mode = start_mode;
+	ref_uwu(want, len, base, &ref);
+
+	for (i = 0; i < payload_uwu_nr_impls; i++) {
+		if (payload_uwu_valid(&payload_uwu_impls[i]))
+			check_uwu(&payload_uwu_impls[i], NULL, in, len,
+				  start_mode, base, seed, want, &ref);
+	}
+	check_uwu(payload_uwu_table, NULL, in, len, start_mode, base, seed,
+		  want, &ref);
+	if (len >= key_len)
+		check_pipeline(in, len, start_mode, base, seed, want, in,
+			       key_len);
+	free(want);
+
+	check_segments(in, len, start_mode, base, seed, NULL, 0);
+	if (len >= key_len)
+		check_segments(in, len, start_mode, base, seed, in, key_len);
+	check_map(in, len, start_mode, base, seed);
+	check_phrases(in, len, seed);
+	if (len >= key_len)
+		check_xor(in, len, base, seed, in, key_len);
+	check_classify(in, len);
+	check_classify_utf8(seed);
+}
+
+#ifdef FUZZ_LIBFUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	payload_init();
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	fuzz_one(data, size);
+
+	return 0;
+}
+#else
+static void usage(const char *argv0, int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+"Usage: %s [OPTIONS] [file...]\n"
+"\n"
+"Runs each file, - for stdin, or random inputs if there are none.\n"
+"\n"
+"Options:\n"
+"  -h  show this message\n"
+"  -n  number of random inputs, 10000 by default\n"
+"  -s  seed for the random inputs\n",
+		argv0);
+	exit(error_code);
+}
+
+/* mostly IRC-ish text, so the state machine gets somewhere */
+static void random_input(u8 *buf, size_t size)
+{
+	static const char alphabet[] = "PRIVMSG lLrR \n:#abcxyz";
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (i < 4 || rand() % 8 == 0)
+			buf[i] = rand();
+		else
+			buf[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+	}
+}
+
+static void run_file(const char *path)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	static u8 buf[FUZZ_MAX_LEN + 4];
+	size_t size;
+
+	if (!f)
+		die("Failed to open %s", path);
+	size = fread(buf, 1, sizeof(buf), f);
+	if (f != stdin)
+		fclose(f);
+	fuzz_one(buf, size);
+}
+
+int main(int argc, char *argv[])
+{
+	static u8 buf[8192];
+	unsigned int seed = time(NULL);
+	int opt, i, n = 10000;
+
+	while ((opt = getopt(argc, argv, "hn:s:")) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	payload_init();
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			run_file(argv[i]);
+		return EXIT_SUCCESS;
+	}
+
+	srand(seed);
+	for (i = 0; i < n; i++) {
+		size_t size = 4 + rand() % (sizeof(buf) - 4);
+
+		random_input(buf, size);
+		fuzz_one(buf, size);
+	}
+	printf("%d random inputs, seed %u: ok\n", n, seed);
+
+	return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,185 @@
+/**
+ * loadgen - the payloads udp-send generates and udp-recv checks.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _LOADGEN_H
+#define _LOADGEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * A generated datagram is a header in lower case hex, then text from the
+ * corpus, then a '\n':
+ *
+ *   seq(16) timestamp(16) corpus offset(8) gso size(4) segment(4) text \n
+ *
+ * uwu leaves hex digits alone and whatever state its state machine is in, a
+ * digit leaves it past the command word, so a UDP GSO buffer the target
+ * transforms as a whole comes out the same as if each datagram had been
+ * done on its own. XOR on the other hand carries its key offset over
+ * from one datagram of a GSO buffer to the next, which is what the gso
+ * size and segment fields are for. The timestamp is CLOCK_MONOTONIC, which
+ * both ends share on one box.
+ */
+#define LG_HDR_LEN	48
+#define LG_MIN_SIZE	(LG_HDR_LEN + 1)
+#define LG_MAX_SIZE	65507
+
+struct lg_hdr {
+	uint64_t	seq;
+	uint64_t	ts_ns;
+	uint32_t	corpus_off;
+	uint16_t	gso_size;
+	uint16_t	seg;
+};
+
+struct lg_corpus {
+	/* len bytes of text followed by a copy of the first LG_MAX_SIZE */
+	uint8_t		*data;
+	size_t		len;
+};
+
+static const char lg_default_text[] =
+	"PRIVMSG #lobby :hello world, are rollers rare around here?\r\n"
+	"NOTICE ben :really lovely weather for a barrel roll\r\n"
+	"PRIVMSG #uwu :the quick brown fox jumps over the lazy dog\r\n";
+
+static inline uint64_t lg_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* NULL for the built in IRC text */
+static inline int lg_corpus_load(struct lg_corpus *c, const char *path)
+{
+	size_t size = 0, len = 0, i;
+	uint8_t *text = NULL;
+
+	if (path) {
+		FILE *f = fopen(path, "rb");
+		size_t n;
+
+		if (!f)
+			return -1;
+		do {
+			if (len == size) {
+				size = size ? size * 2 : 65536;
+				text = realloc(text, size);
+				if (!text) {
+					fclose(f);
+					return -1;
+				}
+			}
+			n = fread(text + len, 1, size - len, f);
+			len += n;
+		} while (n);
+		fclose(f);
+	} else {
+		len = sizeof(lg_default_text) - 1;
+		text = (uint8_t *)strdup(lg_default_text);
+	}
+	if (!text || !len) {
+		free(text);
+		return -1;
+	}
+
+	c->data = malloc(len + LG_MAX_SIZE);
+	if (!c->data) {
+		free(text);
+		return -1;
+	}
+	for (i = 0; i < len + LG_MAX_SIZE; i++)
+		c->data[i] = text[i % len];
+	c->len = len;
+	free(text);
+
+	return 0;
+}
+
+static const char lg_hex[] = "0123456789abcdef";
+
+static inline void lg_put_hex(uint8_t *p, uint64_t v, int digits)
+{
+	while (digits-- > 0) {
+		p[digits] = lg_hex[v & 0xf];
+		v >>= 4;
+	}
+}
+
+static inline int lg_get_hex(const uint8_t *p, int digits, uint64_t *v)
+{
+	int i;
+
+	*v = 0;
+	for (i = 0; i < digits; i++) {
+		*v <<= 4;
+		if (p[i] >= '0' && p[i] <= '9')
+			*v |= p[i] - '0';
+		else if (p[i] >= 'a' && p[i] <= 'f')
+			*v |= p[i] - 'a' + 10;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+/* the original datagram of size bytes for h */
+static inline void lg_fill(uint8_t *p, size_t size, const struct lg_hdr *h,
+		const struct lg_corpus *c)
+{
+	lg_put_hex(p, h->seq, 16);
+	lg_put_hex(p + 16, h->ts_ns, 16);
+	lg_put_hex(p + 32, h->corpus_off, 8);
+	lg_put_hex(p + 40, h->gso_size, 4);
+	lg_put_hex(p + 44, h->seg, 4);
+	memcpy(p + LG_HDR_LEN, c->data + h->corpus_off, size - LG_HDR_LEN - 1);
+	p[size - 1] = '\n';
+}
+
+static inline int lg_parse(const uint8_t *p, size_t size,
+		const struct lg_corpus *c, struct lg_hdr *h)
+{
+	uint64_t v;
+
+	if (size < LG_MIN_SIZE)
+		return -1;
+	if (lg_get_hex(p, 16, &h->seq) || lg_get_hex(p + 16, 16, &h->ts_ns))
+		return -1;
+	if (lg_get_hex(p + 32, 8, &v) || v >= c->len)
+		return -1;
+	h->corpus_off = v;
+	if (lg_get_hex(p + 40, 4, &v))
+		return -1;
+	h->gso_size = v;
+	if (lg_get_hex(p + 44, 4, &v))
+		return -1;
+	h->seg = v;
+
+	return 0;
+}
+
+#endif /* _LOADGEN_H */
@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Per-packet OUTPUT cost of the xtables targets against the native nft
+# expressions, for a rule set that picks RULES destination ports:
+#
+#   none  no rules, the baseline
+#   xt    one "-p udp --dport N -j UWU" rule per port, the packets hitting
+#         the last one
+#   nft   "udp dport @ports jump payload", with the uwu expression alone
+#         in the payload chain
+#
+# Runs in a throwaway netns, sending to an address on a dummy device so
+# nothing is received. Needs root, xt_UWU/xt_XOR and nft_uwu/nft_xor
+# loaded, iptables and nft. EXPR=xor benchmarks XOR instead of UWU, and
+# IPTABLES=iptables-legacy keeps the xt run off nft_compat.
+
+RULES=${RULES:-64}
+COUNT=${COUNT:-200000}
+EXPR=${EXPR:-uwu}
+IPTABLES=${IPTABLES:-iptables}
+NS=uwu-bench
+DST=10.13.150.2
+PORT0=10000
+PAYLOAD="PRIVMSG #uwu :hello world, really really lovely weather"
+
+cd "$(dirname "$0")"
+make -s udp-send || exit 1
+NFT_PAYLOAD=../src/nft-payload
+[ -x $NFT_PAYLOAD ] || { echo "build $NFT_PAYLOAD first" >&2; exit 1; }
+
+case $EXPR in
+uwu)	XT_TARGET="UWU"; NFT_ARGS="uwu" ;;
+xor)	XT_TARGET="XOR --xor-key uwu"; NFT_ARGS="xor uwu" ;;
+*)	echo "EXPR must be uwu or xor" >&2; exit 1 ;;
+esac
+
+nsexec() {
+	ip netns exec $NS "$@"
+}
+
+cleanup() {
+	ip netns del $NS 2>/dev/null
+}
+trap cleanup EXIT
+
+run() {
+	echo -n "$1: "
+	nsexec ./udp-send -c $COUNT $DST $((PORT0 + RULES - 1)) "$PAYLOAD"
+}
+
+ip netns add $NS || exit 1
+nsexec ip link set lo up
+nsexec ip link add d0 type dummy
+nsexec ip addr add 10.13.150.1/24 dev d0
+nsexec ip link set d0 up
+
+run none
+
+for ((i = 0; i < RULES; i++)); do
+	nsexec $IPTABLES -t mangle -A OUTPUT -p udp --dport $((PORT0 + i)) \
+		-j $XT_TARGET || exit 1
+done
+run xt
+nsexec $IPTABLES -t mangle -F OUTPUT
+
+ports=$(seq -s , $PORT0 $((PORT0 + RULES - 1)))
+nsexec nft -f - <<EOF || exit 1
+table ip uwu_bench {
+	set ports {
+		type inet_service
+		elements = { $ports }
+	}
+	chain out {
+		type filter hook output priority mangle;
+		udp dport @ports jump payload
+	}
+	chain payload {
+	}
+}
+EOF
+nsexec $NFT_PAYLOAD uwu_bench payload $NFT_ARGS || exit 1
+run nft
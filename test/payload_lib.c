@@ -0,0 +1,40 @@
+/**
+ * payload_lib - the transform kernels built for userspace.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "payload_lib.h"
+
+const struct uwu_impl * const payload_uwu_impls = uwu_impls;
+const unsigned int payload_uwu_nr_impls = ARRAY_SIZE(uwu_impls);
+const struct uwu_impl * const payload_uwu_table = &uwu_table_impl;
+
+void payload_init(void)
+{
+	uwu_tables_init();
+}
+
+bool payload_uwu_valid(const struct uwu_impl *impl)
+{
+	return !impl->valid || impl->valid();
+}
+
+void payload_xor(struct xor_walk *w, u8 *p, unsigned int len,
+		unsigned int off)
+{
+	xor_transform(w, p, len, off);
+}
@@ -0,0 +1,149 @@
+/**
+ * payload_ref - the transforms as plain byte loops, to check against.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _PAYLOAD_REF_H
+#define _PAYLOAD_REF_H
+
+/**
+ * Deliberately nothing from uwu_core.h or xor_core.h, so a bug there can't
+ * cancel itself out: fuzz-payload checks the kernels against these and
+ * udp-recv what came off the wire.
+ */
+#include "xt_payload_core.h"
+#include "xt_UWU.h"
+
+struct ref_result {
+	int			mode;
+	unsigned int		rewritten;
+	struct xt_payload_csum	csum;
+};
+
+/* skb_uwu() as it was before the tables and the vector code */
+static inline void ref_uwu(u8 *p, unsigned int len, unsigned int off,
+		struct ref_result *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		u8 from = p[i];
+
+		if (r->mode) {
+			switch (p[i]) {
+			case 'l':
+				p[i] = 'w';
+				break;
+			case 'r':
+				p[i] = 'w';
+				break;
+			case 'L':
+				p[i] = 'W';
+				break;
+			case 'R':
+				p[i] = 'W';
+				break;
+			case '\n':
+				r->mode = 0;
+				break;
+			default:
+				break;
+			}
+		} else {
+			if (!(p[i] >= 'A' && p[i] <= 'Z'))
+				r->mode = 1;
+		}
+		if (p[i] != from) {
+			r->rewritten++;
+			xt_payload_csum_add(&r->csum, off + i, from, p[i]);
+		}
+	}
+}
+
+/* the same with --uwu-map, which the kernels take as a 256 byte table */
+static inline void ref_uwu_map(u8 *p, unsigned int len, unsigned int off,
+		const u8 *map, struct ref_result *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		u8 from = p[i];
+
+		if (r->mode) {
+			if (p[i] == '\n')
+				r->mode = 0;
+			else
+				p[i] = map[p[i]];
+		} else if (!(p[i] >= 'A' && p[i] <= 'Z')) {
+			r->mode = 1;
+		}
+		if (p[i] != from) {
+			r->rewritten++;
+			xt_payload_csum_add(&r->csum, off + i, from, p[i]);
+		}
+	}
+}
+
+/**
+ * --uwu-phrase by brute force: at every byte the longest phrase that ends
+ * there without reaching back into the last one rewritten, the later of
+ * two that are the same, for at most max_edits phrases. Writes the result
+ * to out and returns its length.
+ */
+static inline unsigned int ref_phrases(const u8 *in, unsigned int len,
+		const struct xt_uwu_phrase *ph, unsigned int nr, bool resize,
+		unsigned int max_edits, u8 *out)
+{
+	unsigned int i, j, from_len, start = 0, o = 0, edits = 0;
+	int best;
+
+	for (i = 0; i < len && edits < max_edits; i++) {
+		best = -1;
+		for (j = 0; j < nr; j++) {
+			from_len = ph[j].from_len;
+			if (from_len > i + 1 - start ||
+			    memcmp(in + i + 1 - from_len, ph[j].from, from_len))
+				continue;
+			if (best < 0 || from_len >= ph[best].from_len)
+				best = j;
+		}
+		if (best < 0 ||
+		    (!resize && ph[best].to_len != ph[best].from_len))
+			continue;
+		from_len = ph[best].from_len;
+		memcpy(out + o, in + start, i + 1 - from_len - start);
+		o += i + 1 - from_len - start;
+		memcpy(out + o, ph[best].to, ph[best].to_len);
+		o += ph[best].to_len;
+		start = i + 1;
+		edits++;
+	}
+	memcpy(out + o, in + start, len - start);
+
+	return o + len - start;
+}
+
+static inline void ref_xor(u8 *p, unsigned int len, const u8 *key,
+		unsigned int key_len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		p[i] ^= key[i % key_len];
+}
+
+#endif /* _PAYLOAD_REF_H */
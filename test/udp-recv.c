@@ -0,0 +1,479 @@
+/**
+ * udp-recv - count, time and check what udp-send generated.
+ * Copyright (C) 2021 Ben Cartwright-Cox <ben@benjojo.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * Every datagram udp-send -f/-s generates says where in the corpus its text
+ * came from, so the receiver can build the original, run it through the
+ * reference loop of the transform the sender's rules apply and compare.
+ * A bad checksum shows up as loss instead: the receiving stack drops it.
+ *
+ * Loss is counted from the sequence numbers, which each sending thread
+ * starts at 0, so start udp-recv first.
+ */
+
+#define _GNU_SOURCE
+
+#include "loadgen.h"
+#include "payload_ref.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define die(fmt, args...) \
+do { \
+	fprintf(stderr, fmt "\n", ##args); \
+	exit(EXIT_FAILURE); \
+} while (0)
+
+#define fail(fmt, args...) die("Failed to " fmt, ##args)
+
+#define MAX_BATCH	1024
+#define MAX_THREADS	256
+#define MAX_SENDERS	256
+#define MAX_KEY_LEN	32
+
+/**
+ * Latency histogram with 8 linear buckets per power of two: values below 8
+ * have a bucket each, above that the bucket is the top 4 bits of the value
+ * and where they are, so it is good to 1/8th.
+ */
+#define HIST_SUB_BITS	3
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+enum { CHECK_COUNT, CHECK_NONE, CHECK_UWU, CHECK_XOR };
+
+static const char * const check_names[] = {
+	[CHECK_COUNT]	= "count",
+	[CHECK_NONE]	= "none",
+	[CHECK_UWU]	= "uwu",
+	[CHECK_XOR]	= "xor",
+};
+
+struct receiver {
+	pthread_t		thread;
+	int			sock;
+	unsigned long long	packets;
+	unsigned long long	bytes;
+	unsigned long long	ok;
+	unsigned long long	bad;
+	unsigned long long	unparsed;
+	/* the highest sequence number seen from each sending thread, + 1 */
+	unsigned long long	next_seq[MAX_SENDERS];
+	unsigned long long	hist[HIST_BUCKETS];
+};
+
+static struct {
+	int			port;
+	int			check;
+	unsigned int		batch;
+	unsigned int		threads;
+	unsigned long long	count;
+	double			seconds;
+	bool			verbose;
+	u8			key[MAX_KEY_LEN];
+	unsigned int		key_len;
+	struct lg_corpus	corpus;
+} conf = {
+	.check		= CHECK_COUNT,
+	.batch		= 64,
+	.threads	= 1,
+};
+
+static volatile sig_atomic_t stop;
+static unsigned long long received;
+static bool dumped;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *argv0, int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+"Usage: %s [OPTIONS] port\n"
+"\n"
+"Receives until -c, -d or ^C, then prints the packet rate, latency, loss\n"
+"and how many payloads came out the way they should. Exits non-zero if\n"
+"any didn't.\n"
+"\n"
+"Options:\n"
+"  -b  datagrams per recvmmsg() call, 64 by default\n"
+"  -c  stop after count datagrams\n"
+"  -d  stop after this many seconds\n"
+"  -f  the text corpus udp-send was given\n"
+"  -h  show this message\n"
+"  -k  XOR key the payloads went through (implies -m xor)\n"
+"  -m  what to check the payloads for: count (only count them), none\n"
+"      (unchanged), uwu or xor\n"
+"  -t  receiving threads, each with its own SO_REUSEPORT socket\n"
+"  -v  print the first bad payload\n",
+		argv0);
+	exit(error_code);
+}
+
+static unsigned int hist_bucket(u64 v)
+{
+	unsigned int e;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+	e = 63 - __builtin_clzll(v);
+
+	return (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS |
+	       ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* the smallest value in bucket b */
+static u64 hist_value(unsigned int b)
+{
+	unsigned int e = b >> HIST_SUB_BITS;
+
+	if (!e)
+		return b;
+
+	return (u64)((1 << HIST_SUB_BITS) | (b & ((1 << HIST_SUB_BITS) - 1)))
+	       << (e - 1);
+}
+
+/**
+ * XOR doesn't reset its key offset between the datagrams of a GSO buffer,
+ * and which datagram of it this was is in the header it garbled, so try
+ * every key offset until the header makes sense and agrees with it.
+ */
+static int unxor(const u8 *p, size_t len, u8 *out, struct lg_hdr *h)
+{
+	unsigned int off, i;
+	u8 hdr[LG_HDR_LEN];
+
+	for (off = 0; off < conf.key_len; off++) {
+		for (i = 0; i < LG_HDR_LEN; i++)
+			hdr[i] = p[i] ^ conf.key[(off + i) % conf.key_len];
+		memcpy(out, hdr, LG_HDR_LEN);
+		if (lg_parse(out, len, &conf.corpus, h) ||
+		    (u64)h->seg * h->gso_size % conf.key_len != off)
+			continue;
+		for (i = 0; i < len; i++)
+			out[i] = p[i] ^ conf.key[(off + i) % conf.key_len];
+		return 0;
+	}
+
+	return -1;
+}
+
+static void dump(const char *what, const u8 *p, size_t len)
+{
+	size_t i;
+
+	fprintf(stderr, "%s:", what);
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "%s%02x", i % 32 ? " " : "\n  ", p[i]);
+	fprintf(stderr, "\n");
+}
+
+static void check(struct receiver *r, const u8 *p, size_t len, u64 now,
+		u8 *got, u8 *want)
+{
+	struct ref_result ref = { 0 };
+	struct lg_hdr h;
+
+	if (conf.check == CHECK_XOR) {
+		if (unxor(p, len, got, &h))
+			goto unparsed;
+	} else {
+		memcpy(got, p, len);
+		if (lg_parse(got, len, &conf.corpus, &h))
+			goto unparsed;
+	}
+
+	if (now > h.ts_ns)
+		r->hist[hist_bucket(now - h.ts_ns)]++;
+	if (h.seq >> 48 < MAX_SENDERS &&
+	    (h.seq & ((1ULL << 48) - 1)) >= r->next_seq[h.seq >> 48])
+		r->next_seq[h.seq >> 48] = (h.seq & ((1ULL << 48) - 1)) + 1;
+
+	/* what the sender sent, and what the rules should have made of it */
+	lg_fill(want, len, &h, &conf.corpus);
+	if (conf.check == CHECK_UWU)
+		ref_uwu(want, len, 0, &ref);
+	if (!memcmp(got, want, len)) {
+		r->ok++;
+		return;
+	}
+
+	r->bad++;
+	if (conf.verbose && !__atomic_exchange_n(&dumped, true,
+						 __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&print_lock);
+		dump("bad payload", p, len);
+		dump("want", conf.check == CHECK_XOR ? got : want, len);
+		pthread_mutex_unlock(&print_lock);
+	}
+	return;
+
+unparsed:
+	r->unparsed++;
+}
+
+static void *recv_loop(void *arg)
+{
+	struct receiver *r = arg;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	u8 *bufs, *got, *want;
+	unsigned int i;
+	int n;
+
+	msgs = calloc(conf.batch, sizeof(*msgs));
+	iov = calloc(conf.batch, sizeof(*iov));
+	bufs = malloc((size_t)conf.batch * LG_MAX_SIZE);
+	got = malloc(LG_MAX_SIZE);
+	want = malloc(LG_MAX_SIZE);
+	if (!msgs || !iov || !bufs || !got || !want)
+		die("OOM");
+	for (i = 0; i < conf.batch; i++) {
+		iov[i].iov_base = bufs + (size_t)i * LG_MAX_SIZE;
+		iov[i].iov_len = LG_MAX_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!stop) {
+		u64 now;
+
+		n = recvmmsg(r->sock, msgs, conf.batch, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			fail("receive: %s", strerror(errno));
+		}
+		now = lg_now_ns();
+		for (i = 0; i < (unsigned int)n; i++) {
+			r->packets++;
+			r->bytes += msgs[i].msg_len;
+			if (conf.check != CHECK_COUNT)
+				check(r, iov[i].iov_base, msgs[i].msg_len,
+				      now, got, want);
+		}
+		if (conf.count &&
+		    __atomic_add_fetch(&received, n, __ATOMIC_RELAXED) >=
+		    conf.count)
+			stop = 1;
+	}
+
+	free(want);
+	free(got);
+	free(bufs);
+	free(iov);
+	free(msgs);
+
+	return NULL;
+}
+
+static int open_socket(void)
+{
+	struct timeval tv = { .tv_usec = 100000 };
+	struct sockaddr_in addr = {
+		.sin_family	= AF_INET,
+		.sin_port	= htons(conf.port),
+	};
+	int sock, one = 1, size = 4 << 20;
+
+	sock = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		fail("create the sock");
+	/* so the threads notice stop */
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+		fail("set up the sock: %s", strerror(errno));
+	/* best effort, capped by net.core.rmem_max */
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		fail("bind port %d: %s", conf.port, strerror(errno));
+
+	return sock;
+}
+
+static void print_latency(const unsigned long long *hist,
+		unsigned long long n)
+{
+	static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long long seen = 0;
+	unsigned int b, p = 0, first = HIST_BUCKETS, last = 0;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		if (first == HIST_BUCKETS)
+			first = b;
+		last = b;
+	}
+	printf("latency us: min %.1f", hist_value(first) / 1e3);
+	for (b = first; b <= last && p < ARRAY_SIZE(pcts); b++) {
+		seen += hist[b];
+		while (p < ARRAY_SIZE(pcts) && seen >= pcts[p] * n) {
+			printf(", p%g %.1f", pcts[p] * 100, hist_value(b) / 1e3);
+			p++;
+		}
+	}
+	printf(", max %.1f\n", hist_value(last) / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long packets = 0, bytes = 0, ok = 0, bad = 0;
+	unsigned long long unparsed = 0, expected = 0, timed = 0;
+	static unsigned long long next_seq[MAX_SENDERS];
+	static unsigned long long hist[HIST_BUCKETS];
+	const char *corpus = NULL;
+	struct receiver *receivers;
+	unsigned int i, j;
+	u64 t0, end = 0;
+	double ns;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:c:d:f:hk:m:t:v")) != -1) {
+		switch (opt) {
+		case 'b':
+			conf.batch = atoi(optarg);
+			if (conf.batch < 1 || conf.batch > MAX_BATCH)
+				die("Invalid batch: %s", optarg);
+			break;
+		case 'c':
+			conf.count = strtoull(optarg, NULL, 0);
+			if (!conf.count)
+				die("Invalid count: %s", optarg);
+			break;
+		case 'd':
+			conf.seconds = atof(optarg);
+			if (conf.seconds <= 0)
+				die("Invalid duration: %s", optarg);
+			break;
+		case 'f':
+			corpus = optarg;
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		case 'k':
+			conf.key_len = strlen(optarg);
+			if (!conf.key_len || conf.key_len > MAX_KEY_LEN)
+				die("Invalid key length: %s", optarg);
+			memcpy(conf.key, optarg, conf.key_len);
+			conf.check = CHECK_XOR;
+			break;
+		case 'm':
+			for (i = 0; i < ARRAY_SIZE(check_names); i++) {
+				if (!strcmp(optarg, check_names[i]))
+					break;
+			}
+			if (i == ARRAY_SIZE(check_names))
+				die("Invalid check: %s", optarg);
+			conf.check = i;
+			break;
+		case 't':
+			conf.threads = atoi(optarg);
+			if (conf.threads < 1 || conf.threads > MAX_THREADS)
+				die("Invalid thread count: %s", optarg);
+			break;
+		case 'v':
+			conf.verbose = true;
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+	if (optind + 1 != argc)
+		usage(argv[0], EXIT_FAILURE);
+	conf.port = atoi(argv[optind]);
+	if (conf.port <= 0 || conf.port > 65535)
+		die("Invalid port: %s", argv[optind]);
+	if (conf.check == CHECK_XOR && !conf.key_len)
+		die("-m xor needs the key, -k");
+	if (lg_corpus_load(&conf.corpus, corpus))
+		fail("load the corpus %s", corpus ? : "");
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	receivers = calloc(conf.threads, sizeof(*receivers));
+	if (!receivers)
+		die("OOM");
+	for (i = 0; i < conf.threads; i++)
+		receivers[i].sock = open_socket();
+	for (i = 0; i < conf.threads; i++) {
+		if (pthread_create(&receivers[i].thread, NULL, recv_loop,
+				   &receivers[i]))
+			fail("start a receiving thread");
+	}
+
+	t0 = lg_now_ns();
+	if (conf.seconds)
+		end = t0 + conf.seconds * 1e9;
+	while (!stop && (!end || lg_now_ns() < end))
+		usleep(10000);
+	stop = 1;
+	ns = lg_now_ns() - t0;
+
+	for (i = 0; i < conf.threads; i++) {
+		struct receiver *r = &receivers[i];
+
+		pthread_join(r->thread, NULL);
+		close(r->sock);
+		packets += r->packets;
+		bytes += r->bytes;
+		ok += r->ok;
+		bad += r->bad;
+		unparsed += r->unparsed;
+		for (j = 0; j < MAX_SENDERS; j++) {
+			if (r->next_seq[j] > next_seq[j])
+				next_seq[j] = r->next_seq[j];
+		}
+		for (j = 0; j < HIST_BUCKETS; j++)
+			hist[j] += r->hist[j];
+	}
+	for (j = 0; j < MAX_SENDERS; j++)
+		expected += next_seq[j];
+	for (j = 0; j < HIST_BUCKETS; j++)
+		timed += hist[j];
+
+	printf("%llu packets, %llu bytes in %.3f s, %.0f pps, %.3f Gbit/s\n",
+	       packets, bytes, ns / 1e9, packets / ns * 1e9, bytes * 8 / ns);
+	if (conf.check != CHECK_COUNT) {
+		printf("%s: %llu ok, %llu bad, %llu unparsed, %lld lost\n",
+		       check_names[conf.check], ok, bad, unparsed,
+		       (long long)(expected - ok - bad));
+		if (timed)
+			print_latency(hist, timed);
+	}
+
+	free(receivers);
+
+	return bad || unparsed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,11 +1,30 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "loadgen.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+
+/* UDP_MAX_SEGMENTS of older kernels */
+#define MAX_GSO_SEGS	64
+#define MAX_BATCH	1024
+#define MAX_THREADS	256
 
 #define die(fmt, args...) \
 do { \
@@ -15,6 +34,50 @@ do { \
 
 #define fail(fmt, args...) die("Failed to " fmt, ##args)
 
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_IMIX };
+
+struct sender {
+	pthread_t		thread;
+	unsigned int		id;
+	int			sock;
+	/* datagrams to send, 0 for until told to stop */
+	unsigned long long	quota;
+	unsigned long long	sent;
+	unsigned long long	bytes;
+	unsigned long long	retries;
+	uint32_t		corpus_off;
+	uint64_t		rand;
+};
+
+static struct {
+	struct sockaddr_in	addr;
+	bool			no_check;
+	unsigned int		batch;
+	unsigned int		gso_segs;
+	unsigned int		threads;
+	unsigned long long	count;
+	double			seconds;
+	double			rate;
+	/* fixed content, or generated from the corpus */
+	const char		*content;
+	size_t			content_len;
+	bool			generate;
+	struct lg_corpus	corpus;
+	int			size_kind;
+	unsigned int		size_min;
+	unsigned int		size_max;
+} conf = {
+	.threads	= 1,
+	.gso_segs	= 1,
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
 static void usage(const char *argv0, int error_code)
 {
 	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
@@ -22,30 +85,316 @@ static void usage(const char *argv0, int error_code)
 	fprintf(out,
 "Usage: %s [OPTIONS] address port [content]\n"
 "\n"
+"Sends content, or stdin, once. With -c or -d it keeps sending and prints\n"
+"the rate it got. With -f or -s the payloads are generated instead, each\n"
+"with a header udp-recv uses to check it and time it.\n"
+"\n"
 "Options:\n"
+"  -b  datagrams per sendmmsg() call, 64 by default\n"
+"  -c  send count datagrams and print the time per packet\n"
+"  -d  send for this many seconds\n"
+"  -f  text corpus to generate payloads from\n"
+"  -g  UDP_SEGMENT: up to this many datagrams per send buffer\n"
 "  -h  show this message\n"
-"  -n  no UDP checksum\n",
-		argv0);
+"  -n  no UDP checksum\n"
+"  -r  datagrams per second, all threads together\n"
+"  -s  generated payload sizes: N, MIN-MAX (uniform) or imix\n"
+"      (7:4:1 of 64, 548 and 1472 bytes), %d at least\n"
+"  -t  sending threads, each with its own socket\n",
+		argv0, LG_MIN_SIZE);
 	exit(error_code);
 }
 
+static void parse_sizes(const char *spec)
+{
+	char *end;
+
+	conf.generate = true;
+	if (!strcmp(spec, "imix")) {
+		conf.size_kind = SIZE_IMIX;
+		conf.size_min = 64;
+		conf.size_max = 1472;
+		return;
+	}
+	conf.size_min = strtoul(spec, &end, 0);
+	if (*end == '-') {
+		conf.size_kind = SIZE_UNIFORM;
+		conf.size_max = strtoul(end + 1, &end, 0);
+	} else {
+		conf.size_kind = SIZE_FIXED;
+		conf.size_max = conf.size_min;
+	}
+	if (*end || conf.size_min < LG_MIN_SIZE ||
+	    conf.size_max < conf.size_min || conf.size_max > LG_MAX_SIZE)
+		die("Invalid sizes: %s", spec);
+}
+
+static uint64_t next_rand(struct sender *s)
+{
+	s->rand ^= s->rand << 13;
+	s->rand ^= s->rand >> 7;
+	s->rand ^= s->rand << 17;
+
+	return s->rand;
+}
+
+static unsigned int next_size(struct sender *s)
+{
+	static const unsigned int imix[] = {
+		64, 64, 64, 64, 64, 64, 64, 548, 548, 548, 548, 1472,
+	};
+
+	switch (conf.size_kind) {
+	case SIZE_UNIFORM:
+		return conf.size_min +
+		       next_rand(s) % (conf.size_max - conf.size_min + 1);
+	case SIZE_IMIX:
+		return imix[next_rand(s) % (sizeof(imix) / sizeof(imix[0]))];
+	default:
+		return conf.size_min;
+	}
+}
+
+static void fill(struct sender *s, uint8_t *p, unsigned int size,
+		unsigned long long seq, unsigned int seg)
+{
+	struct lg_hdr h = {
+		.seq		= (uint64_t)s->id << 48 | seq,
+		.ts_ns		= lg_now_ns(),
+		.corpus_off	= s->corpus_off,
+		.gso_size	= size,
+		.seg		= seg,
+	};
+
+	lg_fill(p, size, &h, &conf.corpus);
+	s->corpus_off = (s->corpus_off + size - LG_MIN_SIZE) % conf.corpus.len;
+}
+
+/**
+ * Waits for the rate limit and fills in the next batch. Returns the number
+ * of messages, each one datagram or, with -g, a GSO buffer of several.
+ */
+static unsigned int prepare(struct sender *s, struct mmsghdr *msgs,
+		unsigned int *segs, uint64_t t0, unsigned int batch)
+{
+	unsigned long long seq = s->sent;
+	unsigned long long left = s->quota ? s->quota - seq : ~0ULL;
+	unsigned int i, j, n = 0;
+
+	if (conf.rate) {
+		uint64_t due = t0 + seq * 1e9 * conf.threads / conf.rate;
+		struct timespec ts = {
+			.tv_sec		= due / 1000000000,
+			.tv_nsec	= due % 1000000000,
+		};
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR && !stop)
+			;
+	}
+
+	for (i = 0; i < batch && left; i++, n++) {
+		struct iovec *iov = msgs[i].msg_hdr.msg_iov;
+		struct cmsghdr *cm = msgs[i].msg_hdr.msg_control;
+		unsigned int size, nsegs = conf.gso_segs;
+
+		size = conf.generate ? next_size(s) : conf.content_len;
+		if (size && nsegs > LG_MAX_SIZE / size)
+			nsegs = LG_MAX_SIZE / size;
+		if (nsegs > left)
+			nsegs = left;
+		if (conf.generate) {
+			for (j = 0; j < nsegs; j++)
+				fill(s, (uint8_t *)iov->iov_base + j * size,
+				     size, seq + j, j);
+		}
+		seq += nsegs;
+		left -= nsegs;
+		segs[i] = nsegs;
+
+		iov->iov_len = (size_t)nsegs * size;
+		if (nsegs > 1) {
+			msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			*(uint16_t *)CMSG_DATA(cm) = size;
+		} else {
+			msgs[i].msg_hdr.msg_controllen = 0;
+		}
+	}
+
+	return n;
+}
+
+static void *send_loop(void *arg)
+{
+	struct sender *s = arg;
+	unsigned int batch = conf.batch, buf_size, i, n;
+	char (*cmsgs)[CMSG_SPACE(sizeof(uint16_t))];
+	uint64_t t0 = lg_now_ns(), end = 0;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	unsigned int *segs;
+	uint8_t *bufs;
+	int ret;
+
+	/* bursts of no more than about a millisecond */
+	if (conf.rate && batch > conf.rate / conf.threads / 1000)
+		batch = conf.rate / conf.threads / 1000 ? : 1;
+	if (conf.seconds)
+		end = t0 + conf.seconds * 1e9;
+	if (conf.gso_segs > 1)
+		buf_size = LG_MAX_SIZE;
+	else
+		buf_size = conf.generate ? conf.size_max : conf.content_len;
+
+	msgs = calloc(batch, sizeof(*msgs));
+	iov = calloc(batch, sizeof(*iov));
+	cmsgs = calloc(batch, sizeof(*cmsgs));
+	segs = calloc(batch, sizeof(*segs));
+	bufs = malloc((size_t)batch * buf_size);
+	if (!msgs || !iov || !cmsgs || !segs || !bufs)
+		die("OOM");
+	for (i = 0; i < batch; i++) {
+		iov[i].iov_base = bufs + (size_t)i * buf_size;
+		msgs[i].msg_hdr.msg_name = &conf.addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(conf.addr);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = cmsgs[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i]);
+		/* fixed content only has to be written once */
+		for (n = 0; !conf.generate && conf.content_len &&
+			    (n + 1) * conf.content_len <= buf_size; n++)
+			memcpy(bufs + (size_t)i * buf_size +
+			       n * conf.content_len, conf.content,
+			       conf.content_len);
+	}
+
+	while (!stop && (!s->quota || s->sent < s->quota)) {
+		if (end && lg_now_ns() >= end)
+			break;
+		n = prepare(s, msgs, segs, t0, batch);
+		if (stop)
+			break;
+		ret = sendmmsg(s->sock, msgs, n, 0);
+		if (ret < 0) {
+			if (errno == ENOBUFS || errno == EAGAIN ||
+			    errno == EINTR) {
+				s->retries++;
+				continue;
+			}
+			fail("send the UDP message: %s", strerror(errno));
+		}
+		for (i = 0; i < (unsigned int)ret; i++) {
+			s->sent += segs[i];
+			s->bytes += iov[i].iov_len;
+		}
+	}
+
+	free(bufs);
+	free(segs);
+	free(cmsgs);
+	free(iov);
+	free(msgs);
+
+	return NULL;
+}
+
+static void read_content(int argc, char *argv[])
+{
+	char buf[4096], *content = NULL;
+	size_t content_size = 0, content_len = 0, len;
+
+	if (optind + 3 == argc) {
+		conf.content = argv[optind + 2];
+		conf.content_len = strlen(conf.content);
+		return;
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), stdin))) {
+		if (content_len + len > content_size) {
+			size_t new_size;
+
+			new_size = content_len + len;
+			if (new_size < content_size * 2)
+				new_size = content_size * 2;
+			content = realloc(content, new_size);
+			if (!content)
+				die("OOM");
+			content_size = new_size;
+		}
+		memcpy(content + content_len, buf, len);
+		content_len += len;
+	}
+	if (!content)
+		die("No content");
+	if (content_len > LG_MAX_SIZE)
+		die("Content too long: %zu bytes", content_len);
+	conf.content = content;
+	conf.content_len = content_len;
+}
+
 int main(int argc, char *argv[])
 {
-	int sock, port, opt;
-	struct sockaddr_in addr;
-	bool no_check = false;
+	const char *corpus = NULL;
+	unsigned long long sent = 0, bytes = 0, retries = 0;
+	struct sender *senders;
 	struct hostent *he;
-	char *content;
-	int content_len;
+	bool timed = false;
+	unsigned int i;
+	double ns;
+	uint64_t t0;
+	int port, opt;
 
 	/* Parse the command line options */
-	while ((opt = getopt(argc, argv, "hn")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:d:f:g:hnr:s:t:")) != -1) {
 		switch (opt) {
+		case 'b':
+			conf.batch = atoi(optarg);
+			if (conf.batch < 1 || conf.batch > MAX_BATCH)
+				die("Invalid batch: %s", optarg);
+			break;
+		case 'c':
+			conf.count = strtoull(optarg, NULL, 0);
+			if (!conf.count)
+				die("Invalid count: %s", optarg);
+			timed = true;
+			break;
+		case 'd':
+			conf.seconds = atof(optarg);
+			if (conf.seconds <= 0)
+				die("Invalid duration: %s", optarg);
+			timed = true;
+			break;
+		case 'f':
+			corpus = optarg;
+			conf.generate = true;
+			break;
+		case 'g':
+			conf.gso_segs = atoi(optarg);
+			if (conf.gso_segs < 1 || conf.gso_segs > MAX_GSO_SEGS)
+				die("Invalid segment count: %s", optarg);
+			break;
 		case 'h':
 			usage(argv[0], EXIT_SUCCESS);
 			break;
 		case 'n':
-			no_check = true;
+			conf.no_check = true;
+			break;
+		case 'r':
+			conf.rate = atof(optarg);
+			if (conf.rate <= 0)
+				die("Invalid rate: %s", optarg);
+			break;
+		case 's':
+			parse_sizes(optarg);
+			break;
+		case 't':
+			conf.threads = atoi(optarg);
+			if (conf.threads < 1 || conf.threads > MAX_THREADS)
+				die("Invalid thread count: %s", optarg);
 			break;
 		default:
 			usage(argv[0], EXIT_FAILURE);
@@ -65,57 +414,86 @@ int main(int argc, char *argv[])
 	port = atoi(argv[optind + 1]);
 	if (port < 0 || port > 65535)
 		die("Invalid port: %s\n", argv[optind + 1]);
-	if (optind + 3 == argc) {
-		content = strdup(argv[optind + 2]);
-		if (!content)
-			die("OOM");
-		content_len = strlen(content);
+	memset(&conf.addr, 0, sizeof(conf.addr));
+	conf.addr.sin_family = AF_INET;
+	memcpy(&conf.addr.sin_addr, he->h_addr, sizeof(conf.addr.sin_addr));
+	conf.addr.sin_port = htons(port);
+
+	if (conf.generate) {
+		if (optind + 3 == argc)
+			die("Content and generated payloads don't mix");
+		if (!conf.size_min)
+			parse_sizes("1472");
+		if (lg_corpus_load(&conf.corpus, corpus))
+			fail("load the corpus %s", corpus ? : "");
 	} else {
-		char buf[4096];
-		int content_size, len;
-
-		content = NULL;
-		content_len = content_size = 0;
-		while ((len = fread(buf, 1, sizeof(buf), stdin))) {
-			if (content_len + len > content_size) {
-				int new_size;
-
-				new_size = content_len + len;
-				if (new_size < content_size * 2)
-					new_size = content_size * 2;
-				content = realloc(content, new_size);
-				if (!content)
-					die("OOM");
-				content_size = new_size;
-			}
-			memcpy(content + content_len, buf, len);
-			content_len += len;
-		}
-		if (!content)
-			die("No content");
+		read_content(argc, argv);
 	}
+	if (!conf.count && !conf.seconds)
+		conf.count = 1;
+	if (!conf.batch)
+		conf.batch = conf.count && conf.count < 64 ? conf.count : 64;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
 
-	sock = socket(PF_INET, SOCK_DGRAM, 0);
-	if (sock < 0)
-		fail("create the sock");
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	memcpy(&addr.sin_addr, he->h_addr, sizeof(addr.sin_addr));
-	addr.sin_port = htons(port);
+	senders = calloc(conf.threads, sizeof(*senders));
+	if (!senders)
+		die("OOM");
+	for (i = 0; i < conf.threads; i++) {
+		struct sender *s = &senders[i];
 
-	if (no_check) {
-		int ok = 1;
+		s->id = i;
+		s->sock = -1;
+		s->rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+		s->corpus_off = conf.corpus.len ?
+			i * 7919 % conf.corpus.len : 0;
+		/* the first threads take the remainder */
+		if (conf.count)
+			s->quota = conf.count / conf.threads +
+				   (i < conf.count % conf.threads);
+		if (conf.count && !s->quota)
+			continue;
+		s->sock = socket(PF_INET, SOCK_DGRAM, 0);
+		if (s->sock < 0)
+			fail("create the sock");
+		if (conf.no_check) {
+			int ok = 1;
 
-		if (setsockopt(sock, SOL_SOCKET, SO_NO_CHECK, &ok, sizeof(ok)))
-			fail("disable UDP checksum");
+			if (setsockopt(s->sock, SOL_SOCKET, SO_NO_CHECK, &ok,
+				       sizeof(ok)))
+				fail("disable UDP checksum");
+		}
 	}
 
-	if (sendto(sock, content, content_len, 0,
-			(struct sockaddr *)&addr, sizeof(addr)) < 0)
-		fail("send the UDP message");
+	t0 = lg_now_ns();
+	for (i = 0; i < conf.threads; i++) {
+		if (senders[i].sock >= 0 &&
+		    pthread_create(&senders[i].thread, NULL, send_loop,
+				   &senders[i]))
+			fail("start a sending thread");
+	}
+	for (i = 0; i < conf.threads; i++) {
+		if (senders[i].sock < 0)
+			continue;
+		pthread_join(senders[i].thread, NULL);
+		sent += senders[i].sent;
+		bytes += senders[i].bytes;
+		retries += senders[i].retries;
+		close(senders[i].sock);
+	}
+	ns = lg_now_ns() - t0;
+
+	if (timed && sent) {
+		printf("%llu packets in %.3f s, %.1f ns/packet, %.0f pps, "
+		       "%.3f Gbit/s\n", sent, ns / 1e9, ns / sent,
+		       sent / ns * 1e9, bytes * 8 / ns);
+		if (retries)
+			printf("%llu sendmmsg() calls retried on ENOBUFS\n",
+			       retries);
+	}
 
-	free(content);
-	close(sock);
+	free(senders);
 
 	return EXIT_SUCCESS;
 }